@@ -0,0 +1,413 @@
+/*
+ * rowavedt_r.c
+ *
+ *  In-process R interface (.Call) to the fitter; see R/rowavedt.R
+ *
+ *  A context holds the basis matrix and prior, read in place from the R
+ *  objects it keeps alive, and the fit settings. Each fit call takes lists
+ *  of time and value vectors, fits the full and smooth models to every
+ *  series as rowavedt would (fitNuGrid), with worker threads taking series
+ *  in turn, and returns the results as R vectors and arrays. Values are
+ *  read from R memory unless some are missing; times are rescaled into a
+ *  per-thread buffer. Worker threads never call the R API: all results are
+ *  allocated before they start and written by series index.
+ *
+ *  Fits run on worker threads only, even with one thread, so a fatal error
+ *  in the library (checkPtr) never unwinds the R stack from inside a fit:
+ *  the worker keeps the message and ends, and the call raises it as an R
+ *  error once the other workers are done. The worker's buffers are freed;
+ *  memory held by the failed fit itself is not.
+ */
+
+#include "rowavedt.h"
+
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+// Thread that loaded the library, the only one that may call Rf_error
+static pthread_t rMainThread;
+
+// First fatal error on a worker thread in the current fit call, if any
+static pthread_mutex_t rErrorLock = PTHREAD_MUTEX_INITIALIZER;
+static char rErrorMsg[256];
+static int rFailed = 0;
+
+// Basis and prior are owned by R (protected by the external pointer)
+typedef struct {
+  double * basisMat, * priorVec, * nuVec;
+  int basisRows, basisCols, kSmooth, nNu;
+  int maxIter, minObs, interp, repro;
+  double tol, missingCode;
+  char solver;
+} rFitContext;
+
+// One fit call: inputs by series, and the result arrays they fill
+typedef struct {
+  const rFitContext * ctx;
+  int nSeries, next;
+  pthread_mutex_t lock;
+  double ** times, ** values;
+  int * lengths;
+  int * nObs, * iter_m, * iter_l;
+  double * llr, * lpr, * tau_m, * tau_l, * coef_m, * coef_l;
+} rFitJob;
+
+// fatalHandler for the library: on a worker thread, keep the first message
+// for rowavedt_fit and end the thread; an R error on the main thread, which
+// only reaches the library outside fits
+static void rFatal(const char * msg)
+{
+  if (pthread_equal(pthread_self(), rMainThread))
+    Rf_error("%s", msg);
+
+  pthread_mutex_lock(&rErrorLock);
+  if (!rFailed)
+    snprintf(rErrorMsg, sizeof(rErrorMsg), "%s", msg);
+  rFailed = 1;
+  pthread_mutex_unlock(&rErrorLock);
+  pthread_exit(NULL);
+}
+
+static void finalizeContext(SEXP ptr)
+{
+  rFitContext * ctx = (rFitContext *) R_ExternalPtrAddr(ptr);
+
+  if (ctx != NULL)
+  {
+    free(ctx->nuVec);
+    free(ctx);
+    R_ClearExternalPtr(ptr);
+  }
+}
+
+static rFitContext * getContext(SEXP ptr)
+{
+  rFitContext * ctx;
+
+  if (TYPEOF(ptr) != EXTPTRSXP)
+    Rf_error("not a rowavedt context");
+  ctx = (rFitContext *) R_ExternalPtrAddr(ptr);
+  if (ctx == NULL)
+    Rf_error("rowavedt context is no longer valid");
+
+  return ctx;
+}
+
+/*
+ * Create a fit context from a double basis matrix (BASISROWS x BASISCOLS),
+ * prior (BASISCOLS - 1), smooth basis dimension, df (one or more), maximum
+ * EM iterations, tolerance, solver ("e" or "n"), minimum observations,
+ * missing-value code, interpolation flag (as rowavedt -l) and
+ * reproducible-mode flag (as rowavedt -D)
+ */
+SEXP rowavedt_context(SEXP basis, SEXP prior, SEXP smooth, SEXP df,
+    SEXP maxIter, SEXP tol, SEXP solver, SEXP minObs, SEXP missingCode,
+    SEXP interp, SEXP reproducible)
+{
+  SEXP dim, ptr, prot;
+  rFitContext * ctx;
+  int g, k;
+
+  dim = Rf_getAttrib(basis, R_DimSymbol);
+  if (!Rf_isReal(basis) || Rf_length(dim) != 2)
+    Rf_error("basis must be a double matrix");
+  if (!Rf_isReal(prior) || Rf_length(prior) != INTEGER(dim)[1] - 1)
+    Rf_error("prior must be a double vector of length ncol(basis) - 1");
+  if (!Rf_isReal(df) || Rf_length(df) < 1)
+    Rf_error("df must be a double vector");
+  if (!Rf_isString(solver) || Rf_length(solver) != 1 ||
+      (strcmp(CHAR(STRING_ELT(solver, 0)), "e") != 0 &&
+       strcmp(CHAR(STRING_ELT(solver, 0)), "n") != 0))
+    Rf_error("solver must be 'e' or 'n'");
+
+  ctx = calloc(1, sizeof(rFitContext));
+  if (ctx == NULL)
+    Rf_error("out of memory");
+
+  ctx->basisMat = REAL(basis);
+  ctx->priorVec = REAL(prior);
+  ctx->basisRows = INTEGER(dim)[0];
+  ctx->basisCols = INTEGER(dim)[1];
+  ctx->maxIter = Rf_asInteger(maxIter);
+  ctx->tol = Rf_asReal(tol);
+  ctx->solver = CHAR(STRING_ELT(solver, 0))[0];
+  ctx->minObs = Rf_asInteger(minObs);
+  ctx->missingCode = Rf_asReal(missingCode);
+  ctx->interp = Rf_asLogical(interp) == TRUE;
+  ctx->repro = Rf_asLogical(reproducible) == TRUE;
+
+  // Smooth dimension rounded down to a power of 2, as rowavedt -s
+  k = Rf_asInteger(smooth);
+  k = (k < 1) ? 1 : k;
+  ctx->kSmooth = (int) gsl_pow_int(2, (int) trunc(log2(k)));
+  ctx->kSmooth = (ctx->kSmooth > ctx->basisCols) ? ctx->basisCols :
+    ctx->kSmooth;
+
+  // df sorted in increasing order, at least 1, as parseNuList
+  ctx->nNu = Rf_length(df);
+  ctx->nuVec = calloc(ctx->nNu, sizeof(double));
+  if (ctx->nuVec == NULL)
+  {
+    free(ctx);
+    Rf_error("out of memory");
+  }
+  for (g=0; g<ctx->nNu; g++)
+  {
+    ctx->nuVec[g] = (REAL(df)[g] < 1) ? 1 : REAL(df)[g];
+  }
+  qsort(ctx->nuVec, ctx->nNu, sizeof(double), compare_dbl);
+
+  prot = PROTECT(Rf_list2(basis, prior));
+  ptr = PROTECT(R_MakeExternalPtr(ctx, R_NilValue, prot));
+  R_RegisterCFinalizerEx(ptr, finalizeContext, TRUE);
+  UNPROTECT(2);
+
+  return ptr;
+}
+
+// Fit series i of job with workspaces t and y (at least its length);
+// results go to entry i of the job's arrays, NA if too few valid
+// observations
+static void fitSeries(rFitJob * job, int i, double * t, double * y)
+{
+  const rFitContext * ctx = job->ctx;
+  int j, g, n = 0, len = job->lengths[i];
+  int nSeries = job->nSeries, nNu = ctx->nNu;
+  int basisCols = ctx->basisCols, kSmooth = ctx->kSmooth;
+  double * yVec = job->values[i];
+  double minTime = 0, maxTime = 0;
+  nuFit * fits;
+
+  for (j=0; j<len; j++)
+  {
+    if (!isnan(job->times[i][j]) && !isnan(yVec[j]) &&
+        yVec[j] != ctx->missingCode)
+    {
+      t[n++] = job->times[i][j];
+    }
+  }
+
+  // Read values in place unless some were dropped
+  if (n < len)
+  {
+    n = 0;
+    for (j=0; j<len; j++)
+    {
+      if (!isnan(job->times[i][j]) && !isnan(yVec[j]) &&
+          yVec[j] != ctx->missingCode)
+        y[n++] = yVec[j];
+    }
+    yVec = y;
+  }
+  job->nObs[i] = n;
+
+  if (n > 0)
+    arrayMinMax(t, n, &minTime, &maxTime);
+  if (n < ctx->minObs || n == 0 || maxTime == minTime)
+  {
+    for (g=0; g<nNu; g++)
+    {
+      job->llr[i + g*nSeries] = NA_REAL;
+      job->lpr[i + g*nSeries] = NA_REAL;
+      job->tau_m[i + g*nSeries] = NA_REAL;
+      job->tau_l[i + g*nSeries] = NA_REAL;
+      job->iter_m[i + g*nSeries] = NA_INTEGER;
+      job->iter_l[i + g*nSeries] = NA_INTEGER;
+      for (j=0; j<basisCols; j++)
+        job->coef_m[j + basisCols*(g + nNu*i)] = NA_REAL;
+      for (j=0; j<kSmooth; j++)
+        job->coef_l[j + kSmooth*(g + nNu*i)] = NA_REAL;
+    }
+    return;
+  }
+
+  rescaleTimes(t, n, minTime, maxTime, ctx->basisRows);
+
+  fits = allocNuFits(ctx->nuVec, nNu, basisCols, kSmooth);
+  fitNuGrid(ctx->basisMat, NULL, ctx->basisRows, basisCols,
+      yVec, n, t, ctx->priorVec, kSmooth, ctx->maxIter, ctx->tol,
+      ctx->solver, fits, nNu, 0);
+
+  for (g=0; g<nNu; g++)
+  {
+    job->llr[i + g*nSeries] =
+      2 * (fits[g].logLikelihood_m - fits[g].logLikelihood_l);
+    job->lpr[i + g*nSeries] = fits[g].logPosterior_m - fits[g].logPosterior_l;
+    job->tau_m[i + g*nSeries] = fits[g].tau_m;
+    job->tau_l[i + g*nSeries] = fits[g].tau_l;
+    job->iter_m[i + g*nSeries] = fits[g].iter_m;
+    job->iter_l[i + g*nSeries] = fits[g].iter_l;
+    memcpy(&job->coef_m[basisCols*(g + nNu*i)], fits[g].coef_m,
+        basisCols * sizeof(double));
+    memcpy(&job->coef_l[kSmooth*(g + nNu*i)], fits[g].coef_l,
+        kSmooth * sizeof(double));
+  }
+
+  freeNuFits(fits, nNu);
+}
+
+// Take series in turn until none are left
+static void * fitWorker(void * arg)
+{
+  rFitJob * job = (rFitJob *) arg;
+  int i, maxLen = 0;
+
+  for (i=0; i<job->nSeries; i++)
+  {
+    maxLen = (job->lengths[i] > maxLen) ? job->lengths[i] : maxLen;
+  }
+
+  // Freed also if a fatal error ends the thread (see rFatal)
+  double * t, * y;
+  t = calloc(maxLen + 1, sizeof(double));
+  y = calloc(maxLen + 1, sizeof(double));
+  pthread_cleanup_push(free, t);
+  pthread_cleanup_push(free, y);
+  checkPtr(t, "out of memory");
+  checkPtr(y, "out of memory");
+
+  while (1)
+  {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->nSeries)
+      break;
+    fitSeries(job, i, t, y);
+  }
+
+  pthread_cleanup_pop(1);
+  pthread_cleanup_pop(1);
+  return NULL;
+}
+
+/*
+ * Fit each series (times[[i]], values[[i]], double vectors of equal length)
+ * with nThreads threads. Returns a list of n (valid observations), nu, and
+ * llr, lpr, tau, tau.smooth, iter and iter.smooth (series x df) and coef
+ * and coef.smooth (coefficient x df x series); NA for skipped series.
+ * tau is the residual scale parameter itself; rowavedt prints sqrt(tau).
+ */
+SEXP rowavedt_fit(SEXP ptr, SEXP times, SEXP values, SEXP threads)
+{
+  rFitContext * ctx = getContext(ptr);
+  rFitJob job;
+  int i, nThreads, nStarted, nSeries, nNu = ctx->nNu;
+  SEXP result, names, nObs, nu, llr, lpr, tau_m, tau_l, iter_m, iter_l;
+  SEXP coef_m, coef_l;
+  const char * fields[] = {"n", "nu", "llr", "lpr", "tau", "tau.smooth",
+    "iter", "iter.smooth", "coef", "coef.smooth"};
+
+  if (!Rf_isNewList(times) || !Rf_isNewList(values) ||
+      Rf_length(times) != Rf_length(values))
+    Rf_error("times and values must be lists of the same length");
+
+  nSeries = Rf_length(times);
+  nThreads = Rf_asInteger(threads);
+  nThreads = (nThreads > nSeries) ? nSeries : nThreads;
+  nThreads = (nThreads < 1) ? 1 : nThreads;
+
+  job.ctx = ctx;
+  job.nSeries = nSeries;
+  job.next = 0;
+  job.times = (double **) R_alloc(nSeries + 1, sizeof(double *));
+  job.values = (double **) R_alloc(nSeries + 1, sizeof(double *));
+  job.lengths = (int *) R_alloc(nSeries + 1, sizeof(int));
+
+  for (i=0; i<nSeries; i++)
+  {
+    if (!Rf_isReal(VECTOR_ELT(times, i)) ||
+        !Rf_isReal(VECTOR_ELT(values, i)) ||
+        Rf_length(VECTOR_ELT(times, i)) != Rf_length(VECTOR_ELT(values, i)))
+      Rf_error("series %d: times and values must be double vectors of the "
+          "same length", i + 1);
+    job.times[i] = REAL(VECTOR_ELT(times, i));
+    job.values[i] = REAL(VECTOR_ELT(values, i));
+    job.lengths[i] = Rf_length(VECTOR_ELT(times, i));
+  }
+
+  nObs = PROTECT(Rf_allocVector(INTSXP, nSeries));
+  nu = PROTECT(Rf_allocVector(REALSXP, nNu));
+  llr = PROTECT(Rf_allocMatrix(REALSXP, nSeries, nNu));
+  lpr = PROTECT(Rf_allocMatrix(REALSXP, nSeries, nNu));
+  tau_m = PROTECT(Rf_allocMatrix(REALSXP, nSeries, nNu));
+  tau_l = PROTECT(Rf_allocMatrix(REALSXP, nSeries, nNu));
+  iter_m = PROTECT(Rf_allocMatrix(INTSXP, nSeries, nNu));
+  iter_l = PROTECT(Rf_allocMatrix(INTSXP, nSeries, nNu));
+  coef_m = PROTECT(Rf_alloc3DArray(REALSXP, ctx->basisCols, nNu, nSeries));
+  coef_l = PROTECT(Rf_alloc3DArray(REALSXP, ctx->kSmooth, nNu, nSeries));
+
+  memcpy(REAL(nu), ctx->nuVec, nNu * sizeof(double));
+  job.nObs = INTEGER(nObs);
+  job.llr = REAL(llr);
+  job.lpr = REAL(lpr);
+  job.tau_m = REAL(tau_m);
+  job.tau_l = REAL(tau_l);
+  job.iter_m = INTEGER(iter_m);
+  job.iter_l = INTEGER(iter_l);
+  job.coef_m = REAL(coef_m);
+  job.coef_l = REAL(coef_l);
+
+  // Process-wide design and kernel settings (see basisPosition, repro.c)
+  basisInterp = ctx->interp;
+  reproKernels = ctx->repro;
+
+  // Workers only, even for one thread (see rFatal); if a thread cannot be
+  // started, those that did take the remaining series
+  pthread_t workers[nThreads];
+  rFailed = 0;
+  nStarted = 0;
+  pthread_mutex_init(&job.lock, NULL);
+  for (i=0; i<nThreads; i++)
+  {
+    if (pthread_create(&workers[i], NULL, fitWorker, &job) != 0)
+      break;
+    nStarted++;
+  }
+  for (i=0; i<nStarted; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  if (nStarted == 0)
+    Rf_error("could not start a fit thread");
+  if (rFailed)
+    Rf_error("%s", rErrorMsg);
+
+  result = PROTECT(Rf_allocVector(VECSXP, 10));
+  names = PROTECT(Rf_allocVector(STRSXP, 10));
+  SET_VECTOR_ELT(result, 0, nObs);
+  SET_VECTOR_ELT(result, 1, nu);
+  SET_VECTOR_ELT(result, 2, llr);
+  SET_VECTOR_ELT(result, 3, lpr);
+  SET_VECTOR_ELT(result, 4, tau_m);
+  SET_VECTOR_ELT(result, 5, tau_l);
+  SET_VECTOR_ELT(result, 6, iter_m);
+  SET_VECTOR_ELT(result, 7, iter_l);
+  SET_VECTOR_ELT(result, 8, coef_m);
+  SET_VECTOR_ELT(result, 9, coef_l);
+  for (i=0; i<10; i++)
+  {
+    SET_STRING_ELT(names, i, Rf_mkChar(fields[i]));
+  }
+  Rf_setAttrib(result, R_NamesSymbol, names);
+
+  UNPROTECT(12);
+  return result;
+}
+
+static const R_CallMethodDef kCallMethods[] = {
+  {"rowavedt_context", (DL_FUNC) &rowavedt_context, 11},
+  {"rowavedt_fit", (DL_FUNC) &rowavedt_fit, 4},
+  {NULL, NULL, 0}
+};
+
+void R_init_rowavedt_r(DllInfo * info)
+{
+  rMainThread = pthread_self();
+  fatalHandler = rFatal;
+  R_registerRoutines(info, NULL, kCallMethods, NULL, NULL);
+  R_useDynamicSymbols(info, FALSE);
+}
@@ -0,0 +1,627 @@
+/*
+ * bench.c
+ *
+ *  Throughput benchmark for rowavedt code paths
+ */
+
+#include "bench.h"
+
+const char * kBenchHelpMessage = "\nUsage:\trowavedt-bench [options] "
+  "BASISFILE BASISROWS BASISCOLS PRIORFILE\n\t[DATAFILE ...]\n\n"
+  "Fits synthetic light curves (or the given DATAFILEs) with each code path\n"
+  "and writes one JSON object per workload and path to stdout.\n\n"
+  "Options:\n"
+  "-c\tCalibration scaling: also simulate this many null replicates on\n"
+  "\tthe first series of each workload for each thread count in -j.\n"
+  "\tDefaults to 0 (off).\n"
+  "-d\tSet df for t distribution of residuals in the model.\n"
+  "\tDefaults to 5.\n"
+  "-E\tFraction of synthetic series with an injected event.\n"
+  "\tDefaults to 0.2.\n"
+  "-j\tComma-separated thread counts for calibration scaling (-c).\n"
+  "\tThreads fill one NUMA node before the next, so counts of one and\n"
+  "\ttwo nodes' CPUs compare one socket with two. Set ROWAVEDT_NUMA=0\n"
+  "\tto compare against unpinned threads sharing one copy of the design.\n"
+  "\tDefaults to 1.\n"
+  "-g\tFraction of time span in seasonal gaps.\n"
+  "\tDefaults to 0.3.\n"
+  "-m\tNumeric code for missing values.\n"
+  "\tDefaults to 99.999\n"
+  "-M\tFraction of values replaced by the missing code.\n"
+  "\tDefaults to 0.1.\n"
+  "-N\tComma-separated numbers of epochs per synthetic series, one\n"
+  "\tworkload each. Defaults to 256,1024,4096.\n"
+  "-o\tGenerator mode: write the synthetic series to this directory\n"
+  "\tinstead of benchmarking.\n"
+  "-p\tComma-separated code paths to run. Defaults to all of:\n"
+  "\t%s\n"
+  "-s\tSet dimension of smooth (low-resolution) partial basis.\n"
+  "\tDefaults to 8.\n"
+  "-S\tNumber of series per workload.\n"
+  "\tDefaults to 20.\n"
+  "-T\tdf of t noise in synthetic series; 0 for Gaussian noise.\n"
+  "\tDefaults to 3.\n"
+  "-x\tRandom seed.\n"
+  "\tDefaults to 1.\n\n"
+  "Each object reports the workload, series per second, seconds per phase\n"
+  "(read, prepare, fit_full, fit_smooth, output), mean EM iterations per\n"
+  "model, peak RSS of the process running the path, and the mean LLR as a\n"
+  "check that paths agree. Runs with bases of fewer rows show what the\n"
+  "interp path gains over lmT: at equal BASISROWS, its mean LLR is the\n"
+  "closer to that of a fine basis. The repro path over lmT is the cost of\n"
+  "reproducible mode (rowavedt -D). Calibration objects report threads,\n"
+  "NUMA nodes in use, replicates per second and speedup over the first\n"
+  "thread count.\n"
+  "\n";
+
+// Inputs to one fit; times are rescaled and rowVec holds their basis rows
+typedef struct {
+  double * basisMat;
+  float * basisMatF;
+  int basisRows, basisCols;
+  double * priorVec;
+  double nu;
+  int maxIter;
+  double tol;
+  double * yVec, * timeVec;
+  int * rowVec;
+  int n;
+} benchInput;
+
+// Fit one model with k basis columns; returns number of EM iterations
+typedef int (*benchFit)(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau);
+
+typedef struct {
+  const char * name;
+  benchFit fit;
+} benchPath;
+
+typedef struct {
+  double read, prepare, fitFull, fitSmooth, output;
+} benchPhases;
+
+static int fitDense(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  return lmT(in->basisMat, in->basisRows, in->basisCols,
+      in->yVec, in->n, in->timeVec, in->priorVec,
+      in->nu, k, in->maxIter, in->tol,
+      logPosterior, logLikelihood, coef, tau, 0);
+}
+
+static int fitGrouped(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  return lmTGrouped(in->basisMat, in->basisRows, in->basisCols,
+      in->yVec, in->rowVec, in->n, in->priorVec,
+      in->nu, k, in->maxIter, in->tol,
+      logPosterior, logLikelihood, coef, tau, 0);
+}
+
+static int fitMixed(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  return lmTMixed(in->basisMatF, in->basisMat, in->basisRows, in->basisCols,
+      in->yVec, in->n, in->timeVec, in->priorVec,
+      in->nu, k, in->maxIter, in->tol,
+      logPosterior, logLikelihood, coef, tau, 0);
+}
+
+static int fitNewton(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  return lmTNewton(in->basisMat, in->basisRows, in->basisCols,
+      in->yVec, in->n, in->timeVec, in->priorVec,
+      in->nu, k, in->maxIter, in->tol,
+      logPosterior, logLikelihood, coef, tau, 0);
+}
+
+// lmT with design rows interpolated between basis rows (rowavedt -l); each
+// path runs in its own process, so the setting stays with this path
+static int fitInterp(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  basisInterp = 1;
+  return fitDense(in, k, logPosterior, logLikelihood, coef, tau);
+}
+
+// lmT with the fixed-order kernels of reproducible mode (rowavedt -D); its
+// overhead over lmT is the price of bitwise-reproducible results
+static int fitRepro(benchInput * in, int k,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  reproKernels = 1;
+  return fitDense(in, k, logPosterior, logLikelihood, coef, tau);
+}
+
+// Code paths; add new fitters here to benchmark them against the others
+static const benchPath kBenchPaths[] = {
+  {"lmT", fitDense},
+  {"grouped", fitGrouped},
+  {"mixed", fitMixed},
+  {"newton", fitNewton},
+  {"interp", fitInterp},
+  {"repro", fitRepro},
+};
+static const int kNumBenchPaths = sizeof(kBenchPaths) / sizeof(benchPath);
+
+static double wallTime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+ * Process each file as rowavedt does, timing each phase, and print a JSON
+ * object with the results. Runs in a forked child so that peak RSS is
+ * specific to the path.
+ */
+static void runPath(const benchPath * path, char ** files, int nFiles,
+    const char * workload,
+    double * basisMat, float * basisMatF, int basisRows, int basisCols,
+    double * priorVec,
+    double nu, int kSmooth, double missingCode)
+{
+  const int startRows = 1024;
+  const int maxIter = 1e3;
+  const double tol = 1e-9;
+  benchPhases phases = {0, 0, 0, 0, 0};
+  benchInput in;
+  double start, total, llrSum = 0;
+  double logPosterior_m, logLikelihood_m, tau_m;
+  double logPosterior_l, logLikelihood_l, tau_l;
+  long iterFull = 0, iterSmooth = 0;
+  int f, i, nRead, nFit = 0;
+  struct rusage usage;
+
+  FILE * devNull = fopen("/dev/null", "w");
+  checkPtr(devNull, "/dev/null");
+
+  double * coef_m = malloc(basisCols * sizeof(double));
+  checkPtr(coef_m, "out of memory");
+  double * coef_l = malloc(kSmooth * sizeof(double));
+  checkPtr(coef_l, "out of memory");
+
+  in.basisMat = basisMat;
+  in.basisMatF = basisMatF;
+  in.basisRows = basisRows;
+  in.basisCols = basisCols;
+  in.priorVec = priorVec;
+  in.nu = nu;
+  in.maxIter = maxIter;
+  in.tol = tol;
+
+  total = wallTime();
+  for (f=0; f<nFiles; f++)
+  {
+    // Read times and values
+    start = wallTime();
+    in.timeVec = malloc(startRows * sizeof(double));
+    checkPtr(in.timeVec, "out of memory");
+    in.yVec = malloc(startRows * sizeof(double));
+    checkPtr(in.yVec, "out of memory");
+    nRead = readToDoubleVectorDynamic(files[f], startRows, 0, &in.timeVec);
+    readToDoubleVectorDynamic(files[f], startRows, 1, &in.yVec);
+    phases.read += wallTime() - start;
+
+    // Drop missing values, rescale times and find basis rows
+    start = wallTime();
+    in.n = 0;
+    for (i=0; i<nRead; i++)
+    {
+      if (in.yVec[i] != missingCode)
+      {
+        in.yVec[in.n] = in.yVec[i];
+        in.timeVec[in.n] = in.timeVec[i];
+        in.n++;
+      }
+    }
+
+    double minTime, maxTime;
+    arrayMinMax(in.timeVec, in.n, &minTime, &maxTime);
+    rescaleTimes(in.timeVec, in.n, minTime, maxTime, basisRows);
+
+    in.rowVec = malloc(in.n * sizeof(int));
+    checkPtr(in.rowVec, "out of memory");
+    for (i=0; i<in.n; i++)
+    {
+      in.rowVec[i] = (int) floor(in.timeVec[i] + 0.5);
+    }
+    phases.prepare += wallTime() - start;
+
+    // Fit models
+    start = wallTime();
+    iterFull += path->fit(&in, basisCols,
+        &logPosterior_m, &logLikelihood_m, coef_m, &tau_m);
+    phases.fitFull += wallTime() - start;
+
+    start = wallTime();
+    iterSmooth += path->fit(&in, kSmooth,
+        &logPosterior_l, &logLikelihood_l, coef_l, &tau_l);
+    phases.fitSmooth += wallTime() - start;
+
+    // Format output
+    start = wallTime();
+    writeResult(devNull, files[f], in.n, basisCols, kSmooth, nu,
+        2 * (logLikelihood_m - logLikelihood_l),
+        logPosterior_m - logPosterior_l, tau_m, coef_m);
+    phases.output += wallTime() - start;
+
+    llrSum += 2 * (logLikelihood_m - logLikelihood_l);
+    nFit++;
+
+    free(in.timeVec);
+    free(in.yVec);
+    free(in.rowVec);
+  }
+  total = wallTime() - total;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(stdout, "{\"path\": \"%s\", \"workload\": {%s}, "
+      "\"series\": %d, \"seconds\": %.6f, \"series_per_sec\": %.3f, "
+      "\"phase_seconds\": {\"read\": %.6f, \"prepare\": %.6f, "
+      "\"fit_full\": %.6f, \"fit_smooth\": %.6f, \"output\": %.6f}, "
+      "\"em_iter\": {\"full\": %.2f, \"smooth\": %.2f}, "
+      "\"peak_rss_kb\": %ld, \"mean_llr\": %.10g}\n",
+      path->name, workload, nFit, total, nFit / total,
+      phases.read, phases.prepare, phases.fitFull, phases.fitSmooth,
+      phases.output,
+      (double) iterFull / nFit, (double) iterSmooth / nFit,
+      usage.ru_maxrss, llrSum / nFit);
+  fflush(stdout);
+
+  fclose(devNull);
+  free(coef_m);
+  free(coef_l);
+}
+
+/*
+ * Time calibrateNull on one series for each thread count, printing a JSON
+ * object per count
+ */
+static void runCalibration(const char * file, const char * workload,
+    double * basisMat, int basisRows, int basisCols, double * priorVec,
+    double nu, int kSmooth, double missingCode, int nRep,
+    char ** threadList, int nThreadCounts)
+{
+  const int startRows = 1024;
+  const int maxIter = 1e3;
+  const double tol = 1e-9;
+  double * timeVec, * yVec, * llrNull, minTime, maxTime;
+  double start, seconds, base = 0;
+  int i, t, n = 0, nRead, nThreads, nNodes;
+  numaTopology topo;
+
+  timeVec = malloc(startRows * sizeof(double));
+  checkPtr(timeVec, "out of memory");
+  yVec = malloc(startRows * sizeof(double));
+  checkPtr(yVec, "out of memory");
+  nRead = readToDoubleVectorDynamic(file, startRows, 0, &timeVec);
+  readToDoubleVectorDynamic(file, startRows, 1, &yVec);
+  for (i=0; i<nRead; i++)
+  {
+    if (yVec[i] != missingCode)
+    {
+      yVec[n] = yVec[i];
+      timeVec[n] = timeVec[i];
+      n++;
+    }
+  }
+  arrayMinMax(timeVec, n, &minTime, &maxTime);
+  rescaleTimes(timeVec, n, minTime, maxTime, basisRows);
+
+  llrNull = malloc(nRep * sizeof(double));
+  checkPtr(llrNull, "out of memory");
+
+  readNumaTopology(&topo);
+
+  for (t=0; t<nThreadCounts; t++)
+  {
+    nThreads = atoi(threadList[t]);
+    nThreads = (nThreads < 1) ? 1 : nThreads;
+
+    // Nodes used by compact placement of nThreads threads
+    nNodes = 1;
+    for (i=0; i<nThreads && topo.nNodes > 1; i++)
+    {
+      if (numaThreadNode(&topo, i) + 1 > nNodes)
+        nNodes = numaThreadNode(&topo, i) + 1;
+    }
+
+    start = wallTime();
+    calibrateNull(basisMat, basisRows, basisCols, yVec, n, timeVec,
+        priorVec, nu, kSmooth, maxIter, tol, 't', nRep, nThreads, 1,
+        llrNull);
+    seconds = wallTime() - start;
+    base = (t == 0) ? seconds : base;
+
+    fprintf(stdout, "{\"path\": \"calibrate\", \"workload\": {%s}, "
+        "\"threads\": %d, \"numa_nodes\": %d, \"replicates\": %d, "
+        "\"seconds\": %.6f, \"replicates_per_sec\": %.3f, "
+        "\"speedup\": %.3f}\n",
+        workload, nThreads, nNodes, nRep, seconds, nRep / seconds,
+        base / seconds);
+    fflush(stdout);
+  }
+
+  freeNumaTopology(&topo);
+  free(llrNull);
+  free(timeVec);
+  free(yVec);
+}
+
+// Split comma-separated list in place; returns number of entries
+static int splitList(char * list, char ** entries, int maxEntries)
+{
+  int n = 0;
+  char * buf = strtok(list, ",");
+  while (buf != NULL && n < maxEntries)
+  {
+    entries[n++] = buf;
+    buf = strtok(NULL, ",");
+  }
+  return n;
+}
+
+int main(int argc, char * argv[]) {
+  // Define constants
+  const int nArgs = 4;
+  const int maxList = 64;
+
+  // Process arguments
+  int c, i, j, w;
+  extern char *optarg;
+  char * basisFile, * priorFile, * outDir = NULL;
+  char nList[256] = "256,1024,4096", pathList[256] = "";
+  char threadList[256] = "1";
+  int kSmooth = 8, nSeries = 20, nRep = 0;
+  int basisRows, basisCols;
+  double nu = 5, missingCode = 99.999;
+  unsigned long seed = 1;
+  synthParams params = {0, 1000, 0.3, 0.1, 99.999, 3, 0.2};
+
+  // Parse options
+  while ( (c=getopt(argc, argv, "c:d:E:g:j:m:M:N:o:p:s:S:T:x:h")) != -1 ) {
+    switch(c) {
+      case 'h':
+        {
+          char names[256] = "";
+          for (i=0; i<kNumBenchPaths; i++)
+          {
+            strcat(names, kBenchPaths[i].name);
+            if (i < kNumBenchPaths-1) strcat(names, ",");
+          }
+          printf(kBenchHelpMessage, names);
+        }
+        return 0;
+      case 'c':
+        nRep = atoi(optarg);
+        break;
+      case 'd':
+        nu = atof(optarg);
+        nu = (nu < 1) ? 1 : nu;
+        break;
+      case 'E':
+        params.eventFrac = atof(optarg);
+        break;
+      case 'g':
+        params.gapFrac = atof(optarg);
+        break;
+      case 'j':
+        strncpy(threadList, optarg, sizeof(threadList)-1);
+        break;
+      case 'm':
+        missingCode = atof(optarg);
+        params.missingCode = missingCode;
+        break;
+      case 'M':
+        params.missingFrac = atof(optarg);
+        break;
+      case 'N':
+        strncpy(nList, optarg, sizeof(nList)-1);
+        break;
+      case 'o':
+        outDir = optarg;
+        break;
+      case 'p':
+        strncpy(pathList, optarg, sizeof(pathList)-1);
+        break;
+      case 's':
+        kSmooth = atoi(optarg);
+        break;
+      case 'S':
+        nSeries = atoi(optarg);
+        break;
+      case 'T':
+        params.noiseDf = atof(optarg);
+        break;
+      case 'x':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Unknown argument; see -h\n");
+        exit(1);
+    }
+  }
+
+  // Parse positional arguments
+  if (argc-optind < nArgs) {
+    fprintf(stderr, "Not enough arguments\n");
+    exit(1);
+  }
+
+  basisFile = argv[optind];
+  basisRows = atoi( argv[optind+1] );
+  basisCols = atoi( argv[optind+2] );
+  priorFile = argv[optind+3];
+
+  // Select paths
+  const benchPath * paths[kNumBenchPaths];
+  int nPaths = 0;
+  if (pathList[0] == '\0')
+  {
+    for (i=0; i<kNumBenchPaths; i++) paths[nPaths++] = &kBenchPaths[i];
+  }
+  else
+  {
+    char * names[maxList];
+    int nNames = splitList(pathList, names, maxList);
+    for (j=0; j<nNames; j++)
+    {
+      for (i=0; i<kNumBenchPaths; i++)
+      {
+        if (strcmp(names[j], kBenchPaths[i].name) == 0 &&
+            nPaths < kNumBenchPaths)
+        {
+          paths[nPaths++] = &kBenchPaths[i];
+          break;
+        }
+      }
+      if (i == kNumBenchPaths)
+      {
+        fprintf(stderr, "Error -- unknown path %s\n", names[j]);
+        exit(1);
+      }
+    }
+  }
+
+  // Read basis and prior
+  double * basisMat, * priorVec;
+  basisMat = malloc(basisCols * basisRows * sizeof(double));
+  checkPtr(basisMat, "out of memory");
+  readToDoubleMatrix(basisFile, basisRows, basisCols, basisMat);
+
+  float * basisMatF;
+  basisMatF = malloc(basisCols * basisRows * sizeof(float));
+  checkPtr(basisMatF, "out of memory");
+  for (i=0; i<basisCols*basisRows; i++)
+  {
+    basisMatF[i] = (float) basisMat[i];
+  }
+
+  priorVec = malloc((basisCols-1) * sizeof(double));
+  checkPtr(priorVec, "out of memory");
+  readToDoubleVector(priorFile, basisCols-1, 0, priorVec);
+
+  char * threadEntries[maxList];
+  int nThreadCounts = splitList(threadList, threadEntries, maxList);
+
+  // Build workloads: given files, or synthetic series written to a directory
+  char * nEntries[maxList];
+  int nWorkloads = 1;
+  char tmpTemplate[] = "/tmp/rowavedt-bench-XXXXXX";
+  char * dir = outDir;
+
+  if (argc-optind == nArgs)
+  {
+    nWorkloads = splitList(nList, nEntries, maxList);
+    if (dir == NULL)
+    {
+      dir = mkdtemp(tmpTemplate);
+      checkPtr(dir, "could not create temporary directory");
+    }
+  }
+
+  gsl_rng * rng = gsl_rng_alloc(gsl_rng_mt19937);
+  gsl_rng_set(rng, seed);
+
+  for (w=0; w<nWorkloads; w++)
+  {
+    char workload[512];
+    char ** files;
+    int nFiles;
+
+    if (argc-optind > nArgs)
+    {
+      files = &argv[optind + nArgs];
+      nFiles = argc - optind - nArgs;
+      snprintf(workload, sizeof(workload), "\"files\": %d", nFiles);
+    }
+    else
+    {
+      params.n = atoi(nEntries[w]);
+      nFiles = nSeries;
+      files = malloc(nFiles * sizeof(char *));
+      checkPtr(files, "out of memory");
+
+      double * timeVec = malloc(params.n * sizeof(double));
+      checkPtr(timeVec, "out of memory");
+      double * yVec = malloc(params.n * sizeof(double));
+      checkPtr(yVec, "out of memory");
+
+      for (i=0; i<nFiles; i++)
+      {
+        files[i] = malloc(strlen(dir) + 32);
+        checkPtr(files[i], "out of memory");
+        sprintf(files[i], "%s/synth_%d_%d.dat", dir, params.n, i);
+        synthSeries(rng, &params, timeVec, yVec);
+        writeSeriesFile(files[i], timeVec, yVec, params.n);
+      }
+
+      free(timeVec);
+      free(yVec);
+
+      snprintf(workload, sizeof(workload), "\"n\": %d, \"gap_frac\": %g, "
+          "\"missing_frac\": %g, \"noise_df\": %g, \"event_frac\": %g",
+          params.n, params.gapFrac, params.missingFrac, params.noiseDf,
+          params.eventFrac);
+    }
+
+    // Run each path in its own process
+    for (j=0; outDir == NULL && j<nPaths; j++)
+    {
+      pid_t pid;
+      fflush(stdout);
+      pid = fork();
+      if (pid < 0)
+      {
+        fprintf(stderr, "Error -- could not fork\n");
+        exit(1);
+      }
+      if (pid == 0)
+      {
+        runPath(paths[j], files, nFiles, workload,
+            basisMat, basisMatF, basisRows, basisCols, priorVec,
+            nu, kSmooth, missingCode);
+        _exit(0);
+      }
+      waitpid(pid, NULL, 0);
+    }
+
+    if (outDir == NULL && nRep > 0)
+    {
+      runCalibration(files[0], workload, basisMat, basisRows, basisCols,
+          priorVec, nu, kSmooth, missingCode, nRep,
+          threadEntries, nThreadCounts);
+    }
+
+    if (argc-optind == nArgs)
+    {
+      for (i=0; i<nFiles; i++)
+      {
+        if (outDir == NULL) unlink(files[i]);
+        free(files[i]);
+      }
+      free(files);
+    }
+  }
+
+  if (outDir == NULL && dir != NULL) rmdir(dir);
+
+  gsl_rng_free(rng);
+  free(basisMat);
+  free(basisMatF);
+  free(priorVec);
+
+  return 0;
+}
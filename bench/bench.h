@@ -0,0 +1,33 @@
+/*
+ * bench.h
+ *
+ *  Benchmark harness and synthetic light curve generator
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "rowavedt.h"
+
+// synth.c
+typedef struct {
+  int n;               // Number of epochs, including missing ones
+  double span;         // Time span of series
+  double gapFrac;      // Fraction of span removed in seasonal gaps
+  double missingFrac;  // Fraction of values replaced by missingCode
+  double missingCode;
+  double noiseDf;      // df of t noise; 0 for Gaussian noise
+  double eventFrac;    // Fraction of series with an injected event
+} synthParams;
+
+void synthSeries(gsl_rng * rng, const synthParams * params,
+    double * timeVec, double * yVec);
+void writeSeriesFile(const char * fname, double * timeVec, double * yVec,
+    int n);
+
+#endif /* BENCH_H_ */
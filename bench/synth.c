@@ -0,0 +1,94 @@
+/*
+ * synth.c
+ *
+ *  Synthetic light curves for benchmarks
+ */
+
+#include "bench.h"
+
+const int kSynthGaps = 3;
+const double kSynthNoiseScale = 1;
+const double kSynthEventAmplitude = 8;
+const double kSynthEventWidth = 0.005;
+
+/*
+ * Draw one light curve with params->n epochs
+ *
+ * Times are sorted uniform draws over the span with kSynthGaps equally spaced
+ * seasonal gaps covering gapFrac of it. Values are a slow sinusoid plus t
+ * (or Gaussian) noise; a fraction eventFrac of series also get a Gaussian
+ * bump of width kSynthEventWidth of the span, and a fraction missingFrac of
+ * values are replaced by missingCode, as in data/yMissing.dat.
+ */
+void synthSeries(gsl_rng * rng, const synthParams * params,
+    double * timeVec, double * yVec)
+{
+  int i, gap;
+  double available, gapLength, period, amplitude, eventTime = 0, z;
+  int hasEvent;
+
+  available = params->span * (1 - params->gapFrac);
+  gapLength = params->span * params->gapFrac / kSynthGaps;
+
+  // Times on available span, then shifted past preceding gaps
+  for (i=0; i<params->n; i++)
+  {
+    timeVec[i] = gsl_rng_uniform(rng) * available;
+  }
+  qsort(timeVec, params->n, sizeof(double), compare_dbl);
+
+  for (i=0; i<params->n; i++)
+  {
+    gap = (int) floor(timeVec[i] / available * (kSynthGaps + 1));
+    gap = (gap > kSynthGaps) ? kSynthGaps : gap;
+    timeVec[i] += gap * gapLength;
+  }
+
+  // Baseline variability and optional event
+  period = params->span * (0.2 + gsl_rng_uniform(rng));
+  amplitude = gsl_rng_uniform(rng);
+  hasEvent = gsl_rng_uniform(rng) < params->eventFrac;
+  if (hasEvent)
+  {
+    eventTime = timeVec[gsl_rng_uniform_int(rng, params->n)];
+  }
+
+  for (i=0; i<params->n; i++)
+  {
+    yVec[i] = amplitude * sin(2 * M_PI * timeVec[i] / period);
+
+    if (hasEvent)
+    {
+      z = (timeVec[i] - eventTime) / (kSynthEventWidth * params->span);
+      yVec[i] += kSynthEventAmplitude * exp(-0.5 * z * z);
+    }
+
+    if (params->noiseDf > 0)
+      yVec[i] += kSynthNoiseScale * gsl_ran_tdist(rng, params->noiseDf);
+    else
+      yVec[i] += gsl_ran_gaussian(rng, kSynthNoiseScale);
+
+    if (gsl_rng_uniform(rng) < params->missingFrac)
+    {
+      yVec[i] = params->missingCode;
+    }
+  }
+}
+
+// Write series as space-delimited time and value columns
+void writeSeriesFile(const char * fname, double * timeVec, double * yVec,
+    int n)
+{
+  FILE * outfile;
+  int i;
+
+  outfile = fopen(fname, "w");
+  checkPtr(outfile, fname);
+
+  for (i=0; i<n; i++)
+  {
+    fprintf(outfile, "%.15g %.15g\n", timeVec[i], yVec[i]);
+  }
+
+  fclose(outfile);
+}
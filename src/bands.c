@@ -0,0 +1,246 @@
+/*
+ * bands.c
+ *
+ *  Fits of several value columns (bands) observed on one time axis
+ *
+ *  The data file is read once for the time column and every band. Bands
+ *  whose valid epochs (values other than their missing code) coincide share
+ *  the rescaled times, the designs and the unit-weight factorization that
+ *  starts each fit (fitNuGridBands); bands with other valid epochs are
+ *  fitted as separate groups. Results are written per band in the order the
+ *  columns were given, the ID of each followed by ':' and its column.
+ */
+
+#include "rowavedt.h"
+
+/*
+ * Parse a comma-separated list of integers (e.g. "1,3,5") into a vector
+ * Returns the number of values; caller frees (*vec)
+ */
+int parseIntList(const char * list, int ** vec)
+{
+  int n = 1, i;
+  const char * pos;
+  char * end;
+
+  for (pos=list; *pos != '\0'; pos++)
+  {
+    if (*pos == ',') n++;
+  }
+
+  int * v;
+  v = calloc(n, sizeof(int));
+  checkPtr(v, "out of memory");
+
+  pos = list;
+  for (i=0; i<n; i++)
+  {
+    v[i] = (int) strtol(pos, &end, 10);
+    if (end == pos || (*end != ',' && *end != '\0'))
+    {
+      fprintf(stderr, "Error -- invalid list '%s'\n", list);
+      exit(1);
+    }
+    pos = end + 1;
+  }
+
+  (*vec) = v;
+  return n;
+}
+
+// As parseIntList for a list of real numbers (e.g. missing codes)
+int parseDoubleList(const char * list, double ** vec)
+{
+  int n = 1, i;
+  const char * pos;
+  char * end;
+
+  for (pos=list; *pos != '\0'; pos++)
+  {
+    if (*pos == ',') n++;
+  }
+
+  double * v;
+  v = calloc(n, sizeof(double));
+  checkPtr(v, "out of memory");
+
+  pos = list;
+  for (i=0; i<n; i++)
+  {
+    v[i] = strtod(pos, &end);
+    if (end == pos || (*end != ',' && *end != '\0'))
+    {
+      fprintf(stderr, "Error -- invalid list '%s'\n", list);
+      exit(1);
+    }
+    pos = end + 1;
+  }
+
+  (*vec) = v;
+  return n;
+}
+
+/*
+ * Fit bands valueCols[0..nBands-1] of dataFile, with missing codes
+ * missingCodes[b], and write their results to stdout
+ * Bands with fewer than cfg->minObs valid values are skipped with a
+ * warning. Returns 0, or 1 if every band was skipped.
+ */
+int runBands(const fitConfig * cfg, const char * dataFile, int dataRows,
+    const char * idString, const int * valueCols, const double * missingCodes,
+    int nBands)
+{
+  int nCols = nBands + 1, nRows, nFit = 0;
+  int i, b, c, g, n, nGroup;
+  double minTime, maxTime;
+  char bandId[PATH_MAX];
+
+  // Time column first, then the bands
+  int * cols;
+  cols = calloc(nCols, sizeof(int));
+  checkPtr(cols, "out of memory");
+  cols[0] = cfg->timeCol;
+  memcpy(&cols[1], valueCols, nBands * sizeof(int));
+
+  double * rows;
+  rows = malloc(((dataRows < 1) ? 1 : dataRows) * nCols * sizeof(double));
+  checkPtr(rows, "out of memory");
+  nRows = readToDoubleColumnsDynamic(dataFile, (dataRows < 1) ? 1 : dataRows,
+      cols, nCols, &rows);
+
+  if (nRows == 0 || isnan(rows[0]))
+  {
+    fprintf(stderr, "Error -- NaN at first time; aborting\n");
+    exit(1);
+  }
+
+  // Group of each band: its first band with the same valid epochs
+  int * group, * valid;
+  group = malloc(nBands * sizeof(int));
+  checkPtr(group, "out of memory");
+  valid = malloc(nRows * sizeof(int));
+  checkPtr(valid, "out of memory");
+
+  double * timeVec, * yMat;
+  timeVec = malloc(nRows * sizeof(double));
+  checkPtr(timeVec, "out of memory");
+  yMat = malloc(nRows * nBands * sizeof(double));
+  checkPtr(yMat, "out of memory");
+
+  nuFit ** fits;
+  fits = calloc(nBands, sizeof(nuFit *));
+  checkPtr(fits, "out of memory");
+  int * nObs;
+  nObs = calloc(nBands, sizeof(int));
+  checkPtr(nObs, "out of memory");
+
+  for (b=0; b<nBands; b++)
+  {
+    group[b] = b;
+    for (c=0; c<b; c++)
+    {
+      for (i=0; i<nRows; i++)
+      {
+        if ((rows[i*nCols + 1+b] != missingCodes[b]) !=
+            (rows[i*nCols + 1+c] != missingCodes[c]))
+          break;
+      }
+      if (i == nRows)
+      {
+        group[b] = group[c];
+        break;
+      }
+    }
+  }
+
+  for (g=0; g<nBands; g++)
+  {
+    if (group[g] != g)
+      continue;
+
+    // Valid epochs of the group
+    n = 0;
+    for (i=0; i<nRows; i++)
+    {
+      if (rows[i*nCols + 1+g] != missingCodes[g])
+      {
+        valid[n] = i;
+        timeVec[n] = rows[i*nCols];
+        n++;
+      }
+    }
+
+    // Bands of the group, as columns of yMat
+    nGroup = 0;
+    for (b=g; b<nBands; b++)
+    {
+      if (group[b] != g)
+        continue;
+      if (n < cfg->minObs)
+      {
+        fprintf(stderr, "Warning -- read %d obs in column %d, minimum to "
+            "process is %d; skipping\n", n, valueCols[b], cfg->minObs);
+        continue;
+      }
+      for (i=0; i<n; i++)
+      {
+        yMat[nGroup*n + i] = rows[valid[i]*nCols + 1+b];
+      }
+      fits[b] = allocNuFits(cfg->nuVec, cfg->nNu, cfg->basisCols,
+          cfg->kSmooth);
+      nObs[b] = n;
+      nGroup++;
+    }
+    if (nGroup == 0)
+      continue;
+
+    arrayMinMax(timeVec, n, &minTime, &maxTime);
+    rescaleTimes(timeVec, n, minTime, maxTime, cfg->basisRows);
+
+    // Fits of the group's bands, in band order
+    nuFit * groupFits[nGroup];
+    nGroup = 0;
+    for (b=g; b<nBands; b++)
+    {
+      if (group[b] == g && fits[b] != NULL)
+        groupFits[nGroup++] = fits[b];
+    }
+
+    fitNuGridBands(cfg->basisMat, cfg->basisMatF, cfg->basisRows,
+        cfg->basisCols, yMat, n, nGroup, timeVec, cfg->priorVec,
+        cfg->kSmooth, cfg->maxIter, cfg->tol, cfg->solver,
+        groupFits, cfg->nNu);
+    nFit += nGroup;
+
+    nGroup = 0;
+    for (b=g; b<nBands; b++)
+    {
+      if (group[b] != g || fits[b] == NULL)
+        continue;
+      snprintf(bandId, sizeof(bandId), "%s:%d", idString, valueCols[b]);
+      verifySeries(cfg, bandId, &yMat[nGroup * n], n, timeVec, fits[b]);
+      nGroup++;
+    }
+  }
+
+  for (b=0; b<nBands; b++)
+  {
+    if (fits[b] == NULL)
+      continue;
+    snprintf(bandId, sizeof(bandId), "%s:%d", idString, valueCols[b]);
+    writeNuFits(stdout, bandId, nObs[b], cfg->basisCols, cfg->kSmooth,
+        fits[b], cfg->nNu, cfg->profileNu);
+    freeNuFits(fits[b], cfg->nNu);
+  }
+
+  free(cols);
+  free(rows);
+  free(group);
+  free(valid);
+  free(timeVec);
+  free(yMat);
+  free(fits);
+  free(nObs);
+
+  return (nFit == 0);
+}
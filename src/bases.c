@@ -0,0 +1,302 @@
+/*
+ * bases.c
+ *
+ *  Fits of each series against several bases
+ *
+ *  BASISFILE may list several bases (e.g. of different filter families or
+ *  smoothness, from scripts/mk_wavelet_basis.R), each with its own prior
+ *  and dimensions. Every series is then read, parsed and normalized to the
+ *  unit interval once, and fitted against each basis in turn, its times
+ *  scaled to that basis's grid; the records of basis N (base 0) carry the
+ *  ID followed by ":bN". One fitConfig per basis holds its basis, prior and
+ *  dimensions; all other settings are shared.
+ */
+
+#include "rowavedt.h"
+
+// Read basis matrix and prior, with a single-precision copy of the basis
+// for mixed-precision fits if requested
+void readModelInputs(const char * basisFile, int basisRows,
+    int basisCols, const char * priorFile, short mixedPrecision,
+    double ** basisMat, float ** basisMatF, double ** priorVec)
+{
+  int i;
+  double * basis, * prior;
+  float * basisF = NULL;
+
+  // Read basis to allocated matrix
+  basis = calloc(basisCols * basisRows, sizeof(double));
+  checkPtr(basis, "out of memory");
+
+  readToDoubleMatrix(basisFile, basisRows, basisCols, basis);
+
+  // Single-precision copy of basis for mixed-precision fits
+  if (mixedPrecision)
+  {
+    basisF = calloc(basisCols * basisRows, sizeof(float));
+    checkPtr(basisF, "out of memory");
+    for (i=0; i<basisCols*basisRows; i++)
+    {
+      basisF[i] = (float) basis[i];
+    }
+  }
+
+  // Read prior to vector
+  prior = calloc(basisCols-1, sizeof(double));
+  checkPtr(prior, "out of memory");
+  readToDoubleVector(priorFile, basisCols-1, 0, prior);
+
+  (*basisMat) = basis;
+  (*basisMatF) = basisF;
+  (*priorVec) = prior;
+}
+
+/*
+ * Split a comma-separated list of file names into (*items), pointers into
+ * (*buffer), a copy of list. Returns the number of names; caller frees both
+ */
+static int splitFileList(const char * list, char *** items, char ** buffer)
+{
+  int n = 1, i;
+  char * pos;
+
+  (*buffer) = strdup(list);
+  checkPtr(*buffer, "out of memory");
+  for (pos=(*buffer); *pos != '\0'; pos++)
+  {
+    if (*pos == ',') n++;
+  }
+
+  (*items) = calloc(n, sizeof(char *));
+  checkPtr(*items, "out of memory");
+
+  pos = (*buffer);
+  for (i=0; i<n; i++)
+  {
+    (*items)[i] = pos;
+    pos = strchr(pos, ',');
+    if (pos != NULL) *pos++ = '\0';
+  }
+
+  return n;
+}
+
+/*
+ * Set up one configuration per basis of basisFiles, a comma-separated list.
+ * rowsList, colsList and priorFiles give one entry for all bases or one per
+ * basis. Each configuration copies cfg with its basis dimensions, basis and
+ * prior (readModelInputs) and its tag "bN", and kSmooth at most its
+ * columns. Returns the number of bases; free with freeBases
+ */
+int setupBases(const fitConfig * cfg, const char * basisFiles,
+    const char * rowsList, const char * colsList, const char * priorFiles,
+    fitConfig ** cfgs)
+{
+  char ** basisNames, ** priorNames, * basisBuffer, * priorBuffer;
+  int * rows, * cols;
+  int nBases, nRows, nCols, nPriors, b;
+  fitConfig * bases;
+
+  nBases = splitFileList(basisFiles, &basisNames, &basisBuffer);
+  nPriors = splitFileList(priorFiles, &priorNames, &priorBuffer);
+  nRows = parseIntList(rowsList, &rows);
+  nCols = parseIntList(colsList, &cols);
+
+  if ((nRows != 1 && nRows != nBases) || (nCols != 1 && nCols != nBases) ||
+      (nPriors != 1 && nPriors != nBases))
+  {
+    fprintf(stderr, "Error -- give one BASISROWS, BASISCOLS and PRIORFILE, "
+        "or one per basis\n");
+    exit(1);
+  }
+
+  bases = calloc(nBases, sizeof(fitConfig));
+  checkPtr(bases, "out of memory");
+
+  for (b=0; b<nBases; b++)
+  {
+    bases[b] = (*cfg);
+    bases[b].basisRows = rows[(nRows > 1) ? b : 0];
+    bases[b].basisCols = cols[(nCols > 1) ? b : 0];
+    bases[b].kSmooth = (cfg->kSmooth > bases[b].basisCols) ?
+      bases[b].basisCols : cfg->kSmooth;
+
+    readModelInputs(basisNames[b], bases[b].basisRows, bases[b].basisCols,
+        priorNames[(nPriors > 1) ? b : 0], cfg->mixedPrecision,
+        &bases[b].basisMat, &bases[b].basisMatF, &bases[b].priorVec);
+    bases[b].cacheSeed = fitCacheSeed(&bases[b], basisNames[b],
+        priorNames[(nPriors > 1) ? b : 0]);
+
+    bases[b].basisTag = malloc(16);
+    checkPtr(bases[b].basisTag, "out of memory");
+    snprintf(bases[b].basisTag, 16, "b%d", b);
+  }
+
+  free(basisNames);
+  free(basisBuffer);
+  free(priorNames);
+  free(priorBuffer);
+  free(rows);
+  free(cols);
+
+  (*cfgs) = bases;
+  return nBases;
+}
+
+void freeBases(fitConfig * cfgs, int nBases)
+{
+  int b;
+
+  for (b=0; b<nBases; b++)
+  {
+    free(cfgs[b].basisMat);
+    free(cfgs[b].basisMatF);
+    free(cfgs[b].priorVec);
+    free(cfgs[b].basisTag);
+  }
+  free(cfgs);
+}
+
+// ID of the records of a series for the basis of cfg: id, or id:TAG
+const char * basisSeriesId(const fitConfig * cfg, const char * id,
+    char * buffer, size_t size)
+{
+  if (cfg->basisTag == NULL)
+    return id;
+
+  snprintf(buffer, size, "%s:%s", id, cfg->basisTag);
+  return buffer;
+}
+
+/*
+ * Map valid times onto [0, 1] in place, the first step of rescaleTimes, so
+ * that gridTimes gives exactly the times rescaleTimes would for any basis
+ */
+void unitTimes(double * timeVec, int n)
+{
+  double minTime, maxTime;
+
+  arrayMinMax(timeVec, n, &minTime, &maxTime);
+  rescaleTimes(timeVec, n, minTime, maxTime, 2);
+}
+
+// Times on the grid of a basis with basisRows rows, from unitTimes
+void gridTimes(const double * unitVec, int n, int basisRows,
+    double * timeVec)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+  {
+    timeVec[i] = unitVec[i] * (basisRows-1);
+  }
+}
+
+/*
+ * Fit one series (n valid observations, times as read) against each of
+ * nBases bases and write the records of each to outfile in basis order.
+ * Normalizes timeVec in place (unitTimes). With screenAlpha, fits that
+ * cannot be flagged stop early (fitNuGridScreen).
+ */
+void fitBases(const fitConfig * cfgs, int nBases, const char * id,
+    double * yVec, int n, double * timeVec, FILE * outfile)
+{
+  int b;
+  double * scaled;
+  char basisId[PATH_MAX];
+  const char * recordId;
+  nuFit * fits;
+
+  scaled = calloc(n, sizeof(double));
+  checkPtr(scaled, "out of memory");
+
+  unitTimes(timeVec, n);
+
+  for (b=0; b<nBases; b++)
+  {
+    if (b == 0 || cfgs[b].basisRows != cfgs[b-1].basisRows)
+      gridTimes(timeVec, n, cfgs[b].basisRows, scaled);
+
+    fits = allocNuFits(cfgs[b].nuVec, cfgs[b].nNu, cfgs[b].basisCols,
+        cfgs[b].kSmooth);
+    if (cfgs[b].screenAlpha > 0)
+    {
+      fitNuGridScreen(cfgs[b].basisMat, cfgs[b].basisRows, cfgs[b].basisCols,
+          yVec, n, scaled, cfgs[b].priorVec, cfgs[b].kSmooth,
+          cfgs[b].maxIter, cfgs[b].tol,
+          screenThreshold(cfgs[b].screenAlpha, cfgs[b].basisCols,
+            cfgs[b].kSmooth),
+          fits, cfgs[b].nNu);
+    }
+    else
+    {
+      fitNuGrid(cfgs[b].basisMat, cfgs[b].basisMatF, cfgs[b].basisRows,
+          cfgs[b].basisCols, yVec, n, scaled, cfgs[b].priorVec,
+          cfgs[b].kSmooth, cfgs[b].maxIter, cfgs[b].tol, cfgs[b].solver,
+          fits, cfgs[b].nNu, 0);
+    }
+
+    recordId = basisSeriesId(&cfgs[b], id, basisId, sizeof(basisId));
+    writeNuFits(outfile, recordId, n, cfgs[b].basisCols, cfgs[b].kSmooth,
+        fits, cfgs[b].nNu, cfgs[b].profileNu);
+    verifySeries(&cfgs[b], recordId, yVec, n, scaled, fits);
+
+    freeNuFits(fits, cfgs[b].nNu);
+  }
+
+  free(scaled);
+}
+
+/*
+ * Fit the series in dataFile (time and value columns of cfgs[0]) against
+ * each of nBases bases and write their records to stdout
+ * Returns 0; exits if too few observations are valid
+ */
+int runBases(const fitConfig * cfgs, int nBases, const char * dataFile,
+    int dataRows, const char * idString)
+{
+  int cols[2] = {cfgs[0].timeCol, cfgs[0].valueCol};
+  int nRows, nObs = 0, i;
+  double * rows, * timeVec, * yVec;
+
+  rows = calloc(((dataRows < 1) ? 1 : dataRows) * 2, sizeof(double));
+  checkPtr(rows, "out of memory");
+  nRows = readToDoubleColumnsDynamic(dataFile, (dataRows < 1) ? 1 : dataRows,
+      cols, 2, &rows);
+
+  if (nRows == 0 || isnan(rows[0]) || isnan(rows[1]))
+  {
+    fprintf(stderr, "Error -- NaN at first time or observation; aborting\n");
+    exit(1);
+  }
+
+  timeVec = calloc(nRows, sizeof(double));
+  checkPtr(timeVec, "out of memory");
+  yVec = calloc(nRows, sizeof(double));
+  checkPtr(yVec, "out of memory");
+
+  for (i=0; i<nRows; i++)
+  {
+    if (rows[2*i + 1] != cfgs[0].missingCode)
+    {
+      timeVec[nObs] = rows[2*i];
+      yVec[nObs] = rows[2*i + 1];
+      nObs++;
+    }
+  }
+
+  if (nObs < cfgs[0].minObs)
+  {
+    fprintf(stderr, "Error -- read %d obs, minimum to process is %d\n",
+        nObs, cfgs[0].minObs);
+    exit(1);
+  }
+
+  fitBases(cfgs, nBases, idString, yVec, nObs, timeVec, stdout);
+
+  free(rows);
+  free(timeVec);
+  free(yVec);
+
+  return 0;
+}
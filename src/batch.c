@@ -0,0 +1,1131 @@
+/*
+ * batch.c
+ *
+ *  Sharded, checkpointed fits of the series listed in a manifest
+ *
+ *  Each manifest line holds a data file and optionally an ID (defaulting to
+ *  the file name). A series belongs to shard fnv1a(ID) mod nShards, so the
+ *  assignment does not depend on manifest order or on which worker runs it.
+ *  A worker holds an flock on OUTDIR/shard-S-of-N.lock while it fits shard
+ *  S (see runShard), appending result lines in shard order to
+ *  shard-S-of-N.part. Every kBatchCheckpointEvery series it syncs the part
+ *  file and records its length and the number of series done in
+ *  shard-S-of-N.ckpt, so a worker taking over after a failure truncates the
+ *  part file to the checkpoint and skips the series already done. Finished
+ *  shards are sorted by ID into shard-S-of-N.txt, and the worker that finds
+ *  all of them present merges them into OUTDIR/results.txt. Workers
+ *  coordinate only through these files.
+ */
+
+#include "rowavedt.h"
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Checkpoint after this many series
+const int kBatchCheckpointEvery = 256;
+
+// Default depths of the read, fit and write queues (series, blocks, series)
+const int kBatchQueueDepth[] = {32, 8, 64};
+
+// Series with at most this many observations are fit in blocks (lmTBlock)
+const int kBlockMaxObs = 64;
+
+typedef struct {
+  char * dataFile, * id;
+} batchSeries;
+
+// A series on its way through the pipeline
+typedef struct {
+  const batchSeries * series;
+  int index;            // Position in the shard
+  char * data;          // Contents of the data file until parsed
+  double * timeVec, * yVec;
+  int nObs;             // Valid observations; -1 if skipped
+  int cached;
+  uint64_t key;
+  char * lines;         // Result lines; NULL if skipped
+  size_t linesSize;
+} batchItem;
+
+// Unit of work for the fit stage: one series, or a block of short ones
+typedef struct {
+  batchItem * items[BLOCK_LANES];
+  int count, block;
+} batchWork;
+
+enum {kStageRead, kStageParse, kStageFit, kStageWrite, kNumStages};
+
+/*
+ * State shared by the stages of one shard. Readers take series in order
+ * but only up to window series ahead of the writer, which bounds the
+ * results held for reordering.
+ */
+typedef struct {
+  const fitConfig * cfg;  // One per basis (see bases.c)
+  int nBases;
+  const batchSeries * series;
+  int nSeries, dataRows;
+  int next, nWritten, window;
+  int readersLeft, fittersLeft;
+  stageQueue readQueue, fitQueue, writeQueue;
+  stageStats stages[kNumStages];
+  numaTopology * topo;
+  double ** nodeBasis;  // Per-node basis replicas, nBases per node
+  pthread_mutex_t lock;
+  pthread_cond_t windowOpen;
+} batchPipeline;
+
+typedef struct {
+  batchPipeline * pipe;
+  int thread;
+} batchStageArg;
+
+// One line of a sorted shard file during the merge
+typedef struct {
+  char * line;
+  size_t size;
+  FILE * infile;
+  int shard;
+} mergeHead;
+
+/*
+ * Hash of everything except the series that determines a result line:
+ * basis and prior files, and fit settings. Extended by seriesCacheKey.
+ */
+uint64_t fitCacheSeed(const fitConfig * cfg, const char * basisFile,
+    const char * priorFile)
+{
+  uint64_t key;
+  int settings[8] = {cfg->basisRows, cfg->basisCols, cfg->kSmooth,
+    cfg->minObs, cfg->timeCol, cfg->valueCol, cfg->maxIter,
+    (reproKernels << 28) | (basisInterp << 24) | (cfg->mixedPrecision << 16) |
+      (cfg->profileNu << 8) | cfg->solver};
+
+  key = fnv1a("rowavedt result 1", 17, kFnvOffset);
+  key = fnv1aFileIdentity(basisFile, key);
+  key = fnv1aFileIdentity(priorFile, key);
+  key = fnv1a(settings, sizeof(settings), key);
+  key = fnv1a(&cfg->tol, sizeof(double), key);
+  key = fnv1a(&cfg->missingCode, sizeof(double), key);
+  key = fnv1a(cfg->nuVec, cfg->nNu * sizeof(double), key);
+  if (cfg->screenAlpha > 0)
+  {
+    key = fnv1a(&cfg->screenAlpha, sizeof(double), key);
+  }
+
+  return key;
+}
+
+// Cache key of a series from its valid (unscaled) times and values
+uint64_t seriesCacheKey(uint64_t seed, const double * timeVec,
+    const double * yVec, int n)
+{
+  seed = fnv1a(timeVec, n * sizeof(double), seed);
+  return fnv1a(yVec, n * sizeof(double), seed);
+}
+
+static int batchShard(const char * id, int nShards)
+{
+  return (int) (fnv1a(id, strlen(id), kFnvOffset) % (uint64_t) nShards);
+}
+
+static void shardPath(char * path, size_t size, const char * outDir,
+    int shard, int nShards, const char * ext)
+{
+  snprintf(path, size, "%s/shard-%04d-of-%04d.%s", outDir, shard, nShards,
+      ext);
+}
+
+static int fileExists(const char * path)
+{
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+// Open and lock path without waiting; returns the descriptor or -1
+static int tryLock(const char * path)
+{
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+ * Read the series of one shard from the manifest, in manifest order
+ * Sets (*hash) to a hash of the shard's series list, so that a checkpoint
+ * is only trusted for the manifest it was written for (runShard adds the
+ * fit settings).
+ * Returns the number of series; caller frees with freeBatchSeries
+ */
+static int readManifest(const char * manifest, int shard, int nShards,
+    batchSeries ** series, uint64_t * hash)
+{
+  FILE * infile;
+  char * line = NULL, * file, * id;
+  size_t lineSize = 0;
+  int n = 0, size = 64;
+  batchSeries * s, * tmp;
+
+  infile = fopen(manifest, "r");
+  checkPtr(infile, manifest);
+
+  s = malloc(size * sizeof(batchSeries));
+  checkPtr(s, "out of memory");
+
+  (*hash) = kFnvOffset;
+  while (getline(&line, &lineSize, infile) > 0)
+  {
+    if (line[0] == '#') continue;
+    file = strtok(line, " \t\r\n");
+    if (file == NULL) continue;
+    id = strtok(NULL, " \t\r\n");
+    id = (id == NULL) ? file : id;
+
+    if (batchShard(id, nShards) != shard) continue;
+
+    if (n >= size)
+    {
+      size *= 2;
+      tmp = realloc(s, size * sizeof(batchSeries));
+      checkPtr(tmp, "out of memory");
+      s = tmp;
+    }
+    s[n].dataFile = strdup(file);
+    checkPtr(s[n].dataFile, "out of memory");
+    s[n].id = strdup(id);
+    checkPtr(s[n].id, "out of memory");
+    (*hash) = fnv1a(file, strlen(file) + 1, *hash);
+    (*hash) = fnv1a(id, strlen(id) + 1, *hash);
+    n++;
+  }
+
+  free(line);
+  fclose(infile);
+
+  (*series) = s;
+  return n;
+}
+
+static void freeBatchSeries(batchSeries * series, int n)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+  {
+    free(series[i].dataFile);
+    free(series[i].id);
+  }
+  free(series);
+}
+
+// Returns 1 and sets nDone and bytes if path holds a checkpoint for hash
+static int readCheckpoint(const char * path, uint64_t hash,
+    int * nDone, long * bytes)
+{
+  FILE * infile;
+  unsigned long long ckptHash;
+  int ok;
+
+  infile = fopen(path, "r");
+  if (infile == NULL)
+  {
+    return 0;
+  }
+  ok = fscanf(infile, "# rowavedt checkpoint %d %ld %llx",
+      nDone, bytes, &ckptHash) == 3 && ckptHash == hash &&
+    (*nDone) >= 0 && (*bytes) >= 0;
+  fclose(infile);
+
+  return ok;
+}
+
+// Sync the part file, then record progress via a temporary file
+static void writeCheckpoint(const char * path, FILE * partFile,
+    uint64_t hash, int nDone)
+{
+  char tmpPath[PATH_MAX + 8];
+  FILE * outfile;
+  long bytes;
+
+  fflush(partFile);
+  fsync(fileno(partFile));
+  bytes = ftell(partFile);
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  outfile = fopen(tmpPath, "w");
+  checkPtr(outfile, tmpPath);
+  fprintf(outfile, "# rowavedt checkpoint %d %ld %llx\n", nDone, bytes,
+      (unsigned long long) hash);
+  fflush(outfile);
+  fsync(fileno(outfile));
+  fclose(outfile);
+
+  if (rename(tmpPath, path) != 0)
+  {
+    fprintf(stderr, "Error -- cannot write checkpoint %s\n", path);
+    exit(1);
+  }
+}
+
+// Compare result lines by their ID (first space-delimited token)
+static int compareId(const char * a, const char * b)
+{
+  size_t la = strcspn(a, " \n"), lb = strcspn(b, " \n");
+  int c = memcmp(a, b, (la < lb) ? la : lb);
+
+  return (c != 0) ? c : (la > lb) - (la < lb);
+}
+
+// Lines of a shard sort by ID; pointers order lines of one ID (one per df)
+static int compareLine(const void * a, const void * b)
+{
+  const char * x = *(char * const *) a, * y = *(char * const *) b;
+  int c = compareId(x, y);
+
+  return (c != 0) ? c : (x > y) - (x < y);
+}
+
+// Write the lines of partPath sorted by ID to path via a temporary file
+static void sortShard(const char * partPath, const char * path)
+{
+  char tmpPath[PATH_MAX + 8];
+  char * buffer, * pos, ** lines;
+  long bytes, i, nLines = 0;
+  FILE * infile, * outfile;
+
+  infile = fopen(partPath, "r");
+  checkPtr(infile, partPath);
+  fseek(infile, 0, SEEK_END);
+  bytes = ftell(infile);
+  rewind(infile);
+
+  buffer = malloc(bytes + 1);
+  checkPtr(buffer, "out of memory");
+  if ((long) fread(buffer, 1, bytes, infile) != bytes)
+  {
+    fprintf(stderr, "Error -- cannot read %s\n", partPath);
+    exit(1);
+  }
+  buffer[bytes] = '\0';
+  fclose(infile);
+
+  for (i=0; i<bytes; i++)
+  {
+    if (buffer[i] == '\n') nLines++;
+  }
+
+  lines = malloc((nLines + 1) * sizeof(char *));
+  checkPtr(lines, "out of memory");
+  pos = buffer;
+  for (i=0; i<nLines; i++)
+  {
+    lines[i] = pos;
+    pos = strchr(pos, '\n') + 1;
+  }
+
+  qsort(lines, nLines, sizeof(char *), compareLine);
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  outfile = fopen(tmpPath, "w");
+  checkPtr(outfile, tmpPath);
+  for (i=0; i<nLines; i++)
+  {
+    fwrite(lines[i], 1, strchr(lines[i], '\n') - lines[i] + 1, outfile);
+  }
+  fflush(outfile);
+  fsync(fileno(outfile));
+  fclose(outfile);
+
+  if (rename(tmpPath, path) != 0)
+  {
+    fprintf(stderr, "Error -- cannot write %s\n", path);
+    exit(1);
+  }
+
+  free(lines);
+  free(buffer);
+}
+
+// Whole contents of path, NUL-terminated; NULL if it cannot be opened
+static char * readSeriesFile(const char * path)
+{
+  FILE * infile;
+  char * data, * tmp;
+  size_t size = 1 << 16, n = 0, got;
+
+  infile = fopen(path, "r");
+  if (infile == NULL)
+  {
+    return NULL;
+  }
+
+  data = malloc(size + 1);
+  checkPtr(data, "out of memory");
+  while ((got = fread(data + n, 1, size - n, infile)) > 0)
+  {
+    n += got;
+    if (n == size)
+    {
+      size *= 2;
+      tmp = realloc(data, size + 1);
+      checkPtr(tmp, "out of memory");
+      data = tmp;
+    }
+  }
+  data[n] = '\0';
+  fclose(infile);
+
+  return data;
+}
+
+/*
+ * Parse the data file contents of item, splitting columns as
+ * readToDoubleVectorDynamic does, and move the valid observations to the
+ * head of the vectors. Sets item->nObs to the number of valid observations,
+ * or to -1 (with a warning) if the series cannot be fit.
+ */
+static void parseBatchSeries(const fitConfig * cfg, batchItem * item,
+    int dataRows)
+{
+  const char sep[] = "\t ,\r";
+  char * line, * next, * token, * save;
+  int i, j, n = 0, nObs = 0, size;
+  double * tmp;
+
+  item->nObs = -1;
+  if (item->data == NULL)
+  {
+    fprintf(stderr, "Warning -- cannot read %s; skipping %s\n",
+        item->series->dataFile, item->series->id);
+    return;
+  }
+
+  size = (dataRows < 1) ? 1 : dataRows;
+  item->timeVec = malloc(size * sizeof(double));
+  checkPtr(item->timeVec, "out of memory");
+  item->yVec = malloc(size * sizeof(double));
+  checkPtr(item->yVec, "out of memory");
+
+  for (line=item->data; *line != '\0'; line=next)
+  {
+    next = strchr(line, '\n');
+    if (next != NULL)
+      *next++ = '\0';
+    else
+      next = line + strlen(line);
+
+    // Skip comments and blank lines
+    if (line[0] == '#') continue;
+    token = strtok_r(line, sep, &save);
+    if (token == NULL) continue;
+
+    if (n >= size)
+    {
+      size *= 2;
+      tmp = realloc(item->timeVec, size * sizeof(double));
+      checkPtr(tmp, "out of memory");
+      item->timeVec = tmp;
+      tmp = realloc(item->yVec, size * sizeof(double));
+      checkPtr(tmp, "out of memory");
+      item->yVec = tmp;
+    }
+
+    item->timeVec[n] = NAN;
+    item->yVec[n] = NAN;
+    for (j=0; token != NULL; j++, token=strtok_r(NULL, sep, &save))
+    {
+      if (j == cfg->timeCol) item->timeVec[n] = atof(token);
+      if (j == cfg->valueCol) item->yVec[n] = atof(token);
+    }
+    n++;
+  }
+
+  free(item->data);
+  item->data = NULL;
+
+  if (n == 0 || isnan(item->timeVec[0]) || isnan(item->yVec[0]))
+  {
+    fprintf(stderr, "Warning -- malformed data in %s; skipping %s\n",
+        item->series->dataFile, item->series->id);
+    return;
+  }
+
+  for (i=0; i<n; i++)
+  {
+    if (item->yVec[i] != cfg->missingCode)
+    {
+      item->yVec[nObs] = item->yVec[i];
+      item->timeVec[nObs] = item->timeVec[i];
+      nObs++;
+    }
+  }
+
+  if (nObs < cfg->minObs)
+  {
+    fprintf(stderr, "Warning -- read %d obs, minimum to process is %d; "
+        "skipping %s\n", nObs, cfg->minObs, item->series->id);
+    return;
+  }
+
+  item->nObs = nObs;
+}
+
+static void freeBatchItem(batchItem * item)
+{
+  free(item->data);
+  free(item->timeVec);
+  free(item->yVec);
+  free(item->lines);
+  free(item);
+}
+
+// Fit one series against each basis and format its result lines into
+// item->lines
+static void fitItem(const fitConfig * cfgs, int nBases, batchItem * item)
+{
+  FILE * lineFile;
+
+  lineFile = open_memstream(&item->lines, &item->linesSize);
+  checkPtr(lineFile, "out of memory");
+  fitBases(cfgs, nBases, item->series->id, item->yVec, item->nObs,
+      item->timeVec, lineFile);
+  fclose(lineFile);
+}
+
+// Fit a block of short series together (fitNuGridBlock) against each basis
+static void fitItemBlock(const fitConfig * cfgs, int nBases,
+    batchItem ** items, int nLanes)
+{
+  int s, b;
+  double * yVecs[BLOCK_LANES], * timeVecs[BLOCK_LANES];
+  int nVec[BLOCK_LANES];
+  nuFit * fits[BLOCK_LANES];
+  FILE * lineFiles[BLOCK_LANES];
+  char basisId[PATH_MAX];
+  const char * recordId;
+  const fitConfig * cfg;
+
+  for (s=0; s<nLanes; s++)
+  {
+    unitTimes(items[s]->timeVec, items[s]->nObs);
+    yVecs[s] = items[s]->yVec;
+    nVec[s] = items[s]->nObs;
+    timeVecs[s] = malloc(nVec[s] * sizeof(double));
+    checkPtr(timeVecs[s], "out of memory");
+    lineFiles[s] = open_memstream(&items[s]->lines, &items[s]->linesSize);
+    checkPtr(lineFiles[s], "out of memory");
+  }
+
+  for (b=0; b<nBases; b++)
+  {
+    cfg = &cfgs[b];
+    for (s=0; s<nLanes; s++)
+    {
+      if (b == 0 || cfg->basisRows != cfgs[b-1].basisRows)
+        gridTimes(items[s]->timeVec, nVec[s], cfg->basisRows, timeVecs[s]);
+      fits[s] = allocNuFits(cfg->nuVec, cfg->nNu, cfg->basisCols,
+          cfg->kSmooth);
+    }
+
+    fitNuGridBlock(cfg->basisMat, cfg->basisRows, cfg->basisCols,
+        yVecs, nVec, timeVecs, cfg->priorVec,
+        cfg->kSmooth, cfg->maxIter, cfg->tol, cfg->solver,
+        fits, cfg->nNu, nLanes);
+
+    for (s=0; s<nLanes; s++)
+    {
+      recordId = basisSeriesId(cfg, items[s]->series->id, basisId,
+          sizeof(basisId));
+      writeNuFits(lineFiles[s], recordId, nVec[s], cfg->basisCols,
+          cfg->kSmooth, fits[s], cfg->nNu, cfg->profileNu);
+      verifySeries(cfg, recordId, yVecs[s], nVec[s], timeVecs[s], fits[s]);
+      freeNuFits(fits[s], cfg->nNu);
+    }
+  }
+
+  for (s=0; s<nLanes; s++)
+  {
+    fclose(lineFiles[s]);
+    free(timeVecs[s]);
+  }
+}
+
+// Queue a work unit for fitting, costed by its observations, so that of
+// the units waiting the longest series are fit first
+static void pushFitWork(batchPipeline * pipe, batchWork * work,
+    double * blocked)
+{
+  int s;
+  double cost = 0;
+
+  for (s=0; s<work->count; s++)
+  {
+    cost += work->items[s]->nObs;
+  }
+  stagePushCost(&pipe->fitQueue, work, cost, blocked);
+}
+
+// Read stage: load data files in shard order, up to window series ahead
+static void * readStage(void * arg)
+{
+  batchPipeline * pipe = ((batchStageArg *) arg)->pipe;
+  double start = monotonicSeconds(), starved = 0, blocked = 0, wait;
+  batchItem * item;
+  int i;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->next < pipe->nSeries &&
+        pipe->next >= pipe->nWritten + pipe->window)
+    {
+      wait = monotonicSeconds();
+      while (pipe->next < pipe->nSeries &&
+          pipe->next >= pipe->nWritten + pipe->window)
+        pthread_cond_wait(&pipe->windowOpen, &pipe->lock);
+      blocked += monotonicSeconds() - wait;
+    }
+    i = pipe->next++;
+    pthread_mutex_unlock(&pipe->lock);
+    if (i >= pipe->nSeries)
+      break;
+
+    item = calloc(1, sizeof(batchItem));
+    checkPtr(item, "out of memory");
+    item->series = &pipe->series[i];
+    item->index = i;
+    item->data = readSeriesFile(item->series->dataFile);
+    stagePush(&pipe->readQueue, item, &blocked);
+  }
+
+  pthread_mutex_lock(&pipe->lock);
+  if (--pipe->readersLeft == 0)
+    closeStageQueue(&pipe->readQueue);
+  pthread_mutex_unlock(&pipe->lock);
+
+  addStageTimes(&pipe->stages[kStageRead], monotonicSeconds() - start,
+      starved, blocked);
+  return NULL;
+}
+
+/*
+ * Parse stage: parse series, answer what it can from the cache, and pass
+ * the rest to the fit stage, short series in blocks of up to BLOCK_LANES.
+ * A partial block is sent on whenever no more input is waiting, so a slow
+ * reader delays no series for long.
+ */
+static void * parseStage(void * arg)
+{
+  batchPipeline * pipe = ((batchStageArg *) arg)->pipe;
+  const fitConfig * cfg = pipe->cfg;
+  double start = monotonicSeconds(), starved = 0, blocked = 0;
+  batchItem * item;
+  batchWork * work, * block = NULL;
+  FILE * lineFile;
+
+  for (;;)
+  {
+    item = stageTryPop(&pipe->readQueue);
+    if (item == NULL)
+    {
+      if (block != NULL)
+      {
+        pushFitWork(pipe, block, &blocked);
+        block = NULL;
+      }
+      item = stagePop(&pipe->readQueue, &starved);
+      if (item == NULL)
+        break;
+    }
+
+    parseBatchSeries(cfg, item, pipe->dataRows);
+
+    if (item->nObs > 0 && cfg->cacheDir != NULL)
+    {
+      item->key = seriesCacheKey(cfg->cacheSeed, item->timeVec, item->yVec,
+          item->nObs);
+      lineFile = open_memstream(&item->lines, &item->linesSize);
+      checkPtr(lineFile, "out of memory");
+      item->cached = cacheLookup(cfg->cacheDir, item->key, item->series->id,
+          lineFile);
+      fclose(lineFile);
+      if (!item->cached)
+      {
+        free(item->lines);
+        item->lines = NULL;
+      }
+    }
+
+    if (item->nObs < 0 || item->cached)
+    {
+      stagePush(&pipe->writeQueue, item, &blocked);
+    }
+    else if (item->nObs <= kBlockMaxObs && cfg->basisMatF == NULL &&
+        cfg->screenAlpha <= 0)
+    {
+      if (block == NULL)
+      {
+        block = calloc(1, sizeof(batchWork));
+        checkPtr(block, "out of memory");
+        block->block = 1;
+      }
+      block->items[block->count++] = item;
+      if (block->count == BLOCK_LANES)
+      {
+        pushFitWork(pipe, block, &blocked);
+        block = NULL;
+      }
+    }
+    else
+    {
+      work = calloc(1, sizeof(batchWork));
+      checkPtr(work, "out of memory");
+      work->items[work->count++] = item;
+      pushFitWork(pipe, work, &blocked);
+    }
+  }
+
+  closeStageQueue(&pipe->fitQueue);
+
+  addStageTimes(&pipe->stages[kStageParse], monotonicSeconds() - start,
+      starved, blocked);
+  return NULL;
+}
+
+/*
+ * Fit stage: fit work units and pass their series to the writer. On NUMA
+ * systems the thread pins itself to a node and reads the bases from that
+ * node's replicas.
+ */
+static void * fitStage(void * arg)
+{
+  batchPipeline * pipe = ((batchStageArg *) arg)->pipe;
+  int thread = ((batchStageArg *) arg)->thread;
+  double start = monotonicSeconds(), starved = 0, blocked = 0;
+  batchWork * work;
+  int node, s, b;
+  fitConfig cfgs[pipe->nBases];
+  double ** replica;
+  size_t size;
+
+  memcpy(cfgs, pipe->cfg, pipe->nBases * sizeof(fitConfig));
+
+  if (pipe->topo->nNodes > 1)
+  {
+    node = numaThreadNode(pipe->topo, thread);
+    numaPinThread(pipe->topo, node);
+
+    pthread_mutex_lock(&pipe->lock);
+    for (b=0; b<pipe->nBases; b++)
+    {
+      replica = &pipe->nodeBasis[node * pipe->nBases + b];
+      if ((*replica) == NULL)
+      {
+        size = (size_t) cfgs[b].basisRows * cfgs[b].basisCols *
+          sizeof(double);
+        (*replica) = malloc(size);
+        checkPtr(*replica, "out of memory");
+        memcpy(*replica, cfgs[b].basisMat, size);
+      }
+      cfgs[b].basisMat = (*replica);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+  }
+
+  while ((work = stagePop(&pipe->fitQueue, &starved)) != NULL)
+  {
+    if (work->block)
+      fitItemBlock(cfgs, pipe->nBases, work->items, work->count);
+    else
+      fitItem(cfgs, pipe->nBases, work->items[0]);
+
+    for (s=0; s<work->count; s++)
+    {
+      stagePush(&pipe->writeQueue, work->items[s], &blocked);
+    }
+    free(work);
+  }
+
+  addStageTimes(&pipe->stages[kStageFit], monotonicSeconds() - start,
+      starved, blocked);
+  return NULL;
+}
+
+static void startStage(pthread_t * threads, batchStageArg * args, int n,
+    batchPipeline * pipe, void * (* stage)(void *))
+{
+  int i;
+
+  for (i=0; i<n; i++)
+  {
+    args[i].pipe = pipe;
+    args[i].thread = i;
+    if (pthread_create(&threads[i], NULL, stage, &args[i]) != 0)
+    {
+      fprintf(stderr, "Error -- could not start thread\n");
+      exit(1);
+    }
+  }
+}
+
+/*
+ * Fit the series of one shard, resuming from its checkpoint if present
+ *
+ * Series flow through four stages joined by bounded queues: nReaders
+ * threads read data files, one thread parses them and consults the cache,
+ * nThreads threads fit, and this thread writes the results in shard order
+ * to the part file, checkpointing every kBatchCheckpointEvery series.
+ * Reading, fitting and writing thus overlap, and the time each stage spends
+ * busy or waiting is reported at the end. Of the work waiting to be fit,
+ * the longest series go first, so that the threads do not end a shard
+ * waiting on one long fit. Each series is fit against the nBases bases of
+ * cfg (see bases.c). Caller holds the shard lock.
+ */
+static void runShard(const fitConfig * cfg, int nBases, const char * manifest,
+    int dataRows, const char * outDir, int shard, int nShards)
+{
+  char partPath[PATH_MAX], ckptPath[PATH_MAX], path[PATH_MAX], label[64];
+  batchSeries * series;
+  uint64_t hash;
+  int nSeries, nDone = 0, i, s, nCached = 0, nSkipped = 0;
+  int depth[3], nReaders, nThreads;
+  long bytes = 0;
+  double start, starved = 0;
+  FILE * partFile;
+  batchItem * item, ** pending;
+  batchPipeline pipe;
+  numaTopology topo;
+
+  shardPath(partPath, sizeof(partPath), outDir, shard, nShards, "part");
+  shardPath(ckptPath, sizeof(ckptPath), outDir, shard, nShards, "ckpt");
+  shardPath(path, sizeof(path), outDir, shard, nShards, "txt");
+
+  nSeries = readManifest(manifest, shard, nShards, &series, &hash);
+
+  // A checkpoint is only trusted for the same basis, prior and settings
+  for (i=0; i<nBases; i++)
+  {
+    hash = fnv1a(&cfg[i].cacheSeed, sizeof(uint64_t), hash);
+  }
+
+  // Resume: drop lines written after the last checkpoint
+  if (!readCheckpoint(ckptPath, hash, &nDone, &bytes) || nDone > nSeries)
+  {
+    nDone = 0;
+    bytes = 0;
+  }
+
+  partFile = fopen(partPath, fileExists(partPath) ? "r+" : "w+");
+  checkPtr(partFile, partPath);
+  if (ftruncate(fileno(partFile), bytes) != 0)
+  {
+    fprintf(stderr, "Error -- cannot truncate %s\n", partPath);
+    exit(1);
+  }
+  fseek(partFile, 0, SEEK_END);
+
+  if (nDone > 0)
+  {
+    fprintf(stderr, "shard %d of %d: resuming after %d of %d series\n",
+        shard, nShards, nDone, nSeries);
+  }
+
+  for (i=0; i<3; i++)
+  {
+    depth[i] = (cfg->queueDepth[i] > 0) ? cfg->queueDepth[i] :
+      kBatchQueueDepth[i];
+  }
+  nReaders = (cfg->nReaders > 0) ? cfg->nReaders : 1;
+  nThreads = (cfg->nThreads > 0) ? cfg->nThreads : 1;
+
+  pipe.cfg = cfg;
+  pipe.nBases = nBases;
+  pipe.series = series;
+  pipe.nSeries = nSeries;
+  pipe.dataRows = dataRows;
+  pipe.next = nDone;
+  pipe.nWritten = nDone;
+  pipe.window = depth[0] + depth[1] * BLOCK_LANES + depth[2] + nReaders +
+    (nThreads + 1) * BLOCK_LANES;
+  pipe.readersLeft = nReaders;
+  initStageQueue(&pipe.readQueue, depth[0]);
+  initCostQueue(&pipe.fitQueue, depth[1]);
+  initStageQueue(&pipe.writeQueue, depth[2]);
+  memset(pipe.stages, 0, sizeof(pipe.stages));
+  pipe.stages[kStageRead].name = "read";
+  pipe.stages[kStageRead].nThreads = nReaders;
+  pipe.stages[kStageParse].name = "parse";
+  pipe.stages[kStageParse].nThreads = 1;
+  pipe.stages[kStageFit].name = "fit";
+  pipe.stages[kStageFit].nThreads = nThreads;
+  pipe.stages[kStageWrite].name = "write";
+  pipe.stages[kStageWrite].nThreads = 1;
+  readNumaTopology(&topo);
+  pipe.topo = &topo;
+  pipe.nodeBasis = calloc(topo.nNodes * nBases, sizeof(double *));
+  checkPtr(pipe.nodeBasis, "out of memory");
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.windowOpen, NULL);
+
+  // Results that arrived ahead of their turn, by index mod window
+  pending = calloc(pipe.window, sizeof(batchItem *));
+  checkPtr(pending, "out of memory");
+
+  pthread_t readers[nReaders], parser, fitters[nThreads];
+  batchStageArg readArgs[nReaders], parseArg, fitArgs[nThreads];
+
+  start = monotonicSeconds();
+  startStage(readers, readArgs, nReaders, &pipe, readStage);
+  startStage(&parser, &parseArg, 1, &pipe, parseStage);
+  startStage(fitters, fitArgs, nThreads, &pipe, fitStage);
+
+  // Write stage: append results in shard order
+  for (i=nDone; i<nSeries; )
+  {
+    item = stagePop(&pipe.writeQueue, &starved);
+    pending[item->index % pipe.window] = item;
+
+    while (i < nSeries && pending[i % pipe.window] != NULL)
+    {
+      item = pending[i % pipe.window];
+      pending[i % pipe.window] = NULL;
+
+      if (item->lines != NULL)
+      {
+        fputs(item->lines, partFile);
+        if (cfg->cacheDir != NULL && !item->cached)
+          cacheStore(cfg->cacheDir, item->key, item->lines);
+      }
+      nCached += item->cached;
+      nSkipped += (item->nObs < 0);
+      freeBatchItem(item);
+
+      i++;
+      if ((i - nDone) % kBatchCheckpointEvery == 0)
+        writeCheckpoint(ckptPath, partFile, hash, i);
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    pipe.nWritten = i;
+    pthread_cond_broadcast(&pipe.windowOpen);
+    pthread_mutex_unlock(&pipe.lock);
+  }
+
+  writeCheckpoint(ckptPath, partFile, hash, nSeries);
+  addStageTimes(&pipe.stages[kStageWrite], monotonicSeconds() - start,
+      starved, 0);
+
+  for (s=0; s<nReaders; s++)
+  {
+    pthread_join(readers[s], NULL);
+  }
+  pthread_join(parser, NULL);
+  for (s=0; s<nThreads; s++)
+  {
+    pthread_join(fitters[s], NULL);
+  }
+  fclose(partFile);
+
+  snprintf(label, sizeof(label), "shard %d of %d", shard, nShards);
+  reportStages(stderr, label, pipe.stages, kNumStages,
+      monotonicSeconds() - start);
+
+  for (s=0; s<topo.nNodes * nBases; s++)
+  {
+    free(pipe.nodeBasis[s]);
+  }
+  free(pipe.nodeBasis);
+  free(pending);
+  freeStageQueue(&pipe.readQueue);
+  freeStageQueue(&pipe.fitQueue);
+  freeStageQueue(&pipe.writeQueue);
+  pthread_mutex_destroy(&pipe.lock);
+  pthread_cond_destroy(&pipe.windowOpen);
+  freeNumaTopology(&topo);
+
+  // Publish the sorted shard, then drop its working files
+  sortShard(partPath, path);
+  unlink(partPath);
+  unlink(ckptPath);
+
+  fprintf(stderr, "shard %d of %d: %d series (%d from cache, %d skipped)\n",
+      shard, nShards, nSeries - nDone, nCached, nSkipped);
+
+  freeBatchSeries(series, nSeries);
+}
+
+static void siftDown(mergeHead * heap, int n, int i)
+{
+  int child;
+  mergeHead tmp;
+
+  while ((child = 2*i + 1) < n)
+  {
+    if (child + 1 < n &&
+        compareId(heap[child+1].line, heap[child].line) < 0)
+      child++;
+    if (compareId(heap[child].line, heap[i].line) >= 0)
+      break;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+}
+
+/*
+ * Merge sorted shard files into OUTDIR/results.txt, if all shards are done
+ * and no other worker is merging. A heap of shard heads keeps the merge to
+ * one pass with one line per shard in memory.
+ */
+static void mergeShards(const char * outDir, int nShards)
+{
+  char path[PATH_MAX], tmpPath[PATH_MAX + 8];
+  int s, n = 0, fd;
+  mergeHead * heap;
+  FILE * outfile;
+
+  for (s=0; s<nShards; s++)
+  {
+    shardPath(path, sizeof(path), outDir, s, nShards, "txt");
+    if (!fileExists(path))
+      return;
+  }
+
+  snprintf(path, sizeof(path), "%s/merge.lock", outDir);
+  fd = tryLock(path);
+  if (fd < 0)
+  {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s/results.txt", outDir);
+  if (fileExists(path))
+  {
+    close(fd);
+    return;
+  }
+
+  heap = calloc(nShards, sizeof(mergeHead));
+  checkPtr(heap, "out of memory");
+  for (s=0; s<nShards; s++)
+  {
+    shardPath(path, sizeof(path), outDir, s, nShards, "txt");
+    heap[n].infile = fopen(path, "r");
+    checkPtr(heap[n].infile, path);
+    heap[n].shard = s;
+    if (getline(&heap[n].line, &heap[n].size, heap[n].infile) > 0)
+    {
+      n++;
+    }
+    else
+    {
+      fclose(heap[n].infile);
+      free(heap[n].line);
+      heap[n].line = NULL;
+    }
+  }
+  for (s=n/2-1; s>=0; s--)
+  {
+    siftDown(heap, n, s);
+  }
+
+  snprintf(path, sizeof(path), "%s/results.txt", outDir);
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  outfile = fopen(tmpPath, "w");
+  checkPtr(outfile, tmpPath);
+
+  while (n > 0)
+  {
+    fputs(heap[0].line, outfile);
+    if (getline(&heap[0].line, &heap[0].size, heap[0].infile) <= 0)
+    {
+      fclose(heap[0].infile);
+      free(heap[0].line);
+      heap[0] = heap[--n];
+    }
+    siftDown(heap, n, 0);
+  }
+
+  fflush(outfile);
+  fsync(fileno(outfile));
+  fclose(outfile);
+  if (rename(tmpPath, path) != 0)
+  {
+    fprintf(stderr, "Error -- cannot write %s\n", path);
+    exit(1);
+  }
+
+  free(heap);
+  close(fd);
+}
+
+/*
+ * Batch driver: fit shard `shard` of nShards, or with shard < 0 every
+ * unfinished shard that no other worker holds, then merge if all shards
+ * are done. Running one worker per node (or per core) with the same
+ * arguments splits the manifest without any further coordination. cfg
+ * holds one configuration per basis (nBases; see bases.c).
+ * Returns 0 on success, 1 if the requested shard is held by another worker.
+ */
+int runBatch(const fitConfig * cfg, int nBases, const char * manifest,
+    int dataRows, const char * outDir, int shard, int nShards)
+{
+  char path[PATH_MAX];
+  int s, first, last, fd;
+
+  if (mkdir(outDir, 0777) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "Error -- cannot create %s\n", outDir);
+    exit(1);
+  }
+
+  first = (shard < 0) ? 0 : shard;
+  last = (shard < 0) ? nShards - 1 : shard;
+
+  for (s=first; s<=last; s++)
+  {
+    shardPath(path, sizeof(path), outDir, s, nShards, "txt");
+    if (fileExists(path))
+      continue;
+
+    shardPath(path, sizeof(path), outDir, s, nShards, "lock");
+    fd = tryLock(path);
+    if (fd < 0)
+    {
+      if (shard >= 0)
+      {
+        fprintf(stderr, "Error -- shard %d of %d is held by another "
+            "worker\n", s, nShards);
+        return 1;
+      }
+      continue;
+    }
+
+    // Recheck: a previous holder may have finished since the check above
+    shardPath(path, sizeof(path), outDir, s, nShards, "txt");
+    if (!fileExists(path))
+    {
+      runShard(cfg, nBases, manifest, dataRows, outDir, s, nShards);
+    }
+    close(fd);
+  }
+
+  mergeShards(outDir, nShards);
+
+  return 0;
+}
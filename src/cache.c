@@ -0,0 +1,323 @@
+/*
+ * cache.c
+ *
+ *  On-disk cache of result lines keyed by a content hash
+ *
+ *  Each entry is a file named by its 64-bit key (16 hex digits) holding the
+ *  result lines without their ID, so an unchanged series can be reported
+ *  under any ID. Usage is recorded in DIR/index, an append-only log of
+ *  fixed-size records (key, entry bytes, time of last use) behind a short
+ *  header. When the log has doubled since it was last compacted, the
+ *  process holding its lock keeps the latest record per key and evicts
+ *  least recently used entries until the cache is within its size limit
+ *  (kCacheMaxMB, or ROWAVEDT_CACHE_MB megabytes).
+ */
+
+#include "rowavedt.h"
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+// 64-bit FNV-1a parameters
+const uint64_t kFnvOffset = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+// Default limit on the total size of cache entries, in megabytes
+const double kCacheMaxMB = 256;
+
+// Eviction brings the cache down to this fraction of its limit
+const double kCacheEvictTo = 0.9;
+
+// Index growth allowed beyond twice its compacted size before compacting
+const long kCacheCompactSlack = 1 << 16;
+
+static const char kCacheMagic[8] = {'R', 'W', 'D', 'T', 'I', 'D', 'X', '1'};
+
+typedef struct {
+  char magic[8];
+  uint64_t compactBytes;
+} cacheHeader;
+
+typedef struct {
+  uint64_t key;
+  uint32_t bytes;
+  uint32_t used;
+} cacheRecord;
+
+uint64_t fnv1a(const void * data, size_t len, uint64_t hash)
+{
+  const unsigned char * p = data;
+  size_t i;
+
+  for (i=0; i<len; i++)
+  {
+    hash ^= p[i];
+    hash *= kFnvPrime;
+  }
+
+  return hash;
+}
+
+// Mix the identity of a file (device, inode, size, modification time) into
+// hash, so a rewritten basis or prior file changes every key that uses it
+uint64_t fnv1aFileIdentity(const char * fname, uint64_t hash)
+{
+  struct stat st;
+  int64_t id[4] = {0, 0, 0, 0};
+
+  if (stat(fname, &st) == 0)
+  {
+    id[0] = (int64_t) st.st_dev;
+    id[1] = (int64_t) st.st_ino;
+    id[2] = (int64_t) st.st_size;
+    id[3] = (int64_t) st.st_mtime;
+  }
+
+  return fnv1a(id, sizeof(id), hash);
+}
+
+static void cacheEntryPath(char * path, size_t size, const char * dir,
+    uint64_t key)
+{
+  snprintf(path, size, "%s/%016llx", dir, (unsigned long long) key);
+}
+
+static int compareRecordKey(const void * a, const void * b)
+{
+  const cacheRecord * x = a, * y = b;
+  if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+  return (x->used > y->used) - (x->used < y->used);
+}
+
+static int compareRecordUsed(const void * a, const void * b)
+{
+  const cacheRecord * x = a, * y = b;
+  return (x->used > y->used) - (x->used < y->used);
+}
+
+/*
+ * Rewrite the index with one record per live entry, evicting the least
+ * recently used entries while the total exceeds the size limit
+ * Caller holds the lock on the current index (fd)
+ */
+static void cacheCompact(const char * dir, int fd, long indexBytes)
+{
+  long nRec, i, nLive;
+  double limit, total;
+  const char * env;
+  char path[PATH_MAX], tmpPath[PATH_MAX + 32];
+  cacheHeader header;
+  cacheRecord * rec;
+  struct stat st;
+  FILE * outfile;
+
+  env = getenv("ROWAVEDT_CACHE_MB");
+  limit = ((env != NULL && atof(env) > 0) ? atof(env) : kCacheMaxMB) * 1e6;
+
+  nRec = (indexBytes - (long) sizeof(cacheHeader)) / sizeof(cacheRecord);
+  if (nRec <= 0)
+  {
+    return;
+  }
+
+  rec = malloc(nRec * sizeof(cacheRecord));
+  checkPtr(rec, "out of memory");
+  if (pread(fd, rec, nRec * sizeof(cacheRecord), sizeof(cacheHeader)) !=
+      (ssize_t) (nRec * sizeof(cacheRecord)))
+  {
+    free(rec);
+    return;
+  }
+
+  // Latest record per key, for entries that still exist
+  qsort(rec, nRec, sizeof(cacheRecord), compareRecordKey);
+  nLive = 0;
+  total = 0;
+  for (i=0; i<nRec; i++)
+  {
+    if (i+1 < nRec && rec[i+1].key == rec[i].key)
+      continue;
+    cacheEntryPath(path, sizeof(path), dir, rec[i].key);
+    if (stat(path, &st) != 0)
+      continue;
+    rec[i].bytes = (uint32_t) st.st_size;
+    rec[nLive++] = rec[i];
+    total += st.st_size;
+  }
+
+  // Evict least recently used entries
+  i = 0;
+  if (total > limit)
+  {
+    qsort(rec, nLive, sizeof(cacheRecord), compareRecordUsed);
+    for (; i<nLive && total > kCacheEvictTo * limit; i++)
+    {
+      cacheEntryPath(path, sizeof(path), dir, rec[i].key);
+      unlink(path);
+      total -= rec[i].bytes;
+    }
+  }
+
+  // Replace index
+  snprintf(path, sizeof(path), "%s/index", dir);
+  snprintf(tmpPath, sizeof(tmpPath), "%s/index.%d.tmp", dir, (int) getpid());
+  outfile = fopen(tmpPath, "wb");
+  if (outfile != NULL)
+  {
+    memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+    header.compactBytes = sizeof(cacheHeader) +
+      (nLive - i) * sizeof(cacheRecord);
+    fwrite(&header, sizeof(cacheHeader), 1, outfile);
+    fwrite(&rec[i], sizeof(cacheRecord), nLive - i, outfile);
+    if (fclose(outfile) == 0)
+      rename(tmpPath, path);
+    else
+      unlink(tmpPath);
+  }
+
+  free(rec);
+}
+
+// Append a usage record to the index, compacting it if it has grown
+static void cacheRecordUse(const char * dir, uint64_t key, long bytes)
+{
+  char path[PATH_MAX];
+  struct stat st, stPath;
+  cacheHeader header;
+  cacheRecord rec;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/index", dir);
+
+  // Lock the current index; retry if it was replaced while waiting
+  for (;;)
+  {
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+      return;
+    if (flock(fd, LOCK_EX) != 0)
+    {
+      close(fd);
+      return;
+    }
+    if (fstat(fd, &st) == 0 && stat(path, &stPath) == 0 &&
+        st.st_ino == stPath.st_ino && st.st_dev == stPath.st_dev)
+      break;
+    close(fd);
+  }
+
+  if (st.st_size < (off_t) sizeof(cacheHeader) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0)
+  {
+    // New or unreadable index: start over
+    if (ftruncate(fd, 0) == 0)
+    {
+      memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+      header.compactBytes = sizeof(cacheHeader);
+      if (write(fd, &header, sizeof(header)) != sizeof(header))
+      {
+        close(fd);
+        return;
+      }
+    }
+    st.st_size = sizeof(cacheHeader);
+  }
+
+  rec.key = key;
+  rec.bytes = (uint32_t) bytes;
+  rec.used = (uint32_t) time(NULL);
+  if (write(fd, &rec, sizeof(rec)) == sizeof(rec))
+    st.st_size += sizeof(rec);
+
+  if (st.st_size > 2 * (long) header.compactBytes + kCacheCompactSlack)
+  {
+    cacheCompact(dir, fd, st.st_size);
+  }
+
+  close(fd);
+}
+
+/*
+ * Write the cached lines for key to outfile, each prefixed by idString
+ * Returns 1 on a hit, 0 if there is no entry
+ */
+int cacheLookup(const char * dir, uint64_t key, const char * idString,
+    FILE * outfile)
+{
+  char path[PATH_MAX];
+  char * line = NULL;
+  size_t lineSize = 0;
+  long bytes = 0;
+  ssize_t len;
+  FILE * infile;
+
+  cacheEntryPath(path, sizeof(path), dir, key);
+  infile = fopen(path, "r");
+  if (infile == NULL)
+  {
+    return 0;
+  }
+
+  while ((len = getline(&line, &lineSize, infile)) > 0)
+  {
+    fprintf(outfile, "%s %s", idString, line);
+    bytes += len;
+  }
+
+  free(line);
+  fclose(infile);
+
+  cacheRecordUse(dir, key, bytes);
+
+  return 1;
+}
+
+/*
+ * Store result lines (as written by writeResult, including IDs) under key
+ * The ID, up to the first space of each line, is dropped. Failures to
+ * write are ignored: the cache only ever saves work.
+ */
+void cacheStore(const char * dir, uint64_t key, const char * lines)
+{
+  char path[PATH_MAX], tmpPath[PATH_MAX + 32];
+  const char * line, * rest, * next;
+  long bytes = 0;
+  FILE * outfile;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+  {
+    return;
+  }
+
+  cacheEntryPath(path, sizeof(path), dir, key);
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int) getpid());
+
+  outfile = fopen(tmpPath, "w");
+  if (outfile == NULL)
+  {
+    return;
+  }
+
+  for (line=lines; *line != '\0'; line=next)
+  {
+    next = strchr(line, '\n');
+    next = (next == NULL) ? line + strlen(line) : next + 1;
+    rest = memchr(line, ' ', next - line);
+    rest = (rest == NULL) ? line : rest + 1;
+    fwrite(rest, 1, next - rest, outfile);
+    bytes += next - rest;
+  }
+
+  if (fclose(outfile) != 0 || rename(tmpPath, path) != 0)
+  {
+    unlink(tmpPath);
+    return;
+  }
+
+  cacheRecordUse(dir, key, bytes);
+}
@@ -0,0 +1,296 @@
+/*
+ * calibrate.c
+ *
+ *  Empirical calibration of the LLR null distribution for one cadence
+ */
+
+#include "rowavedt.h"
+
+// Upper-tail probabilities of the null quantile table. Must match
+// kNullTailProbs in scripts/screen_time_series.R.
+const double kNullTailProbs[] = {0.5, 0.2, 0.1, 0.05, 0.02, 0.01, 0.005,
+  0.002, 0.001, 0.0005, 0.0002, 0.0001};
+const int kNumNullTailProbs = sizeof(kNullTailProbs) / sizeof(double);
+
+// Inputs shared by all workers, read-only except for llrNull and the
+// per-node design replicas
+typedef struct {
+  double * dMat_m, * dMat_l;
+  numaTopology * topo;
+  double ** nodeDMat_m, ** nodeDMat_l;
+  pthread_mutex_t replicaLock;
+  int n, basisRows, basisCols, kSmooth, regular;
+  double * fitted, * resid, * priorVec, * coef_l;
+  double nu, tau_l, tol;
+  int maxIter;
+  char nullModel;
+  int nRep, nThreads;
+  unsigned long seed;
+  double * llrNull;
+} calibrationTask;
+
+typedef struct {
+  calibrationTask * task;
+  int thread;
+} calibrationWorkerArg;
+
+// Copy of src made by the calling thread, so its pages are local to the
+// thread's node
+static double * replicate(const double * src, size_t n)
+{
+  double * copy;
+
+  copy = malloc(n * sizeof(double));
+  checkPtr(copy, "out of memory");
+  memcpy(copy, src, n * sizeof(double));
+
+  return copy;
+}
+
+// Fit replicates thread, thread + nThreads, ...; each replicate has its own
+// seeded generator, so results do not depend on the number of threads
+static void * calibrationWorker(void * arg)
+{
+  calibrationTask * task = ((calibrationWorkerArg *) arg)->task;
+  int thread = ((calibrationWorkerArg *) arg)->thread;
+  int n = task->n, r, i, node, warm_m, warm_l;
+  double logPosterior_m, logLikelihood_m, tau_m;
+  double logPosterior_l, logLikelihood_l, tau_l;
+  double scale = sqrt(task->tau_l);
+  double * dMat_m = task->dMat_m, * dMat_l = task->dMat_l;
+
+  // On NUMA systems, pin to a node and read designs from its replica; the
+  // workspaces below and in lmTDesign are then allocated on that node too
+  if (task->topo->nNodes > 1)
+  {
+    node = numaThreadNode(task->topo, thread);
+    numaPinThread(task->topo, node);
+
+    pthread_mutex_lock(&task->replicaLock);
+    if (task->nodeDMat_m[node] == NULL)
+    {
+      task->nodeDMat_m[node] = replicate(task->dMat_m,
+          (size_t) (n + task->basisCols - 1) * task->basisCols);
+      task->nodeDMat_l[node] = replicate(task->dMat_l,
+          (size_t) (n + task->kSmooth - 1) * task->kSmooth);
+    }
+    dMat_m = task->nodeDMat_m[node];
+    dMat_l = task->nodeDMat_l[node];
+    pthread_mutex_unlock(&task->replicaLock);
+  }
+
+  double * yRep, * noise, * coef_m, * coef_l;
+  yRep = calloc(n, sizeof(double));
+  checkPtr(yRep, "out of memory");
+  noise = malloc(n * sizeof(double));
+  checkPtr(noise, "out of memory");
+  coef_m = calloc(task->basisCols, sizeof(double));
+  checkPtr(coef_m, "out of memory");
+  coef_l = calloc(task->kSmooth, sizeof(double));
+  checkPtr(coef_l, "out of memory");
+
+  gsl_rng * rng = gsl_rng_alloc(gsl_rng_mt19937);
+  checkPtr(rng, "out of memory");
+
+  for (r=thread; r<task->nRep; r+=task->nThreads)
+  {
+    gsl_rng_set(rng, task->seed + r);
+
+    // Draw replicate from smooth (null) fit plus noise
+    switch (task->nullModel)
+    {
+      case 'g':
+        for (i=0; i<n; i++)
+          noise[i] = gsl_ran_gaussian(rng, scale);
+        break;
+      case 't':
+        for (i=0; i<n; i++)
+          noise[i] = isinf(task->nu) ? gsl_ran_gaussian(rng, scale) :
+            scale * gsl_ran_tdist(rng, task->nu);
+        break;
+      default:
+        dcopy(n, task->resid, 1, noise, 1);
+        gsl_ran_shuffle(rng, noise, n, sizeof(double));
+    }
+
+    for (i=0; i<n; i++)
+    {
+      yRep[i] = task->fitted[i] + noise[i];
+    }
+
+    // Start both models as fitNuGrid starts an observed series
+    warm_m = task->regular && projectInit(dMat_m, n, task->basisCols,
+        task->basisRows, yRep, task->priorVec, coef_m);
+    warm_l = task->regular && projectInit(dMat_l, n, task->kSmooth,
+        task->basisRows, yRep, task->priorVec, coef_l);
+    tau_m = 0;
+    tau_l = 0;
+
+    lmTDesign(dMat_m, n, task->basisCols, yRep, task->priorVec,
+        task->nu, task->maxIter, task->tol,
+        &logPosterior_m, &logLikelihood_m, coef_m, &tau_m, warm_m);
+
+    lmTDesign(dMat_l, n, task->kSmooth, yRep, task->priorVec,
+        task->nu, task->maxIter, task->tol,
+        &logPosterior_l, &logLikelihood_l, coef_l, &tau_l, warm_l);
+
+    task->llrNull[r] = 2 * (logLikelihood_m - logLikelihood_l);
+  }
+
+  gsl_rng_free(rng);
+  free(yRep);
+  free(noise);
+  free(coef_m);
+  free(coef_l);
+
+  return NULL;
+}
+
+/*
+ * Simulate the null distribution of the LLR on the cadence of one series
+ * Fills llrNull with nRep replicates; returns 0
+ *
+ * The smooth (kSmooth) model is fit to the observed series, and replicates
+ * are drawn from it with noise that is Gaussian ('g') or t ('t') at the
+ * fitted scale, or a permutation of its residuals ('p'). Both models are
+ * fit to each replicate from the start fitNuGrid would use for an observed
+ * series, on designs built once and shared by nThreads threads. On NUMA
+ * systems threads are pinned to nodes and each node reads its own copy of
+ * the designs (see numa.c). Times must already be rescaled (see
+ * rescaleTimes).
+ */
+int calibrateNull(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int kSmooth,
+    int maxIter, double tol,
+    char nullModel, int nRep, int nThreads, unsigned long seed,
+    double * llrNull)
+{
+  int i, warmStart;
+  double logPosterior_l, logLikelihood_l;
+  calibrationTask task;
+
+  task.n = n;
+  task.basisRows = basisRows;
+  task.basisCols = basisCols;
+  task.kSmooth = kSmooth;
+  task.priorVec = priorVec;
+  task.nu = nu;
+  task.maxIter = maxIter;
+  task.tol = tol;
+  task.nullModel = nullModel;
+  task.nRep = nRep;
+  task.nThreads = (nThreads < 1) ? 1 : nThreads;
+  task.seed = seed;
+  task.llrNull = llrNull;
+
+  // Shared designs
+  task.dMat_m = buildDesign(basisMat, basisRows, timeVec, n, basisCols);
+  task.dMat_l = buildDesign(basisMat, basisRows, timeVec, n, kSmooth);
+
+  // Null fit to observed series, started as in fitNuGrid
+  task.regular = regularSampling(timeVec, n, basisRows, basisCols) &&
+    regularSampling(timeVec, n, basisRows, kSmooth);
+  task.coef_l = calloc(kSmooth, sizeof(double));
+  checkPtr(task.coef_l, "out of memory");
+  task.fitted = malloc(n * sizeof(double));
+  checkPtr(task.fitted, "out of memory");
+  task.resid = malloc(n * sizeof(double));
+  checkPtr(task.resid, "out of memory");
+
+  warmStart = task.regular && projectInit(task.dMat_l, n, kSmooth, basisRows,
+      yVec, priorVec, task.coef_l);
+  task.tau_l = 0;
+  lmTDesign(task.dMat_l, n, kSmooth, yVec, priorVec, nu, maxIter, tol,
+      &logPosterior_l, &logLikelihood_l, task.coef_l, &task.tau_l,
+      warmStart);
+
+  dgemv('n', n, kSmooth, 1, task.dMat_l, n + kSmooth - 1, task.coef_l, 1,
+      0, task.fitted, 1);
+  for (i=0; i<n; i++)
+  {
+    task.resid[i] = yVec[i] - task.fitted[i];
+  }
+
+  // Per-node design replicas, made by the first worker on each node
+  numaTopology topo;
+  readNumaTopology(&topo);
+  task.topo = &topo;
+  task.nodeDMat_m = calloc(topo.nNodes, sizeof(double *));
+  checkPtr(task.nodeDMat_m, "out of memory");
+  task.nodeDMat_l = calloc(topo.nNodes, sizeof(double *));
+  checkPtr(task.nodeDMat_l, "out of memory");
+  pthread_mutex_init(&task.replicaLock, NULL);
+
+  // Run replicates
+  pthread_t threads[task.nThreads];
+  calibrationWorkerArg args[task.nThreads];
+
+  for (i=0; i<task.nThreads; i++)
+  {
+    args[i].task = &task;
+    args[i].thread = i;
+    if (pthread_create(&threads[i], NULL, calibrationWorker, &args[i]) != 0)
+    {
+      fprintf(stderr, "Error -- could not start thread\n");
+      exit(1);
+    }
+  }
+
+  for (i=0; i<task.nThreads; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i=0; i<topo.nNodes; i++)
+  {
+    free(task.nodeDMat_m[i]);
+    free(task.nodeDMat_l[i]);
+  }
+  free(task.nodeDMat_m);
+  free(task.nodeDMat_l);
+  pthread_mutex_destroy(&task.replicaLock);
+  freeNumaTopology(&topo);
+
+  free(task.dMat_m);
+  free(task.dMat_l);
+  free(task.coef_l);
+  free(task.fitted);
+  free(task.resid);
+
+  return 0;
+}
+
+// Write one row of the null quantile table (see kHelpMessage for columns)
+void writeNullQuantiles(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, double nu,
+    double * llrNull, int nRep)
+{
+  int i, lo;
+  double pos, frac;
+
+  qsort(llrNull, nRep, sizeof(double), compare_dbl);
+
+  fprintf(outfile, "%s %d %d %d %g %d ", idString, nObs, basisCols, kSmooth,
+      nu, nRep);
+
+  // Interpolated upper quantiles; NA where replicates cannot resolve them
+  for (i=0; i<kNumNullTailProbs; i++)
+  {
+    if (kNullTailProbs[i] * nRep < 1)
+    {
+      fprintf(outfile, "NA ");
+      continue;
+    }
+    pos = (1 - kNullTailProbs[i]) * (nRep - 1);
+    lo = (int) floor(pos);
+    frac = pos - lo;
+    if (lo + 1 < nRep)
+      fprintf(outfile, "%g ", llrNull[lo] * (1 - frac) + llrNull[lo+1] * frac);
+    else
+      fprintf(outfile, "%g ", llrNull[lo]);
+  }
+  fprintf(outfile, "\n");
+}
@@ -26,12 +26,19 @@ double dnorm_log(double * x, int n, double location, double scale)
 }
 
 // Compute sum of log-density for t distribution
-// Omits normalizing constants
+// Omits normalizing constants; infinite df gives the normal (dnorm_log)
 double dt_log(double * x, int n, double df, double location, double scale)
 {
   int i;
   double logDensity = 0, z, logScale;
 
+  if (isinf(df))
+  {
+    return dnorm_log(x, n, location, scale);
+  }
+
+  TRACE_BEGIN(TRACE_DTLOG);
+
   logScale = log(scale);
 
   for (i=0; i<n; i++)
@@ -40,5 +47,28 @@ double dt_log(double * x, int n, double df, double location, double scale)
     logDensity += -(df+1)/2 * log(1 + z*z/df) - logScale;
   }
 
+  TRACE_END(TRACE_DTLOG, n * sizeof(double));
+
   return logDensity;
 }
+
+// Normalizing constants omitted by dt_log for n observations
+double dt_logConst(int n, double df)
+{
+  if (isinf(df))
+  {
+    return -0.5 * n * log(2 * M_PI);
+  }
+  return n * (lgamma((df+1)/2) - lgamma(df/2) - 0.5 * log(df * M_PI));
+}
+
+// E-step weight of a residual with t errors of scale sqrt(tau)
+// Infinite df (normal errors) gives weight 1
+double tWeight(double resid, double tau, double df)
+{
+  if (isinf(df))
+  {
+    return 1;
+  }
+  return (df + 1) / (df + resid*resid/tau);
+}
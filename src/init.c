@@ -0,0 +1,97 @@
+/*
+ * init.c
+ *
+ *  Starting values for regularly sampled series
+ */
+
+#include "rowavedt.h"
+
+// Largest fraction of observations that may be out of place relative to
+// uniform sampling for a series to count as near-regular
+const double kRegularMaxMove = 0.1;
+
+// Largest residual of the unit-weight normal equations, relative to |X'y|,
+// for which the projection replaces their solve as the EM start
+const double kProjectMaxResid = 1e-2;
+
+/*
+ * Check whether rescaled times sample the basis grid nearly uniformly
+ * Returns 1 if at most kRegularMaxMove of the observations would have to
+ * move for each block of basisRows / k rows (the finest scale of a k-column
+ * basis) to hold n / k of them, else 0
+ */
+int regularSampling(double * timeVec, int n, int basisRows, int k)
+{
+  int i, b, row;
+  double move = 0;
+
+  if (n < k)
+  {
+    return 0;
+  }
+
+  int counts[k];
+  memset(counts, 0, k * sizeof(int));
+
+  for (i=0; i<n; i++)
+  {
+    row = (int) floor(timeVec[i] + 0.5);
+    b = (int) ((long) row * k / basisRows);
+    counts[(b < k) ? b : k-1]++;
+  }
+
+  for (b=0; b<k; b++)
+  {
+    move += fabs(counts[b] - (double) n / k);
+  }
+
+  return (move / 2 <= kRegularMaxMove * n);
+}
+
+/*
+ * Starting coefficients for a near-regularly sampled series
+ *
+ * With orthonormal basis columns and n observations spread evenly over
+ * basisRows rows, X'X is close to (n / basisRows) I, so the unit-weight
+ * regression that starts EM reduces to the wavelet coefficients X'y shrunk
+ * by the prior: coef_j = (X'y)_j / (n / basisRows + priorVec[j-1]), with no
+ * prior on the first coefficient. Neither condition is assumed: the
+ * projection is accepted only if it solves the normal equations
+ * (X'X + prior) coef = X'y to within kProjectMaxResid, checked with two
+ * more passes over the design. This costs O(nk) instead of forming and
+ * factoring X'X.
+ * dMat is the design from buildDesign; only its first n rows are used.
+ * Returns 1 if coef holds the start, or 0 if the caller should start from
+ * the usual solve
+ */
+int projectInit(double * dMat, int n, int k, int basisRows,
+    double * yVec, double * priorVec, double * coef)
+{
+  int j;
+  double scale = (double) n / basisRows, * fitted, resid, xty[k], grad[k];
+
+  dgemv('t', n, k, 1, dMat, n + k - 1, yVec, 1, 0, xty, 1);
+
+  coef[0] = xty[0] / scale;
+  for (j=1; j<k; j++)
+  {
+    coef[j] = xty[j] / (scale + priorVec[j-1]);
+  }
+
+  // grad = X'X coef + prior coef - X'y
+  fitted = malloc(n * sizeof(double));
+  checkPtr(fitted, "out of memory");
+  dgemv('n', n, k, 1, dMat, n + k - 1, coef, 1, 0, fitted, 1);
+  dgemv('t', n, k, 1, dMat, n + k - 1, fitted, 1, 0, grad, 1);
+  free(fitted);
+
+  resid = 0;
+  for (j=0; j<k; j++)
+  {
+    grad[j] += ((j > 0) ? priorVec[j-1] * coef[j] : 0) - xty[j];
+    resid += grad[j] * grad[j];
+  }
+
+  return (resid <= kProjectMaxResid * kProjectMaxResid *
+      ddot(k, xty, 1, xty, 1));
+}
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <math.h>
 
+#include "interfaceBLAS-LAPACK.h"
+
 inline int max(int a, int b) {
   return a > b ? a : b;
 }
@@ -24,9 +26,20 @@ extern double dasum_(int * N, double * X, int * INCX);
 
 double dasum(int N, double * X, int INCX)
 {
+  if (reproKernels)
+    return reproDasum(N, X, INCX);
   return dasum_(&N, X, &INCX);
 }
 
+extern double ddot_(int * N, double * X, int * INCX, double * Y, int * INCY);
+
+double ddot(int N, double * X, int INCX, double * Y, int INCY)
+{
+  if (reproKernels)
+    return reproDdot(N, X, INCX, Y, INCY);
+  return ddot_(&N, X, &INCX, Y, &INCY);
+}
+
 extern void dcopy_(int * N, double * X, int * INCX, double * Y, int * INCY);
 
 void dcopy(int N, double * X, int INCX, double * Y, int INCY)
@@ -39,6 +52,11 @@ extern void daxpy_(int * N, double * ALPHA, double * X, int * INCX,
 
 void daxpy(int N, double ALPHA, double * X, int INCX, double * Y, int INCY)
 {
+  if (reproKernels)
+  {
+    reproDaxpy(N, ALPHA, X, INCX, Y, INCY);
+    return;
+  }
   daxpy_(&N, &ALPHA, X, &INCX, Y, &INCY);
 }
 
@@ -49,9 +67,31 @@ extern void dgemv_(char * TRANS, int * M, int * N, double * ALPHA, double * A,
 void dgemv(char TRANS, int M, int N, double ALPHA, double * A, int LDA,
     double * X, int INCX, double BETA, double * Y, int INCY)
 {
+  if (reproKernels)
+  {
+    reproDgemv(TRANS, M, N, ALPHA, A, LDA, X, INCX, BETA, Y, INCY);
+    return;
+  }
   dgemv_(&TRANS, &M, &N, &ALPHA, A, &LDA, X, &INCX, &BETA, Y, &INCY);
 }
 
+extern void dgemm_(char * TRANSA, char * TRANSB, int * M, int * N, int * K,
+    double * ALPHA, double * A, int * LDA, double * B, int * LDB,
+    double * BETA, double * C, int * LDC);
+
+void dgemm(char TRANSA, char TRANSB, int M, int N, int K, double ALPHA,
+    double * A, int LDA, double * B, int LDB, double BETA,
+    double * C, int LDC)
+{
+  if (reproKernels)
+  {
+    reproDgemm(TRANSA, TRANSB, M, N, K, ALPHA, A, LDA, B, LDB, BETA, C, LDC);
+    return;
+  }
+  dgemm_(&TRANSA, &TRANSB, &M, &N, &K, &ALPHA, A, &LDA, B, &LDB, &BETA,
+      C, &LDC);
+}
+
 extern void dsyrk_(char * UPLO, char * TRANS, int * N, int * K,
     double * ALPHA, double * A, int * LDA, double * BETA,
     double * C,  int *LDC);
@@ -59,6 +99,11 @@ extern void dsyrk_(char * UPLO, char * TRANS, int * N, int * K,
 void dsyrk(char UPLO, char TRANS, int N, int K, double ALPHA,
     double* A, int LDA, double BETA, double* C, int LDC)
 {
+  if (reproKernels)
+  {
+    reproDsyrk(UPLO, TRANS, N, K, ALPHA, A, LDA, BETA, C, LDC);
+    return;
+  }
   dsyrk_(&UPLO, &TRANS, &N, &K, &ALPHA, A, &LDA, &BETA, C, &LDC);
 }
 
@@ -69,10 +114,49 @@ int dposv(char UPLO, int N, int NRHS, double * A, int LDA,
     double * B, int LDB)
 {
   int INFO;
+  if (reproKernels)
+    return reproDposv(UPLO, N, NRHS, A, LDA, B, LDB);
   dposv_(&UPLO, &N, &NRHS, A, &LDA, B, &LDB, &INFO);
   return INFO;
 }
 
+extern void dgesv_(int * N, int * NRHS, double * A, int * LDA, int * IPIV,
+    double * B, int * LDB, int * INFO);
+
+int dgesv(int N, int NRHS, double * A, int LDA, int * IPIV,
+    double * B, int LDB)
+{
+  int INFO;
+  if (reproKernels)
+    return reproDgesv(N, NRHS, A, LDA, IPIV, B, LDB);
+  dgesv_(&N, &NRHS, A, &LDA, IPIV, B, &LDB, &INFO);
+  return INFO;
+}
+
+extern void dpotrf_(char * UPLO, int * N, double * A, int * LDA, int * INFO);
+
+int dpotrf(char UPLO, int N, double * A, int LDA)
+{
+  int INFO;
+  if (reproKernels)
+    return reproDpotrf(UPLO, N, A, LDA);
+  dpotrf_(&UPLO, &N, A, &LDA, &INFO);
+  return INFO;
+}
+
+extern void dpotrs_(char * UPLO, int * N, int * NRHS, double * A, int * LDA,
+    double * B, int * LDB, int * INFO);
+
+int dpotrs(char UPLO, int N, int NRHS, double * A, int LDA,
+    double * B, int LDB)
+{
+  int INFO;
+  if (reproKernels)
+    return reproDpotrs(UPLO, N, NRHS, A, LDA, B, LDB);
+  dpotrs_(&UPLO, &N, &NRHS, A, &LDA, B, &LDB, &INFO);
+  return INFO;
+}
+
 extern void dgels_(char * TRANS, int * M, int * N, int * NHRS,
     double * A, int * LDA, double * B, int * LDB, double * WORK,
     int * LWORK, int * INFO);
@@ -102,3 +186,34 @@ int dgels(char TRANS, int M, int N, int NRHS, double * A, int LDA,
   return INFO;
 }
 
+
+extern void sgemv_(char * TRANS, int * M, int * N, float * ALPHA, float * A,
+    int * LDA, float * X, int * INCX, float * BETA,
+    float * Y, int * INCY);
+
+void sgemv(char TRANS, int M, int N, float ALPHA, float * A, int LDA,
+    float * X, int INCX, float BETA, float * Y, int INCY)
+{
+  sgemv_(&TRANS, &M, &N, &ALPHA, A, &LDA, X, &INCX, &BETA, Y, &INCY);
+}
+
+extern void ssyrk_(char * UPLO, char * TRANS, int * N, int * K,
+    float * ALPHA, float * A, int * LDA, float * BETA,
+    float * C,  int *LDC);
+
+void ssyrk(char UPLO, char TRANS, int N, int K, float ALPHA,
+    float* A, int LDA, float BETA, float* C, int LDC)
+{
+  ssyrk_(&UPLO, &TRANS, &N, &K, &ALPHA, A, &LDA, &BETA, C, &LDC);
+}
+
+extern void sposv_(char * UPLO, int * N, int * NRHS, float * A, int * LDA,
+    float * B, int * LDB, int * INFO);
+
+int sposv(char UPLO, int N, int NRHS, float * A, int LDA,
+    float * B, int LDB)
+{
+  int INFO;
+  sposv_(&UPLO, &N, &NRHS, A, &LDA, B, &LDB, &INFO);
+  return INFO;
+}
@@ -12,6 +12,8 @@ void dscal(int N, double ALPHA, double * X, int INCX);
 
 double dasum(int N, double * X, int INCX);
 
+double ddot(int N, double * X, int INCX, double * Y, int INCY);
+
 void dcopy(int N, double * X, int INCX, double * Y, int INCY);
 
 void daxpy(int N, double ALPHA, double * X, int INCX, double * Y, int INCY);
@@ -19,13 +21,58 @@ void daxpy(int N, double ALPHA, double * X, int INCX, double * Y, int INCY);
 void dgemv(char TRANS, int M, int N, double ALPHA, double * A, int LDA,
     double * X, int INCX, double BETA, double * Y, int INCY);
 
+void dgemm(char TRANSA, char TRANSB, int M, int N, int K, double ALPHA,
+    double * A, int LDA, double * B, int LDB, double BETA,
+    double * C, int LDC);
 void dsyrk(char UPLO, char TRANS, int N, int K, double ALPHA,
     double* A, int LDA, double BETA, double* C, int LDC);
 
 int dposv(char UPLO, int N, int NRHS, double * A, int LDA,
     double * B, int LDB);
 
+int dgesv(int N, int NRHS, double * A, int LDA, int * IPIV,
+    double * B, int LDB);
+
+int dpotrf(char UPLO, int N, double * A, int LDA);
+
+int dpotrs(char UPLO, int N, int NRHS, double * A, int LDA,
+    double * B, int LDB);
+
 int dgels(char TRANS, int M, int N, int NHRS, double * A, int LDA,
     double * B, int LDB);
 
+// Single precision
+void sgemv(char TRANS, int M, int N, float ALPHA, float * A, int LDA,
+    float * X, int INCX, float BETA, float * Y, int INCY);
+
+void ssyrk(char UPLO, char TRANS, int N, int K, float ALPHA,
+    float* A, int LDA, float BETA, float* C, int LDC);
+
+int sposv(char UPLO, int N, int NRHS, float * A, int LDA,
+    float * B, int LDB);
+
+// Fixed-order kernels (repro.c), used by the double-precision wrappers
+// above when reproKernels is set
+extern int reproKernels;
+
+double reproDasum(int N, const double * X, int INCX);
+double reproDdot(int N, const double * X, int INCX,
+    const double * Y, int INCY);
+void reproDaxpy(int N, double ALPHA, const double * X, int INCX,
+    double * Y, int INCY);
+void reproDgemv(char TRANS, int M, int N, double ALPHA, const double * A,
+    int LDA, const double * X, int INCX, double BETA, double * Y, int INCY);
+void reproDgemm(char TRANSA, char TRANSB, int M, int N, int K, double ALPHA,
+    const double * A, int LDA, const double * B, int LDB, double BETA,
+    double * C, int LDC);
+void reproDsyrk(char UPLO, char TRANS, int N, int K, double ALPHA,
+    const double * A, int LDA, double BETA, double * C, int LDC);
+int reproDpotrf(char UPLO, int N, double * A, int LDA);
+int reproDpotrs(char UPLO, int N, int NRHS, const double * A, int LDA,
+    double * B, int LDB);
+int reproDposv(char UPLO, int N, int NRHS, double * A, int LDA,
+    double * B, int LDB);
+int reproDgesv(int N, int NRHS, double * A, int LDA, int * IPIV,
+    double * B, int LDB);
+
 #endif /* INTERFACEBLASLAPACK_H_ */
@@ -5,6 +5,10 @@
  * Function to run wavelet model for irregularly sampled data
  * Returns number of iterations run
  * Log-posterior, log-likelihood, and coefficients are returned by reference
+ * Times must already be rescaled to [0, basisRows-1] (see rescaleTimes)
+ * If warmStart is nonzero, coef and tau hold starting values on input;
+ * otherwise near-regularly sampled series start from projectInit where it
+ * solves the first regression
  */
 
 int lmT(double * basisMat, int basisRows, int basisCols,
@@ -16,52 +20,96 @@ int lmT(double * basisMat, int basisRows, int basisCols,
     double * logPosterior,
     double * logLikelihood,
     double * coef,
-    double * tau)
+    double * tau,
+    int warmStart)
 {
-  // Initialize workspace variables
-  int iter, i, j, m, tme;
-  double logPosterior_tm1, logPrior, delta;
-  m = n + k - 1;
+  int iter;
+  double * dMat;
 
-  // Rescale times
-  double minTime, maxTime;
-  arrayMinMax(timeVec, n, &minTime, &maxTime);
+  dMat = buildDesign(basisMat, basisRows, timeVec, n, k);
 
-  for (i=0; i<n; i++)
+  // Start near-regular series from the projection instead of a first solve
+  if (!warmStart && regularSampling(timeVec, n, basisRows, k) &&
+      projectInit(dMat, n, k, basisRows, yVec, priorVec, coef))
   {
-    timeVec[i] = (timeVec[i] - minTime) / (maxTime - minTime);
-    timeVec[i] = timeVec[i] * (basisRows-1);
+    (*tau) = 0;
+    warmStart = 1;
   }
 
-  /*
-   * Setup dmat and dvec
-   */
+  iter = lmTDesign(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, warmStart);
 
-  double * dMat, * dVec;
-  dMat = calloc( m * k, sizeof(double));
-  if (dMat==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  free(dMat);
+  dMat = NULL;
+
+  return iter;
+}
+
+/*
+ * Design rows are the basis row nearest each rescaled time, or with
+ * basisInterp (-l) the linear interpolation between the rows on either side
+ * of it. Interpolation removes the rounding of times to the grid, so a basis
+ * of a few hundred rows fits as well as one of thousands. Set once, before
+ * any fit; every design builder and the cache key read it.
+ */
+int basisInterp = 0;
+
+// Rescaled times this close to a basis row are taken to be on it (-l)
+const double kInterpSnap = 1e-9;
 
-  dVec = calloc( m, sizeof(double) );
-  if (dVec==NULL)
+/*
+ * Position of rescaled time t on the basis grid: its design row is
+ * (1-frac) * basis row (*row) + frac * basis row (*row)+1. Without
+ * basisInterp, (*row) is the nearest row and frac is 0.
+ */
+void basisPosition(double t, int basisRows, int * row, double * frac)
+{
+  (*row) = (int) floor( t + 0.5 );
+  if (!basisInterp)
   {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
+    (*frac) = 0;
+    return;
   }
 
-  // Copy observations to dVec; leave remaining entries 0 for prior
-  dcopy(n, yVec, 1, dVec, 1);
+  // Times meant to fall on a row, such as i/(basisRows-1) of the span, can
+  // come out of rescaleTimes an ulp short of it, leaving the row's end of
+  // the interval a weight of 1 - frac that rounding alone sets
+  t = (fabs(t - (*row)) < kInterpSnap) ? (*row) : t;
+  (*row) = (int) floor(t);
+  (*row) = ((*row) > basisRows-2) ? basisRows-2 : (*row);
+  (*row) = ((*row) < 0) ? 0 : (*row);
+  (*frac) = t - (*row);
+}
+
+/*
+ * Build (n+k-1) x k design matrix for the first k basis columns: one basis row
+ * per observation (see basisPosition), followed by identity rows (w/o first
+ * row) for the prior
+ * Caller frees the returned matrix
+ */
+
+double * buildDesign(double * basisMat, int basisRows,
+    double * timeVec, int n, int k)
+{
+  int i, j, m, tme;
+  double frac;
+  m = n + k - 1;
+
+  TRACE_BEGIN(TRACE_DESIGN);
+
+  double * dMat;
+  dMat = calloc( m * k, sizeof(double));
+  checkPtr(dMat, "out of memory");
 
   // Copy correct rows from basisMat to dMat
   for (i=0; i<n; i++)
   {
-    tme = (int) floor( timeVec[i] + 0.5 );
+    basisPosition(timeVec[i], basisRows, &tme, &frac);
     for (j=0; j<k; j++)
     {
-      dMat[i + j*m] = basisMat[tme + j*basisRows];
+      dMat[i + j*m] = (frac == 0) ? basisMat[tme + j*basisRows] :
+        (1-frac) * basisMat[tme + j*basisRows] +
+        frac * basisMat[tme+1 + j*basisRows];
     }
   }
 
@@ -72,56 +120,75 @@ int lmT(double * basisMat, int basisRows, int basisCols,
     dMat[i + j*m] = 1;
   }
 
+  TRACE_END(TRACE_DESIGN, (n + m) * k * sizeof(double));
+
+  return dMat;
+}
+
+/*
+ * EM for one model on a design built by buildDesign, one iteration at a
+ * time, so that several fits can be advanced together (see screen.c)
+ * dMat, yVec and priorVec are only read, so one design can be shared by
+ * several fits; coef is updated in place. If warmStart is nonzero, coef
+ * holds starting values and tau a starting scale (computed if <= 0). If
+ * unitChol is not NULL, it is the Cholesky factor of the unit-weight normal
+ * equations, and seeds the factor reused by wlsUpdate
+ */
+
+void emInit(emModel * em, double * dMat, int n, int k,
+    double * yVec, double * priorVec, double nu,
+    double * coef, double tau, int warmStart, const double * unitChol)
+{
+  // Initialize workspace variables
+  int i, m;
+  double logPrior;
+  m = n + k - 1;
+
+  em->dMat = dMat;
+  em->priorVec = priorVec;
+  em->n = n;
+  em->k = k;
+  em->m = m;
+  em->nu = nu;
+  em->coef = coef;
+  em->tau = tau;
+
+  /*
+   * Setup dvec
+   */
+
+  em->dVec = calloc( m, sizeof(double) );
+  checkPtr(em->dVec, "out of memory");
+
+  // Copy observations to dVec; leave remaining entries 0 for prior
+  dcopy(n, yVec, 1, em->dVec, 1);
+
   /*
    * Allocate workspace arrays
    */
 
   // Allocate workspace matrices
-  double * sqwX, * XTX;
-  sqwX = malloc(m * k * sizeof(double));
-  if (sqwX==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  em->sqwX = malloc(m * k * sizeof(double));
+  checkPtr(em->sqwX, "out of memory");
 
-  XTX = malloc(k * k * sizeof(double));
-  if (XTX==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  em->XTX = malloc(k * k * sizeof(double));
+  checkPtr(em->XTX, "out of memory");
 
   // Allocate workspace vectors
-  double * w, * sqw, * sqwy, * resid;
+  em->w = calloc(m, sizeof(double));
+  checkPtr(em->w, "out of memory");
 
-  w = calloc(m, sizeof(double));
-  if (w==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  em->sqw = calloc(m, sizeof(double));
+  checkPtr(em->sqw, "out of memory");
 
-  sqw = calloc(m, sizeof(double));
-  if (sqw==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  em->sqwy = calloc(m, sizeof(double));
+  checkPtr(em->sqwy, "out of memory");
 
-  sqwy = calloc(m, sizeof(double));
-  if (sqwy==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  em->resid = calloc(m, sizeof(double));
+  checkPtr(em->resid, "out of memory");
 
-  resid = calloc(m, sizeof(double));
-  if (resid==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
+  // Factor of X'WX reused across iterations while weights change little
+  initWlsCache(&em->cache, m, k);
 
   /*
    * Initialize quantities before EM iterations
@@ -130,111 +197,185 @@ int lmT(double * basisMat, int basisRows, int basisCols,
   // Initialize weights for observations
   for (i=0; i<n; i++)
   {
-    w[i] = 1;
+    em->w[i] = 1;
   }
 
   // Copy prior information to weights
-  dcopy(k-1, priorVec, 1, &w[n], 1);
+  dcopy(k-1, priorVec, 1, &em->w[n], 1);
+
+  if (unitChol != NULL)
+  {
+    seedWlsCache(&em->cache, unitChol, em->w);
+  }
 
   /*
    * First iteration
    */
 
-  // Run regression to obtain initial coefficients
-  wls(dMat, m, k, dVec, w, XTX, sqw, sqwX, sqwy, coef);
-
-  // Calculate residuals
-  calcResid(dMat, m, k, dVec, coef, resid);
-
-  // Calculate tau
-  (*tau) = 0;
-  for (i=0; i<m; i++)
+  if (warmStart)
   {
-    (*tau) += resid[i] * resid[i] * w[i];
+    // Start from supplied coefficients; compute tau only if not supplied
+    calcResid(dMat, m, k, em->dVec, coef, em->resid);
   }
-  (*tau) /= dasum(m, w, 1);
-
-  // Calculate initial log-posterior
-  (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
-  logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
-  (*logPosterior) = (*logLikelihood) + logPrior;
+  else
+  {
+    // Run regression to obtain initial coefficients
+    wlsUpdate(dMat, m, k, em->dVec, em->w, em->XTX, em->sqw, em->sqwX,
+        em->sqwy, coef, &em->cache);
 
-  logPosterior_tm1 = (*logPosterior);
+    // Calculate residuals
+    calcResid(dMat, m, k, em->dVec, coef, em->resid);
+  }
 
-  /*
-   * EM loop
-   */
-  for (iter=0; iter<maxIter; iter++)
+  // Calculate tau
+  if (!warmStart || em->tau <= 0)
   {
-    // E step: Update u | beta, tau
-    for (i=0; i<n; i++)
+    em->tau = 0;
+    for (i=0; i<m; i++)
     {
-      w[i] = (nu + 1) / (nu + resid[i]*resid[i]/(*tau));
+      em->tau += em->resid[i] * em->resid[i] * em->w[i];
     }
+    em->tau /= dasum(m, em->w, 1);
+  }
 
-    // M step: Update beta, tau | u
+  // Calculate initial log-posterior
+  em->logLikelihood = dt_log(em->resid, n, nu, 0, sqrt(em->tau));
+  logPrior = dnorm_log(&em->resid[n], k-1, 0, sqrt(em->tau/priorVec[0]));
+  em->logPosterior = em->logLikelihood + logPrior;
+}
 
-    // Run regression to obtain coefficients
-    wls(dMat, m, k, dVec, w, XTX, sqw, sqwX, sqwy, coef);
+/*
+ * One EM iteration. Returns the relative change in log-posterior, whose
+ * size decides convergence; after a warm start the log-posterior may fall
+ * before it rises
+ */
+double emStep(emModel * em)
+{
+  int i, n = em->n, m = em->m, k = em->k;
+  double logPosterior_tm1, logPrior;
 
-    // Calculate residuals
-    calcResid(dMat, m, k, dVec, coef, resid);
+  logPosterior_tm1 = em->logPosterior;
 
-    // Calculate tau
-    (*tau) = 0;
-    for (i=0; i<m; i++)
-    {
-      (*tau) += resid[i] * resid[i] * w[i];
-    }
-    (*tau) /= dasum(m, w, 1);
+  // E step: Update u | beta, tau
+  for (i=0; i<n; i++)
+  {
+    em->w[i] = tWeight(em->resid[i], em->tau, em->nu);
+  }
 
-    // Calculate log-posterior
-    (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
-    logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
-    (*logPosterior) = (*logLikelihood) + logPrior;
+  // M step: Update beta, tau | u
 
-    // Check convergence
-    delta = ((*logPosterior) - logPosterior_tm1) /
-      fabs((*logPosterior) + logPosterior_tm1) * 2;
+  // Run regression to obtain coefficients
+  wlsUpdate(em->dMat, m, k, em->dVec, em->w, em->XTX, em->sqw, em->sqwX,
+      em->sqwy, em->coef, &em->cache);
 
-    if (delta < tol)
-    {
-      logPosterior_tm1 = (*logPosterior);
-      break;
-    }
-    logPosterior_tm1 = (*logPosterior);
+  // Calculate residuals
+  calcResid(em->dMat, m, k, em->dVec, em->coef, em->resid);
+
+  // Calculate tau
+  em->tau = 0;
+  for (i=0; i<m; i++)
+  {
+    em->tau += em->resid[i] * em->resid[i] * em->w[i];
   }
+  em->tau /= dasum(m, em->w, 1);
 
-  /*
-   * Free allocated memory
-   */
+  // Calculate log-posterior
+  em->logLikelihood = dt_log(em->resid, n, em->nu, 0, sqrt(em->tau));
+  logPrior = dnorm_log(&em->resid[n], k-1, 0,
+      sqrt(em->tau/em->priorVec[0]));
+  em->logPosterior = em->logLikelihood + logPrior;
 
-  // Free dMat and dVec
-  free(dMat);
-  dMat = NULL;
+  return (em->logPosterior - logPosterior_tm1) /
+    fabs(em->logPosterior + logPosterior_tm1) * 2;
+}
 
-  free(dVec);
-  dVec = NULL;
+void emFree(emModel * em)
+{
+  free(em->dVec);
+  free(em->sqwX);
+  free(em->XTX);
+  free(em->w);
+  free(em->sqw);
+  free(em->sqwy);
+  free(em->resid);
+  freeWlsCache(&em->cache);
+}
 
-  // Free workspace matrices
-  free(sqwX);
-  sqwX = NULL;
+/*
+ * Function to run wavelet model on a design built by buildDesign
+ * dMat is only read, so one design can be shared by several fits
+ * unitChol as for emInit
+ */
 
-  free(XTX);
-  XTX = NULL;
+static int lmTDesignCore(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart,
+    const double * unitChol)
+{
+  int iter;
+  emModel em;
 
-  // Free workspace vectors
-  free(w);
-  w=NULL;
+  emInit(&em, dMat, n, k, yVec, priorVec, nu, coef, *tau, warmStart,
+      unitChol);
 
-  free(sqw);
-  sqw=NULL;
+  /*
+   * EM loop
+   */
+  for (iter=0; iter<maxIter; iter++)
+  {
+    if (fabs(emStep(&em)) < tol)
+      break;
+  }
 
-  free(sqwy);
-  sqw=NULL;
+  (*logPosterior) = em.logPosterior;
+  (*logLikelihood) = em.logLikelihood;
+  (*tau) = em.tau;
 
-  free(resid);
-  resid=NULL;
+  emFree(&em);
 
   return iter;
 }
+
+int lmTDesign(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  return lmTDesignCore(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, warmStart, NULL);
+}
+
+/*
+ * As lmTDesign, starting from coef, the solution of the unit-weight normal
+ * equations, and unitChol, their Cholesky factor (upper, as left by dposv).
+ * Gives the fit of a cold start without its first factorization, so fits
+ * on one design can share it (see fitNuGridBands).
+ */
+int lmTDesignSeeded(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    const double * unitChol)
+{
+  (*tau) = 0;
+  return lmTDesignCore(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, 1, unitChol);
+}
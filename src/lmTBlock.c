@@ -0,0 +1,391 @@
+/*
+ * lmTBlock.c
+ *
+ *  Wavelet model fit for a block of short series in lockstep
+ *
+ *  For series with a few dozen observations and a model with a few columns,
+ *  the BLAS calls of lmTDesign cost little more than their call overhead.
+ *  Here up to BLOCK_LANES series share one EM loop: every array holds one
+ *  entry per series (lane) innermost, so the Gram matrices, Cholesky
+ *  factorizations and triangular solves of all lanes are computed by the
+ *  same loops, which the compiler vectorizes across lanes. Series shorter
+ *  than the longest in the block are padded with zero-weight observations.
+ */
+
+#include "rowavedt.h"
+
+// Largest model dimension fit by lmTBlock. From k = 16 on, lmTDesign
+// reuses factorizations across iterations (wlsUpdate), which beats
+// rebuilding the Gram matrices of a whole block every iteration.
+const int kBlockMaxK = 15;
+
+// Gram matrix (upper triangle) and right-hand side of the weighted normal
+// equations, prior rows included, for all lanes. Each entry is accumulated
+// over observations in registers from the weighted design wX (workspace).
+static void blockGram(const double * X, const double * y, const double * w,
+    int nMax, int k, const double * priorVec, double * wX,
+    double * G, double * b)
+{
+  int i, a, c, s;
+  double acc[BLOCK_LANES];
+
+  for (i=0; i<nMax; i++)
+  {
+    for (a=0; a<k; a++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        wX[(i * k + a) * BLOCK_LANES + s] = w[i * BLOCK_LANES + s] *
+          X[(i * k + a) * BLOCK_LANES + s];
+    }
+  }
+
+  for (a=0; a<k; a++)
+  {
+    for (c=a; c<k; c++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        acc[s] = 0;
+      for (i=0; i<nMax; i++)
+      {
+        for (s=0; s<BLOCK_LANES; s++)
+          acc[s] += wX[(i * k + a) * BLOCK_LANES + s] *
+            X[(i * k + c) * BLOCK_LANES + s];
+      }
+      for (s=0; s<BLOCK_LANES; s++)
+        G[(a * k + c) * BLOCK_LANES + s] = acc[s];
+    }
+
+    for (s=0; s<BLOCK_LANES; s++)
+      acc[s] = 0;
+    for (i=0; i<nMax; i++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        acc[s] += wX[(i * k + a) * BLOCK_LANES + s] * y[i * BLOCK_LANES + s];
+    }
+    for (s=0; s<BLOCK_LANES; s++)
+      b[a * BLOCK_LANES + s] = acc[s];
+  }
+
+  // Prior rows are unit vectors for coefficients 1..k-1
+  for (a=1; a<k; a++)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+    {
+      G[(a * k + a) * BLOCK_LANES + s] += priorVec[a-1];
+    }
+  }
+}
+
+// Solve G coef = b for all lanes by Cholesky (G = U'U, U overwrites G)
+static void blockSolve(double * G, const double * b, int k, double * coef)
+{
+  int a, c, p, s;
+  double d[BLOCK_LANES];
+
+  for (a=0; a<k; a++)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+      d[s] = G[(a * k + a) * BLOCK_LANES + s];
+    for (p=0; p<a; p++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        d[s] -= G[(p * k + a) * BLOCK_LANES + s] *
+          G[(p * k + a) * BLOCK_LANES + s];
+    }
+    for (s=0; s<BLOCK_LANES; s++)
+      G[(a * k + a) * BLOCK_LANES + s] = sqrt(d[s]);
+
+    for (c=a+1; c<k; c++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        d[s] = G[(a * k + c) * BLOCK_LANES + s];
+      for (p=0; p<a; p++)
+      {
+        for (s=0; s<BLOCK_LANES; s++)
+          d[s] -= G[(p * k + a) * BLOCK_LANES + s] *
+            G[(p * k + c) * BLOCK_LANES + s];
+      }
+      for (s=0; s<BLOCK_LANES; s++)
+        G[(a * k + c) * BLOCK_LANES + s] = d[s] /
+          G[(a * k + a) * BLOCK_LANES + s];
+    }
+  }
+
+  // U' z = b
+  for (a=0; a<k; a++)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+      d[s] = b[a * BLOCK_LANES + s];
+    for (p=0; p<a; p++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        d[s] -= G[(p * k + a) * BLOCK_LANES + s] * coef[p * BLOCK_LANES + s];
+    }
+    for (s=0; s<BLOCK_LANES; s++)
+      coef[a * BLOCK_LANES + s] = d[s] / G[(a * k + a) * BLOCK_LANES + s];
+  }
+
+  // U coef = z
+  for (a=k-1; a>=0; a--)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+      d[s] = coef[a * BLOCK_LANES + s];
+    for (c=a+1; c<k; c++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        d[s] -= G[(a * k + c) * BLOCK_LANES + s] * coef[c * BLOCK_LANES + s];
+    }
+    for (s=0; s<BLOCK_LANES; s++)
+      coef[a * BLOCK_LANES + s] = d[s] / G[(a * k + a) * BLOCK_LANES + s];
+  }
+}
+
+// Observation residuals for all lanes
+static void blockResid(const double * X, const double * y, int nMax, int k,
+    const double * coef, double * resid)
+{
+  int i, j, s;
+
+  for (i=0; i<nMax; i++)
+  {
+    const double * xi = &X[i * k * BLOCK_LANES];
+    for (s=0; s<BLOCK_LANES; s++)
+      resid[i * BLOCK_LANES + s] = y[i * BLOCK_LANES + s];
+    for (j=0; j<k; j++)
+    {
+      for (s=0; s<BLOCK_LANES; s++)
+        resid[i * BLOCK_LANES + s] -= xi[j * BLOCK_LANES + s] *
+          coef[j * BLOCK_LANES + s];
+    }
+  }
+}
+
+// Weighted mean square residual (prior rows included) for each lane
+static void blockTau(const double * resid, const double * w, int nMax, int k,
+    const double * coef, const double * priorVec, double * tau)
+{
+  int i, j, s;
+  double sumw[BLOCK_LANES];
+
+  for (s=0; s<BLOCK_LANES; s++)
+  {
+    tau[s] = 0;
+    sumw[s] = 0;
+  }
+  for (i=0; i<nMax; i++)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+    {
+      tau[s] += resid[i * BLOCK_LANES + s] * resid[i * BLOCK_LANES + s] *
+        w[i * BLOCK_LANES + s];
+      sumw[s] += w[i * BLOCK_LANES + s];
+    }
+  }
+  for (j=1; j<k; j++)
+  {
+    for (s=0; s<BLOCK_LANES; s++)
+    {
+      tau[s] += coef[j * BLOCK_LANES + s] * coef[j * BLOCK_LANES + s] *
+        priorVec[j-1];
+      sumw[s] += priorVec[j-1];
+    }
+  }
+  for (s=0; s<BLOCK_LANES; s++)
+    tau[s] /= sumw[s];
+}
+
+/*
+ * Function to run wavelet model on a block of nLanes <= BLOCK_LANES series
+ * Returns the largest number of iterations run by any lane
+ *
+ * Lane s has nVec[s] observations (yVecs[s], rescaled times timeVecs[s])
+ * and its own convergence test, exactly as in lmTDesign; lanes that have
+ * converged keep their results while the others continue. coefs[s] and
+ * tau[s] hold starting values on input for lanes with warmStart[s] set
+ * (tau[s] <= 0 to compute it), and the estimates on output, with
+ * log-posterior, log-likelihood and iteration count per lane.
+ * Requires k <= kBlockMaxK.
+ */
+int lmTBlock(double * basisMat, int basisRows, int k, int nLanes,
+    double ** yVecs, double ** timeVecs, int * nVec,
+    double * priorVec, double nu,
+    int maxIter, double tol,
+    double * logPosterior, double * logLikelihood,
+    double ** coefs, double * tau, int * iter, int * warmStart)
+{
+  int i, j, s, nMax = 0, tme, active, it, maxRun = 0;
+  double delta, logPrior, frac, logPosterior_tm1[BLOCK_LANES];
+  double laneTau[BLOCK_LANES];
+  int done[BLOCK_LANES];
+
+  TRACE_BEGIN(TRACE_WLS);
+
+  for (s=0; s<nLanes; s++)
+    nMax = (nVec[s] > nMax) ? nVec[s] : nMax;
+
+  /*
+   * Lane-interleaved design, observations, weights and workspace
+   */
+
+  double * X, * wX, * y, * w, * resid, * G, * b, * coef, * scratch;
+  X = calloc((size_t) nMax * k * BLOCK_LANES, sizeof(double));
+  checkPtr(X, "out of memory");
+  wX = malloc((size_t) nMax * k * BLOCK_LANES * sizeof(double));
+  checkPtr(wX, "out of memory");
+  y = calloc(nMax * BLOCK_LANES, sizeof(double));
+  checkPtr(y, "out of memory");
+  w = calloc(nMax * BLOCK_LANES, sizeof(double));
+  checkPtr(w, "out of memory");
+  resid = calloc(nMax * BLOCK_LANES, sizeof(double));
+  checkPtr(resid, "out of memory");
+  G = calloc(k * k * BLOCK_LANES, sizeof(double));
+  checkPtr(G, "out of memory");
+  b = calloc(k * BLOCK_LANES, sizeof(double));
+  checkPtr(b, "out of memory");
+  coef = calloc(k * BLOCK_LANES, sizeof(double));
+  checkPtr(coef, "out of memory");
+  scratch = calloc(nMax + k, sizeof(double));
+  checkPtr(scratch, "out of memory");
+
+  for (s=0; s<BLOCK_LANES; s++)
+  {
+    done[s] = (s >= nLanes);
+    laneTau[s] = 1;
+  }
+
+  // Unused lanes solve the identity system so that they stay finite
+  for (s=nLanes; s<BLOCK_LANES; s++)
+  {
+    for (j=0; j<k && j<nMax; j++)
+    {
+      X[(j * k + j) * BLOCK_LANES + s] = 1;
+      w[j * BLOCK_LANES + s] = 1;
+    }
+  }
+
+  for (s=0; s<nLanes; s++)
+  {
+    for (i=0; i<nVec[s]; i++)
+    {
+      basisPosition(timeVecs[s][i], basisRows, &tme, &frac);
+      for (j=0; j<k; j++)
+        X[(i * k + j) * BLOCK_LANES + s] = (frac == 0) ?
+          basisMat[tme + j*basisRows] :
+          (1-frac) * basisMat[tme + j*basisRows] +
+          frac * basisMat[tme+1 + j*basisRows];
+      y[i * BLOCK_LANES + s] = yVecs[s][i];
+      w[i * BLOCK_LANES + s] = 1;
+    }
+  }
+
+  /*
+   * First iteration
+   */
+
+  blockGram(X, y, w, nMax, k, priorVec, wX, G, b);
+  blockSolve(G, b, k, coef);
+  for (s=0; s<nLanes; s++)
+  {
+    if (warmStart[s])
+    {
+      for (j=0; j<k; j++)
+        coef[j * BLOCK_LANES + s] = coefs[s][j];
+    }
+  }
+
+  blockResid(X, y, nMax, k, coef, resid);
+  blockTau(resid, w, nMax, k, coef, priorVec, laneTau);
+
+  for (s=0; s<nLanes; s++)
+  {
+    if (warmStart[s] && tau[s] > 0)
+      laneTau[s] = tau[s];
+  }
+
+  /*
+   * EM loop
+   */
+
+  for (it=0, active=nLanes; active > 0; it++)
+  {
+    // Log-posterior of each active lane; check convergence after the first
+    for (s=0; s<nLanes; s++)
+    {
+      if (done[s])
+        continue;
+
+      for (i=0; i<nVec[s]; i++)
+        scratch[i] = resid[i * BLOCK_LANES + s];
+      for (j=1; j<k; j++)
+        scratch[nVec[s] + j - 1] = -coef[j * BLOCK_LANES + s];
+
+      logLikelihood[s] = dt_log(scratch, nVec[s], nu, 0, sqrt(laneTau[s]));
+      logPrior = dnorm_log(&scratch[nVec[s]], k-1, 0,
+          sqrt(laneTau[s]/priorVec[0]));
+      logPosterior[s] = logLikelihood[s] + logPrior;
+
+      if (it > 0)
+      {
+        delta = (logPosterior[s] - logPosterior_tm1[s]) /
+          fabs(logPosterior[s] + logPosterior_tm1[s]) * 2;
+        if (fabs(delta) < tol)
+        {
+          // Same count lmTDesign reports: iterations before the break
+          iter[s] = it - 1;
+          maxRun = (iter[s] > maxRun) ? iter[s] : maxRun;
+          for (j=0; j<k; j++)
+            coefs[s][j] = coef[j * BLOCK_LANES + s];
+          tau[s] = laneTau[s];
+          done[s] = 1;
+          active--;
+          continue;
+        }
+      }
+      logPosterior_tm1[s] = logPosterior[s];
+    }
+    if (active == 0 || it >= maxIter)
+    {
+      // Lanes still running at maxIter stop with their current estimates
+      for (s=0; s<nLanes; s++)
+      {
+        if (done[s])
+          continue;
+        iter[s] = maxIter;
+        maxRun = maxIter;
+        for (j=0; j<k; j++)
+          coefs[s][j] = coef[j * BLOCK_LANES + s];
+        tau[s] = laneTau[s];
+      }
+      break;
+    }
+
+    // E step: Update u | beta, tau
+    for (s=0; s<nLanes; s++)
+    {
+      for (i=0; i<nVec[s]; i++)
+        w[i * BLOCK_LANES + s] = tWeight(resid[i * BLOCK_LANES + s],
+            laneTau[s], nu);
+    }
+
+    // M step: Update beta, tau | u
+    blockGram(X, y, w, nMax, k, priorVec, wX, G, b);
+    blockSolve(G, b, k, coef);
+    blockResid(X, y, nMax, k, coef, resid);
+    blockTau(resid, w, nMax, k, coef, priorVec, laneTau);
+  }
+
+  TRACE_END(TRACE_WLS, (size_t) it * (2 * nMax + k) * k * BLOCK_LANES *
+      sizeof(double));
+
+  free(X);
+  free(wX);
+  free(y);
+  free(w);
+  free(resid);
+  free(G);
+  free(b);
+  free(coef);
+  free(scratch);
+
+  return maxRun;
+}
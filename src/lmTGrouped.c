@@ -0,0 +1,307 @@
+/*
+ * lmTGrouped.c
+ *
+ *  Wavelet model fit from per-basis-row sufficient statistics
+ */
+
+#include "rowavedt.h"
+
+/*
+ * Function to run wavelet model using grouped sufficient statistics
+ * Returns number of iterations run
+ *
+ * Observations that map to the same basis row share a design row, so X'WX
+ * and X'Wy only need the sum of weights and the weighted mean of y for each
+ * occupied row. The weighted regression is therefore solved on G <= basisRows
+ * grouped rows instead of n observations; only the E step and residuals are
+ * per-observation. Results match lmT up to rounding.
+ *
+ * rowVec gives the basis row of each observation (0 to basisRows-1)
+ * If warmStart is nonzero, coef and tau hold starting values on input
+ */
+
+int lmTGrouped(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int * rowVec, int n,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  // Initialize workspace variables
+  int iter, i, j, g, G, m;
+  double logPosterior_tm1, logPrior, delta, sumw;
+
+  /*
+   * Group observations by basis row
+   */
+
+  int * groupOfRow, * groupVec, * rowOfGroup;
+  groupOfRow = calloc(basisRows, sizeof(int));
+  checkPtr(groupOfRow, "out of memory");
+
+  groupVec = malloc(n * sizeof(int));
+  checkPtr(groupVec, "out of memory");
+
+  rowOfGroup = malloc(n * sizeof(int));
+  checkPtr(rowOfGroup, "out of memory");
+
+  for (i=0; i<basisRows; i++)
+  {
+    groupOfRow[i] = -1;
+  }
+
+  G = 0;
+  for (i=0; i<n; i++)
+  {
+    if (groupOfRow[rowVec[i]] < 0)
+    {
+      groupOfRow[rowVec[i]] = G;
+      rowOfGroup[G] = rowVec[i];
+      G++;
+    }
+    groupVec[i] = groupOfRow[rowVec[i]];
+  }
+
+  /*
+   * Setup grouped dmat and dvec
+   */
+
+  m = G + k - 1;
+
+  TRACE_BEGIN(TRACE_DESIGN);
+
+  double * dMat, * dVec;
+  dMat = calloc(m * k, sizeof(double));
+  checkPtr(dMat, "out of memory");
+
+  dVec = calloc(m, sizeof(double));
+  checkPtr(dVec, "out of memory");
+
+  // Copy occupied rows from basisMat to dMat
+  for (g=0; g<G; g++)
+  {
+    for (j=0; j<k; j++)
+    {
+      dMat[g + j*m] = basisMat[rowOfGroup[g] + j*basisRows];
+    }
+  }
+
+  // Initialize remaining rows of dMat to identity (w/o first row) for prior
+  for (i=G; i<m; i++)
+  {
+    j = i - G + 1;
+    dMat[i + j*m] = 1;
+  }
+
+  TRACE_END(TRACE_DESIGN, 2 * m * k * sizeof(double));
+
+  /*
+   * Allocate workspace arrays
+   */
+
+  double * sqwX, * XTX;
+  sqwX = malloc(m * k * sizeof(double));
+  checkPtr(sqwX, "out of memory");
+
+  XTX = malloc(k * k * sizeof(double));
+  checkPtr(XTX, "out of memory");
+
+  // Grouped weights (wg), observation weights (w), fitted values by group,
+  // and residuals (observations followed by prior rows)
+  double * w, * wg, * sqw, * sqwy, * fitted, * resid;
+
+  w = malloc(n * sizeof(double));
+  checkPtr(w, "out of memory");
+
+  wg = calloc(m, sizeof(double));
+  checkPtr(wg, "out of memory");
+
+  sqw = calloc(m, sizeof(double));
+  checkPtr(sqw, "out of memory");
+
+  sqwy = calloc(m, sizeof(double));
+  checkPtr(sqwy, "out of memory");
+
+  fitted = calloc(m, sizeof(double));
+  checkPtr(fitted, "out of memory");
+
+  resid = calloc(n + k - 1, sizeof(double));
+  checkPtr(resid, "out of memory");
+
+  // Factor of X'WX reused across iterations while weights change little
+  wlsCache cache;
+  initWlsCache(&cache, m, k);
+
+  // Copy prior information to grouped weights
+  dcopy(k-1, priorVec, 1, &wg[G], 1);
+
+  /*
+   * First iteration
+   */
+
+  for (i=0; i<n; i++)
+  {
+    w[i] = 1;
+  }
+
+  if (!warmStart)
+  {
+    groupStats(groupVec, n, G, yVec, w, wg, dVec);
+    wlsUpdate(dMat, m, k, dVec, wg, XTX, sqw, sqwX, sqwy, coef, &cache);
+  }
+
+  groupResid(dMat, m, k, G, groupVec, n, yVec, coef, fitted, resid);
+
+  // Calculate tau
+  if (!warmStart || (*tau) <= 0)
+  {
+    (*tau) = 0;
+    sumw = 0;
+    for (i=0; i<n; i++)
+    {
+      (*tau) += resid[i] * resid[i];
+      sumw += 1;
+    }
+    for (j=0; j<k-1; j++)
+    {
+      (*tau) += resid[n+j] * resid[n+j] * priorVec[j];
+      sumw += priorVec[j];
+    }
+    (*tau) /= sumw;
+  }
+
+  // Calculate initial log-posterior
+  (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+  logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+  (*logPosterior) = (*logLikelihood) + logPrior;
+
+  logPosterior_tm1 = (*logPosterior);
+
+  /*
+   * EM loop
+   */
+  for (iter=0; iter<maxIter; iter++)
+  {
+    // E step: Update u | beta, tau
+    for (i=0; i<n; i++)
+    {
+      w[i] = tWeight(resid[i], *tau, nu);
+    }
+
+    // M step: Update beta, tau | u
+
+    // Run grouped regression to obtain coefficients
+    groupStats(groupVec, n, G, yVec, w, wg, dVec);
+    wlsUpdate(dMat, m, k, dVec, wg, XTX, sqw, sqwX, sqwy, coef, &cache);
+
+    // Calculate residuals
+    groupResid(dMat, m, k, G, groupVec, n, yVec, coef, fitted, resid);
+
+    // Calculate tau
+    (*tau) = 0;
+    sumw = 0;
+    for (i=0; i<n; i++)
+    {
+      (*tau) += resid[i] * resid[i] * w[i];
+      sumw += w[i];
+    }
+    for (j=0; j<k-1; j++)
+    {
+      (*tau) += resid[n+j] * resid[n+j] * priorVec[j];
+      sumw += priorVec[j];
+    }
+    (*tau) /= sumw;
+
+    // Calculate log-posterior
+    (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+    logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+    (*logPosterior) = (*logLikelihood) + logPrior;
+
+    // Check convergence; after a warm start the log-posterior may fall
+    // before it rises, so only the size of the change counts
+    delta = ((*logPosterior) - logPosterior_tm1) /
+      fabs((*logPosterior) + logPosterior_tm1) * 2;
+
+    if (fabs(delta) < tol)
+    {
+      logPosterior_tm1 = (*logPosterior);
+      break;
+    }
+    logPosterior_tm1 = (*logPosterior);
+  }
+
+  /*
+   * Free allocated memory
+   */
+
+  free(groupOfRow);
+  free(groupVec);
+  free(rowOfGroup);
+
+  free(dMat);
+  free(dVec);
+
+  free(sqwX);
+  free(XTX);
+
+  free(w);
+  free(wg);
+  free(sqw);
+  free(sqwy);
+  free(fitted);
+  free(resid);
+
+  freeWlsCache(&cache);
+
+  return iter;
+}
+
+// Sum weights and weighted values by group; ybar holds weighted group means
+void groupStats(int * groupVec, int n, int G,
+    double * y, double * w,
+    double * wg, double * ybar)
+{
+  int i, g;
+
+  for (g=0; g<G; g++)
+  {
+    wg[g] = 0;
+    ybar[g] = 0;
+  }
+
+  for (i=0; i<n; i++)
+  {
+    wg[groupVec[i]] += w[i];
+    ybar[groupVec[i]] += w[i] * y[i];
+  }
+
+  for (g=0; g<G; g++)
+  {
+    ybar[g] /= wg[g];
+  }
+}
+
+// Per-observation residuals from grouped design; prior residuals follow
+void groupResid(double * dMat, int m, int k, int G,
+    int * groupVec, int n,
+    double * y, double * coef,
+    double * fitted, double * resid)
+{
+  int i, j;
+
+  calcFitted(dMat, m, k, NULL, coef, fitted);
+
+  for (i=0; i<n; i++)
+  {
+    resid[i] = y[i] - fitted[groupVec[i]];
+  }
+
+  for (j=0; j<k-1; j++)
+  {
+    resid[n+j] = -fitted[G+j];
+  }
+}
@@ -0,0 +1,265 @@
+/*
+ * lmTMixed.c
+ *
+ *  Mixed-precision wavelet model fit: single-precision EM, double refinement
+ */
+
+#include "rowavedt.h"
+
+// Relative log-posterior tolerance for the single-precision EM phase. Float
+// rounding makes changes much below this meaningless, so EM hands over to
+// double precision here.
+const double kMixedTol = 1e-6;
+
+// Single-precision version of wls
+static int swls(float * X, int n, int k,
+    float * y, double * w,
+    float * XTX, float * sqwX, float * sqwy,
+    float * coef)
+{
+  int i, j;
+  float sqw;
+
+  TRACE_BEGIN(TRACE_WLS);
+
+  for (i=0; i<n; i++)
+  {
+    sqw = (float) sqrt(w[i]);
+    for (j=0; j<k; j++)
+    {
+      sqwX[i + j*n] = X[i + j*n] * sqw;
+    }
+    sqwy[i] = sqw * y[i];
+  }
+
+  ssyrk('u', 't', k, n, 1, sqwX, n, 0, XTX, k);
+  sgemv('t', n, k, 1, sqwX, n, sqwy, 1, 0, coef, 1);
+
+  int info;
+  info = sposv('u', k, 1, XTX, k, coef, k);
+
+  TRACE_END(TRACE_WLS, (3 * n * k + k * k) * sizeof(float));
+
+  return info;
+}
+
+/*
+ * Function to run wavelet model in mixed precision
+ * Returns total number of iterations run (single and double precision)
+ *
+ * The design is built from basisMatF, a single-precision copy of basisMat,
+ * and EM runs with single-precision X'WX, X'Wy and Cholesky solves until the
+ * relative change in log-posterior falls below kMixedTol. Weights, tau and
+ * log-posterior are accumulated in double. lmT then continues from that
+ * point in double precision until tol is met, so the estimates satisfy the
+ * same convergence criterion as the double-precision path. If a float
+ * Cholesky factorization fails, the float phase is dropped and lmT fits
+ * from the caller's starting values instead.
+ * Arguments are otherwise as for lmT.
+ */
+
+int lmTMixed(float * basisMatF, double * basisMat,
+    int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  // Initialize workspace variables
+  int iter, i, j, m, tme, info = 0;
+  double logPosterior_tm1, logPrior, delta, sumw, frac, tau0 = (*tau);
+  m = n + k - 1;
+
+  /*
+   * Setup single-precision dmat and dvec
+   */
+
+  TRACE_BEGIN(TRACE_DESIGN);
+
+  float * sMat, * sVec;
+  sMat = calloc(m * k, sizeof(float));
+  checkPtr(sMat, "out of memory");
+
+  sVec = calloc(m, sizeof(float));
+  checkPtr(sVec, "out of memory");
+
+  for (i=0; i<n; i++)
+  {
+    sVec[i] = (float) yVec[i];
+    basisPosition(timeVec[i], basisRows, &tme, &frac);
+    for (j=0; j<k; j++)
+    {
+      sMat[i + j*m] = (frac == 0) ? basisMatF[tme + j*basisRows] :
+        (float) ((1-frac) * basisMatF[tme + j*basisRows] +
+            frac * basisMatF[tme+1 + j*basisRows]);
+    }
+  }
+
+  for (i=n; i<m; i++)
+  {
+    j = i - n + 1;
+    sMat[i + j*m] = 1;
+  }
+
+  TRACE_END(TRACE_DESIGN, (n + m) * k * sizeof(float));
+
+  /*
+   * Allocate workspace arrays
+   */
+
+  float * sqwX, * XTX, * sqwy, * sCoef, * fitted;
+  sqwX = malloc(m * k * sizeof(float));
+  checkPtr(sqwX, "out of memory");
+
+  XTX = malloc(k * k * sizeof(float));
+  checkPtr(XTX, "out of memory");
+
+  sqwy = calloc(m, sizeof(float));
+  checkPtr(sqwy, "out of memory");
+
+  sCoef = calloc(k, sizeof(float));
+  checkPtr(sCoef, "out of memory");
+
+  fitted = calloc(m, sizeof(float));
+  checkPtr(fitted, "out of memory");
+
+  double * w, * resid;
+  w = calloc(m, sizeof(double));
+  checkPtr(w, "out of memory");
+
+  resid = calloc(m, sizeof(double));
+  checkPtr(resid, "out of memory");
+
+  /*
+   * Initialize quantities before EM iterations
+   */
+
+  for (i=0; i<n; i++)
+  {
+    w[i] = 1;
+  }
+  dcopy(k-1, priorVec, 1, &w[n], 1);
+
+  if (warmStart)
+  {
+    for (j=0; j<k; j++) sCoef[j] = (float) coef[j];
+  }
+  else
+  {
+    info = swls(sMat, m, k, sVec, w, XTX, sqwX, sqwy, sCoef);
+  }
+
+  sgemv('n', m, k, 1, sMat, m, sCoef, 1, 0, fitted, 1);
+  for (i=0; i<m; i++)
+  {
+    resid[i] = (double) sVec[i] - fitted[i];
+  }
+
+  if (!warmStart || (*tau) <= 0)
+  {
+    (*tau) = 0;
+    sumw = 0;
+    for (i=0; i<m; i++)
+    {
+      (*tau) += resid[i] * resid[i] * w[i];
+      sumw += w[i];
+    }
+    (*tau) /= sumw;
+  }
+
+  (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+  logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+  (*logPosterior) = (*logLikelihood) + logPrior;
+
+  logPosterior_tm1 = (*logPosterior);
+
+  /*
+   * Single-precision EM loop
+   */
+  for (iter=0; iter<maxIter && info==0; iter++)
+  {
+    // E step: Update u | beta, tau
+    for (i=0; i<n; i++)
+    {
+      w[i] = tWeight(resid[i], *tau, nu);
+    }
+
+    // M step: Update beta, tau | u
+    info = swls(sMat, m, k, sVec, w, XTX, sqwX, sqwy, sCoef);
+    if (info != 0)
+      break;
+
+    sgemv('n', m, k, 1, sMat, m, sCoef, 1, 0, fitted, 1);
+    for (i=0; i<m; i++)
+    {
+      resid[i] = (double) sVec[i] - fitted[i];
+    }
+
+    (*tau) = 0;
+    sumw = 0;
+    for (i=0; i<m; i++)
+    {
+      (*tau) += resid[i] * resid[i] * w[i];
+      sumw += w[i];
+    }
+    (*tau) /= sumw;
+
+    (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+    logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+    (*logPosterior) = (*logLikelihood) + logPrior;
+
+    // Check convergence against single-precision tolerance
+    delta = ((*logPosterior) - logPosterior_tm1) /
+      fabs((*logPosterior) + logPosterior_tm1) * 2;
+
+    logPosterior_tm1 = (*logPosterior);
+    if (fabs(delta) < kMixedTol)
+    {
+      iter++;
+      break;
+    }
+  }
+
+  // sCoef is not a solution once a factorization has failed
+  if (info == 0)
+  {
+    for (j=0; j<k; j++)
+    {
+      coef[j] = sCoef[j];
+    }
+  }
+  else
+  {
+    (*tau) = tau0;
+  }
+
+  /*
+   * Free allocated memory
+   */
+
+  free(sMat);
+  free(sVec);
+  free(sqwX);
+  free(XTX);
+  free(sqwy);
+  free(sCoef);
+  free(fitted);
+  free(w);
+  free(resid);
+
+  /*
+   * Double-precision refinement
+   */
+  iter += lmT(basisMat, basisRows, basisCols,
+      yVec, n, timeVec, priorVec,
+      nu, k, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, (info == 0) ? 1 : warmStart);
+
+  return iter;
+}
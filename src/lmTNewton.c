@@ -0,0 +1,323 @@
+/*
+ * lmTNewton.c
+ *
+ *  Wavelet model fit by EM warm-up followed by safeguarded Newton steps
+ */
+
+#include "rowavedt.h"
+
+// Relative log-posterior change at which EM hands over to Newton
+const double kNewtonWarmupTol = 1e-5;
+
+// Step halvings tried by the line search before falling back to EM
+const int kNewtonMaxHalvings = 10;
+
+// Sufficient decrease constant for the line search
+const double kNewtonArmijo = 1e-4;
+
+/*
+ * Evaluate the EM fixed-point equations at (coef, tau)
+ *   F[0..k-1] = X' W (y - X coef)
+ *   F[k]      = sum_i w_i (r_i^2 / tau - 1)
+ * with t weights for observations and prior weights for the prior rows,
+ * filling resid, w and wr = w * resid. Returns the merit ||F||^2, with the
+ * first k entries scaled by 1/tauScale so that both blocks are dimensionless.
+ */
+static double newtonEquations(double * dMat, int m, int n, int k,
+    double * dVec, double * priorVec, double nu,
+    double * coef, double tau, double tauScale,
+    double * resid, double * w, double * wr, double * F)
+{
+  int i;
+
+  calcResid(dMat, m, k, dVec, coef, resid);
+
+  F[k] = 0;
+  for (i=0; i<m; i++)
+  {
+    w[i] = (i < n) ? tWeight(resid[i], tau, nu) : priorVec[i-n];
+    wr[i] = w[i] * resid[i];
+    F[k] += w[i] * (resid[i]*resid[i]/tau - 1);
+  }
+  dgemv('t', m, k, 1, dMat, m, wr, 1, 0, F, 1);
+
+  return ddot(k, F, 1, F, 1) / (tauScale * tauScale) + F[k] * F[k];
+}
+
+/*
+ * Jacobian of newtonEquations in (coef, tau), (k+1) x (k+1) column-major
+ * The coef block is -X' D X with D possibly indefinite, so rows with
+ * positive and negative d are accumulated by separate rank-k updates.
+ * Terms divided by nu + 1 vanish for infinite nu, as they should.
+ */
+static void newtonJacobian(double * dMat, int m, int n, int k,
+    double * priorVec, double nu, double tau,
+    double * resid, double * w,
+    double * sqdX, double * c, double * e, double * J)
+{
+  int i, j, nPos, nNeg, row, ld = k + 1;
+  double s, d, p;
+
+  TRACE_BEGIN(TRACE_WLS);
+
+  J[k + k*ld] = 0;
+  nPos = 0;
+  nNeg = 0;
+  for (i=0; i<m; i++)
+  {
+    if (i < n)
+    {
+      s = resid[i] * resid[i] / tau;
+      d = w[i] - 2 * w[i] * w[i] * s / (nu + 1);
+      e[i] = w[i] * w[i] * s * resid[i] / ((nu + 1) * tau);
+      c[i] = 2 * w[i] * resid[i] / tau * (1 - w[i] * (s - 1) / (nu + 1));
+      J[k + k*ld] += w[i] * s / tau * (w[i] * (s - 1) / (nu + 1) - 1);
+    }
+    else
+    {
+      p = priorVec[i-n];
+      d = p;
+      e[i] = 0;
+      c[i] = 2 * p * resid[i] / tau;
+      J[k + k*ld] -= p * resid[i] * resid[i] / (tau * tau);
+    }
+
+    // Positive-d rows fill sqdX from the top, negative-d rows from the bottom
+    row = (d >= 0) ? nPos++ : m - 1 - nNeg++;
+    d = sqrt(fabs(d));
+    for (j=0; j<k; j++)
+    {
+      sqdX[row + j*m] = dMat[i + j*m] * d;
+    }
+  }
+
+  // Coef block: -X' D X (upper triangle, then mirrored)
+  dsyrk('u', 't', k, nPos, -1, sqdX, m, 0, J, ld);
+  if (nNeg > 0)
+  {
+    dsyrk('u', 't', k, nNeg, 1, &sqdX[nPos], m, 1, J, ld);
+  }
+  for (j=0; j<k; j++)
+  {
+    for (i=0; i<j; i++)
+    {
+      J[j + i*ld] = J[i + j*ld];
+    }
+  }
+
+  // Cross terms: d F_coef / d tau = X' e; d F_tau / d coef = -X' c
+  dgemv('t', m, k, 1, dMat, m, e, 1, 0, &J[k*ld], 1);
+  dgemv('t', m, k, -1, dMat, m, c, 1, 0, &J[k], ld);
+
+  TRACE_END(TRACE_WLS, (2 * m * k + k * k) * sizeof(double));
+}
+
+/*
+ * Function to run wavelet model with a second-order solver
+ * Returns total number of iterations run (EM and Newton)
+ *
+ * EM (lmTDesign) runs until the relative change in log-posterior falls below
+ * kNewtonWarmupTol. Newton's method is then applied to the EM fixed-point
+ * equations in (coef, tau), so it converges quadratically to the same
+ * estimates EM converges to linearly. Each step backtracks until the merit
+ * ||F||^2 decreases sufficiently; if no step is accepted or the Jacobian is
+ * singular, EM resumes from the current point. Iteration stops once the
+ * relative change in log-posterior is below tol.
+ * Arguments are as for lmTDesign.
+ */
+
+int lmTNewtonDesign(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  int iter, h, i, m, info, converged = 0;
+  double logPosterior_tm1, logPrior, delta, merit, meritNew;
+  double alpha, tauNew, tauScale;
+  m = n + k - 1;
+
+  iter = lmTDesign(dMat, n, k, yVec, priorVec, nu, maxIter,
+      (tol > kNewtonWarmupTol) ? tol : kNewtonWarmupTol,
+      logPosterior, logLikelihood, coef, tau, warmStart);
+
+  if (tol >= kNewtonWarmupTol || iter >= maxIter)
+  {
+    return iter;
+  }
+
+  /*
+   * Allocate workspace
+   */
+
+  double * dVec, * resid, * residNew, * w, * wNew, * c, * e;
+  dVec = calloc(m, sizeof(double));
+  checkPtr(dVec, "out of memory");
+  resid = calloc(m, sizeof(double));
+  checkPtr(resid, "out of memory");
+  residNew = calloc(m, sizeof(double));
+  checkPtr(residNew, "out of memory");
+  w = calloc(m, sizeof(double));
+  checkPtr(w, "out of memory");
+  wNew = calloc(m, sizeof(double));
+  checkPtr(wNew, "out of memory");
+  c = calloc(m, sizeof(double));
+  checkPtr(c, "out of memory");
+  e = calloc(m, sizeof(double));
+  checkPtr(e, "out of memory");
+
+  double * sqdX, * J, * F, * FNew, * step, * coefNew, * swap;
+  sqdX = calloc(m * k, sizeof(double));
+  checkPtr(sqdX, "out of memory");
+  J = calloc((k+1) * (k+1), sizeof(double));
+  checkPtr(J, "out of memory");
+  F = calloc(k+1, sizeof(double));
+  checkPtr(F, "out of memory");
+  FNew = calloc(k+1, sizeof(double));
+  checkPtr(FNew, "out of memory");
+  step = calloc(k+1, sizeof(double));
+  checkPtr(step, "out of memory");
+  coefNew = calloc(k, sizeof(double));
+  checkPtr(coefNew, "out of memory");
+
+  int * ipiv;
+  ipiv = calloc(k+1, sizeof(int));
+  checkPtr(ipiv, "out of memory");
+
+  dcopy(n, yVec, 1, dVec, 1);
+
+  /*
+   * Newton iterations
+   */
+
+  tauScale = (*tau);
+  merit = newtonEquations(dMat, m, n, k, dVec, priorVec, nu, coef, *tau,
+      tauScale, resid, w, c, F);
+  logPosterior_tm1 = (*logPosterior);
+
+  for (; iter<maxIter; iter++)
+  {
+    // Newton direction: J step = -F
+    newtonJacobian(dMat, m, n, k, priorVec, nu, *tau, resid, w,
+        sqdX, c, e, J);
+    for (i=0; i<=k; i++)
+    {
+      step[i] = -F[i];
+    }
+    info = dgesv(k+1, 1, J, k+1, ipiv, step, k+1);
+    if (info != 0)
+    {
+      break;
+    }
+
+    // Backtracking line search on the merit function
+    alpha = 1;
+    for (h=0; h<=kNewtonMaxHalvings; h++, alpha/=2)
+    {
+      tauNew = (*tau) + alpha * step[k];
+      if (tauNew <= 0)
+      {
+        continue;
+      }
+      dcopy(k, coef, 1, coefNew, 1);
+      daxpy(k, alpha, step, 1, coefNew, 1);
+      meritNew = newtonEquations(dMat, m, n, k, dVec, priorVec, nu,
+          coefNew, tauNew, tauScale, residNew, wNew, c, FNew);
+      if (meritNew <= (1 - 2 * kNewtonArmijo * alpha) * merit)
+      {
+        break;
+      }
+    }
+    if (h > kNewtonMaxHalvings)
+    {
+      break;
+    }
+
+    // Accept step
+    dcopy(k, coefNew, 1, coef, 1);
+    (*tau) = tauNew;
+    merit = meritNew;
+    swap = resid; resid = residNew; residNew = swap;
+    swap = w; w = wNew; wNew = swap;
+    swap = F; F = FNew; FNew = swap;
+
+    // Calculate log-posterior
+    (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+    logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+    (*logPosterior) = (*logLikelihood) + logPrior;
+
+    // Check convergence; Newton need not increase the log-posterior
+    delta = ((*logPosterior) - logPosterior_tm1) /
+      fabs((*logPosterior) + logPosterior_tm1) * 2;
+
+    logPosterior_tm1 = (*logPosterior);
+    if (fabs(delta) < tol)
+    {
+      iter++;
+      converged = 1;
+      break;
+    }
+  }
+
+  /*
+   * Free allocated memory
+   */
+
+  free(dVec);
+  free(resid);
+  free(residNew);
+  free(w);
+  free(wNew);
+  free(c);
+  free(e);
+  free(sqdX);
+  free(J);
+  free(F);
+  free(FNew);
+  free(step);
+  free(coefNew);
+  free(ipiv);
+
+  // Safeguard: finish with EM from the current point
+  if (!converged && iter < maxIter)
+  {
+    iter += lmTDesign(dMat, n, k, yVec, priorVec, nu, maxIter - iter, tol,
+        logPosterior, logLikelihood, coef, tau, 1);
+  }
+
+  return iter;
+}
+
+/*
+ * As lmT, using lmTNewtonDesign
+ */
+
+int lmTNewton(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  int iter;
+  double * dMat;
+
+  dMat = buildDesign(basisMat, basisRows, timeVec, n, k);
+
+  iter = lmTNewtonDesign(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, warmStart);
+
+  free(dMat);
+
+  return iter;
+}
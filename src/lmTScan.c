@@ -0,0 +1,661 @@
+/*
+ * lmTScan.c
+ *
+ *  Wavelet model fit of long series with memory independent of their length
+ *
+ *  The data file is memory-mapped and scanned twice: once for the number of
+ *  valid observations and their time range, and once to write the basis row
+ *  (as an index among the occupied rows, its group) and value of each to a
+ *  memory-mapped scratch file of 12 bytes per observation. Nothing else is
+ *  kept per observation. Residuals and E-step weights are recomputed from
+ *  these records and the fitted value of each group in one sequential pass
+ *  per EM iteration, which also accumulates the weighted group statistics of
+ *  the next M step. The regression is then solved on the G <= basisRows
+ *  occupied rows as in lmTGrouped, so the heap holds O(basisRows * k) values
+ *  whatever the number of observations; the mapped pages are read ahead and
+ *  dropped by the kernel as each pass moves through them.
+ *
+ *  With basisInterp a group is the interval between two adjacent rows, and
+ *  each record also holds the fraction f of the way across it (20 bytes in
+ *  all). A design row (1-f) a + f b then contributes to X'WX through the
+ *  sums of w (1-f)^2, w f (1-f) and w f^2 of its group. These are written
+ *  as two rows per group, a + c b with c = sum w f (1-f) / sum w (1-f)^2,
+ *  and b, weighted so that their cross products give the same X'WX and
+ *  X'Wy. The first row changes with the weights, so X'WX is rebuilt each
+ *  iteration rather than updated by wlsUpdate.
+ */
+
+#include "rowavedt.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// Scratch files for scanSeries go to $TMPDIR, else here
+const char * kScanScratchDir = "/tmp";
+
+/*
+ * Parse the time and value of one line of text (not NUL-terminated) into
+ * (*t) and (*y); the line is copied to (*buf), grown as needed.
+ * Returns 0 for comments and lines without both columns.
+ */
+static int scanLine(const char * line, size_t len, int timeCol, int valueCol,
+    char ** buf, size_t * bufSize, double * t, double * y)
+{
+  const char sep[] = "\t ,";
+  char * tok, * save;
+  int j, found = 0;
+
+  if (len == 0 || line[0] == '#')
+    return 0;
+
+  if (len + 1 > (*bufSize))
+  {
+    (*bufSize) = 2 * (len + 1);
+    free(*buf);
+    (*buf) = malloc(*bufSize);
+    checkPtr(*buf, "out of memory");
+  }
+  memcpy(*buf, line, len);
+  (*buf)[len] = '\0';
+
+  j = 0;
+  for (tok=strtok_r(*buf, sep, &save); tok != NULL;
+      tok=strtok_r(NULL, sep, &save))
+  {
+    if (j == timeCol)
+    {
+      (*t) = atof(tok);
+      found |= 1;
+    }
+    if (j == valueCol)
+    {
+      (*y) = atof(tok);
+      found |= 2;
+    }
+    j++;
+  }
+
+  return (found == 3);
+}
+
+/*
+ * Map dataFile and write the valid observations (value not missingCode) of
+ * columns timeCol and valueCol to a scratch file, mapped into series
+ * Returns the number of valid observations; release with closeScanSeries
+ */
+int openScanSeries(const char * dataFile, int timeCol, int valueCol,
+    double missingCode, int basisRows, scanSeries * series)
+{
+  int fd, pass, g, row;
+  size_t recordSize = sizeof(double) + sizeof(int);
+  long n = 0;
+  struct stat st;
+  const char * text = NULL, * end, * line, * eol;
+  char * buf = NULL, * scratch;
+  size_t bufSize = 0;
+  double t = 0, y = 0, tRow, frac, minTime = 0, maxTime = 0;
+  const char * dir;
+
+  memset(series, 0, sizeof(scanSeries));
+
+  fd = open(dataFile, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    perror(dataFile);
+    exit(1);
+  }
+
+  if (st.st_size > 0)
+  {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED)
+    {
+      perror(dataFile);
+      exit(1);
+    }
+    madvise((void *) text, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  end = text + st.st_size;
+
+  int * groupOfRow;
+  groupOfRow = malloc(basisRows * sizeof(int));
+  checkPtr(groupOfRow, "out of memory");
+  for (row=0; row<basisRows; row++)
+  {
+    groupOfRow[row] = -1;
+  }
+
+  series->rowOfGroup = malloc(basisRows * sizeof(int));
+  checkPtr(series->rowOfGroup, "out of memory");
+  series->shift = malloc(basisRows * sizeof(double));
+  checkPtr(series->shift, "out of memory");
+
+  // Pass 0 counts the valid observations and finds their time range;
+  // pass 1 writes their records
+  for (pass=0; pass<2; pass++)
+  {
+    if (pass == 1)
+    {
+      if (n == 0)
+        break;
+      if (n > INT_MAX)
+      {
+        fprintf(stderr, "Error -- more than %d observations in %s\n",
+            INT_MAX, dataFile);
+        exit(1);
+      }
+      recordSize += basisInterp ? sizeof(double) : 0;
+      series->mapSize = n * recordSize;
+
+      // Unlinked scratch file, removed when unmapped
+      dir = getenv("TMPDIR");
+      dir = (dir != NULL && dir[0] != '\0') ? dir : kScanScratchDir;
+      scratch = malloc(strlen(dir) + 32);
+      checkPtr(scratch, "out of memory");
+      sprintf(scratch, "%s/rowavedt-scan.XXXXXX", dir);
+      fd = mkstemp(scratch);
+      if (fd < 0 || ftruncate(fd, series->mapSize) != 0)
+      {
+        perror(scratch);
+        exit(1);
+      }
+      unlink(scratch);
+      free(scratch);
+
+      series->map = mmap(NULL, series->mapSize, PROT_READ | PROT_WRITE,
+          MAP_SHARED, fd, 0);
+      if (series->map == MAP_FAILED)
+      {
+        perror("scratch file");
+        exit(1);
+      }
+      close(fd);
+
+      series->yVec = (double *) series->map;
+      series->fracVec = basisInterp ? &series->yVec[n] : NULL;
+      series->groupVec = (int *) &series->yVec[basisInterp ? 2*n : n];
+      n = 0;
+    }
+
+    for (line=text; line<end; line=eol+1)
+    {
+      eol = memchr(line, '\n', end - line);
+      eol = (eol == NULL) ? end : eol;
+
+      if (!scanLine(line, eol - line, timeCol, valueCol, &buf, &bufSize,
+            &t, &y) || isnan(t) || isnan(y) || y == missingCode)
+        continue;
+
+      if (pass == 0)
+      {
+        minTime = (n == 0 || t < minTime) ? t : minTime;
+        maxTime = (n == 0 || t > maxTime) ? t : maxTime;
+        n++;
+        continue;
+      }
+
+      // Basis row as rescaleTimes and buildDesign would give it
+      tRow = (t - minTime) / (maxTime - minTime);
+      tRow = tRow * (basisRows-1);
+      basisPosition(tRow, basisRows, &row, &frac);
+
+      g = groupOfRow[row];
+      if (g < 0)
+      {
+        g = groupOfRow[row] = series->G;
+        series->rowOfGroup[g] = row;
+        series->shift[g] = y;
+        series->G++;
+      }
+      series->yVec[n] = y;
+      series->groupVec[n] = g;
+      if (series->fracVec != NULL)
+        series->fracVec[n] = frac;
+      n++;
+    }
+  }
+
+  if (text != NULL)
+    munmap((void *) text, st.st_size);
+  if (series->map != NULL)
+    madvise(series->map, series->mapSize, MADV_SEQUENTIAL);
+  free(buf);
+  free(groupOfRow);
+
+  series->n = (int) n;
+  series->minTime = minTime;
+  series->maxTime = maxTime;
+
+  return series->n;
+}
+
+void closeScanSeries(scanSeries * series)
+{
+  if (series->map != NULL)
+    munmap(series->map, series->mapSize);
+  free(series->rowOfGroup);
+  free(series->shift);
+  memset(series, 0, sizeof(scanSeries));
+}
+
+/*
+ * Weighted sums of one pass by group, taken about the group shift so that
+ * they do not cancel for values far from zero (d = y - shift): sum w, w d
+ * and w d^2, and with basisInterp sum w f, w (1-f)^2, w f (1-f), w f^2 and
+ * w f d, f being the fraction across the group's interval
+ */
+typedef struct {
+  double * w, * d, * dd;
+  double * w1, * w00, * w01, * w11, * d1;
+} scanStats;
+
+static void allocScanStats(scanStats * st, int G, int interp)
+{
+  int s, nStats = interp ? 8 : 3;
+  double ** fields[8] = {&st->w, &st->d, &st->dd,
+    &st->w1, &st->w00, &st->w01, &st->w11, &st->d1};
+
+  memset(st, 0, sizeof(scanStats));
+  for (s=0; s<nStats; s++)
+  {
+    (*fields[s]) = calloc(G, sizeof(double));
+    checkPtr(*fields[s], "out of memory");
+  }
+}
+
+static void freeScanStats(scanStats * st)
+{
+  free(st->w);
+  free(st->d);
+  free(st->dd);
+  free(st->w1);
+  free(st->w00);
+  free(st->w01);
+  free(st->w11);
+  free(st->d1);
+}
+
+/*
+ * One pass over the observations at group fitted values fitted (with
+ * basisInterp, those at the start of each interval followed by those at its
+ * end) and scale tau. Sets the statistics of the next M step, and returns
+ * the log-likelihood as dt_log would give it.
+ * With tau <= 0 all weights are 1 and the log-likelihood is not computed.
+ */
+static double scanPass(const scanSeries * series, const double * fitted,
+    double tau, double nu, scanStats * st)
+{
+  int i, g, G = series->G;
+  double r, d, f, w = 1, sumLog = 0;
+  const double * y = series->yVec;
+  const double * frac = series->fracVec;
+  const int * group = series->groupVec;
+  const double * shift = series->shift;
+
+  TRACE_BEGIN(TRACE_DTLOG);
+
+  for (g=0; g<G; g++)
+  {
+    st->w[g] = 0;
+    st->d[g] = 0;
+    st->dd[g] = 0;
+    if (frac != NULL)
+    {
+      st->w1[g] = 0;
+      st->w00[g] = 0;
+      st->w01[g] = 0;
+      st->w11[g] = 0;
+      st->d1[g] = 0;
+    }
+  }
+
+  for (i=0; i<series->n; i++)
+  {
+    g = group[i];
+    f = (frac != NULL) ? frac[i] : 0;
+    if (tau > 0)
+    {
+      r = (frac != NULL) ? y[i] - ((1-f) * fitted[g] + f * fitted[G+g]) :
+        y[i] - fitted[g];
+      if (isinf(nu))
+      {
+        sumLog += r * r / tau;
+      }
+      else
+      {
+        sumLog += log(1 + r * r / tau / nu);
+        w = tWeight(r, tau, nu);
+      }
+    }
+    d = y[i] - shift[g];
+    st->w[g] += w;
+    st->d[g] += w * d;
+    st->dd[g] += w * d * d;
+    if (frac != NULL)
+    {
+      st->w1[g] += w * f;
+      st->w00[g] += w * (1-f) * (1-f);
+      st->w01[g] += w * f * (1-f);
+      st->w11[g] += w * f * f;
+      st->d1[g] += w * f * d;
+    }
+  }
+
+  TRACE_END(TRACE_DTLOG, series->mapSize);
+
+  if (tau <= 0)
+    return 0;
+  if (isinf(nu))
+    return -0.5 * sumLog - series->n * log(sqrt(tau));
+  return -(nu+1)/2 * sumLog - series->n * log(sqrt(tau));
+}
+
+/*
+ * Weighted mean squared residual at group fitted values fitted (as for
+ * scanPass) and coefficients coef, from the statistics of scanPass
+ */
+static double scanTau(const scanSeries * series, int k, const double * fitted,
+    const double * coef, const scanStats * st, const double * priorVec)
+{
+  int g, j, G = series->G;
+  double e, eb, tau = 0, sumw = 0;
+
+  for (g=0; g<G; g++)
+  {
+    e = fitted[g] - series->shift[g];
+    if (series->fracVec != NULL)
+    {
+      eb = fitted[G+g] - series->shift[g];
+      tau += st->dd[g] - 2 * e * (st->d[g] - st->d1[g]) - 2 * eb * st->d1[g]
+        + e * e * st->w00[g] + 2 * e * eb * st->w01[g]
+        + eb * eb * st->w11[g];
+    }
+    else
+    {
+      tau += st->dd[g] - 2 * e * st->d[g] + e * e * st->w[g];
+    }
+    sumw += st->w[g];
+  }
+  for (j=0; j<k-1; j++)
+  {
+    tau += coef[j+1] * coef[j+1] * priorVec[j];
+    sumw += priorVec[j];
+  }
+
+  return tau / sumw;
+}
+
+/*
+ * Weighted regression for basisInterp from the statistics of scanPass
+ * ends holds the basis rows at the start of each interval followed by those
+ * at its end (2G x k); dMat (2G+k-1 x k) holds the prior rows on input, and
+ * gets two rows for each group. Results go to coef; wg and dVec (2G+k-1) get
+ * the weights and values of the rows.
+ *
+ * A group's 2 x 2 weights [w00 w01; w01 w11] are split as in a Cholesky
+ * factorization, pivoting on the end with the larger weight: with a the
+ * pivot end and b the other, its rows are ends[a] + c * ends[b] with
+ * weight waa and ends[b] with weight wbb - c * w01, where c = w01 / waa.
+ */
+static void scanInterpSolve(const scanSeries * series, int k,
+    const double * ends, double * dMat, double * wg, double * dVec,
+    const scanStats * st, double * XTX, double * sqw, double * sqwX,
+    double * sqwy, double * coef)
+{
+  int g, j, a, b, G = series->G, m = 2*G + k - 1;
+  double c, q, waa, wbb, say, sby, s0y, s1y;
+
+  for (g=0; g<G; g++)
+  {
+    s0y = st->d[g] - st->d1[g] + series->shift[g] * (st->w[g] - st->w1[g]);
+    s1y = st->d1[g] + series->shift[g] * st->w1[g];
+
+    // Pivot on the end nearer the observations, so that c is at most 1
+    a = (st->w11[g] > st->w00[g]) ? G+g : g;
+    b = (a == g) ? G+g : g;
+    waa = (a == g) ? st->w00[g] : st->w11[g];
+    wbb = (a == g) ? st->w11[g] : st->w00[g];
+    say = (a == g) ? s0y : s1y;
+    sby = (a == g) ? s1y : s0y;
+
+    c = (waa > 0) ? st->w01[g] / waa : 0;
+    q = wbb - c * st->w01[g];
+
+    for (j=0; j<k; j++)
+    {
+      dMat[g + j*m] = ends[a + j*2*G] + c * ends[b + j*2*G];
+      dMat[G+g + j*m] = ends[b + j*2*G];
+    }
+    wg[g] = waa;
+    dVec[g] = (waa > 0) ? say / waa : 0;
+
+    // Second row vanishes when every observation sits at the same fraction
+    if (q > 1e-12 * wbb)
+    {
+      wg[G+g] = q;
+      dVec[G+g] = (sby - c * say) / q;
+    }
+    else
+    {
+      wg[G+g] = 0;
+      dVec[G+g] = 0;
+    }
+  }
+
+  wls(dMat, m, k, dVec, wg, XTX, sqw, sqwX, sqwy, coef);
+}
+
+/*
+ * Function to run wavelet model on a scanSeries
+ * Returns number of iterations run
+ *
+ * Follows lmTGrouped iteration for iteration; each iteration costs one pass
+ * over the observations (plus one with unit weights for a cold start).
+ * Results match lmT up to rounding. If warmStart is nonzero, coef and tau
+ * hold starting values on input.
+ */
+int lmTScan(double * basisMat, int basisRows,
+    const scanSeries * series,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart)
+{
+  int iter, i, j, g, m, nEnds;
+  int G = series->G, interp = (series->fracVec != NULL);
+  double logPosterior_tm1, logPrior, delta;
+
+  // Nearest rows: one design row per group. Interpolation: two per group,
+  // from the basis rows at both ends of each interval (ends)
+  nEnds = interp ? 2*G : G;
+  m = nEnds + k - 1;
+
+  /*
+   * Setup grouped dmat
+   */
+
+  TRACE_BEGIN(TRACE_DESIGN);
+
+  double * dMat, * dVec, * ends = NULL;
+  dMat = calloc(m * k, sizeof(double));
+  checkPtr(dMat, "out of memory");
+
+  dVec = calloc(m, sizeof(double));
+  checkPtr(dVec, "out of memory");
+
+  for (g=0; g<nEnds; g++)
+  {
+    i = series->rowOfGroup[g % G] + g / G;
+    for (j=0; j<k; j++)
+    {
+      dMat[g + j*m] = basisMat[i + j*basisRows];
+    }
+  }
+
+  if (interp)
+  {
+    ends = malloc(nEnds * k * sizeof(double));
+    checkPtr(ends, "out of memory");
+    for (j=0; j<k; j++)
+    {
+      dcopy(nEnds, &dMat[j*m], 1, &ends[j*nEnds], 1);
+    }
+  }
+
+  // Identity (w/o first row) for prior
+  for (i=nEnds; i<m; i++)
+  {
+    j = i - nEnds + 1;
+    dMat[i + j*m] = 1;
+  }
+
+  TRACE_END(TRACE_DESIGN, 2 * m * k * sizeof(double));
+
+  /*
+   * Allocate workspace
+   */
+
+  double * sqwX, * XTX;
+  sqwX = malloc(m * k * sizeof(double));
+  checkPtr(sqwX, "out of memory");
+
+  XTX = malloc(k * k * sizeof(double));
+  checkPtr(XTX, "out of memory");
+
+  // Weights of design rows (wg), statistics of the last pass, and fitted
+  // values at the basis rows of each group
+  double * wg, * sqw, * sqwy, * fitted;
+  scanStats st;
+
+  wg = calloc(m, sizeof(double));
+  checkPtr(wg, "out of memory");
+
+  sqw = calloc(m, sizeof(double));
+  checkPtr(sqw, "out of memory");
+
+  sqwy = calloc(m, sizeof(double));
+  checkPtr(sqwy, "out of memory");
+
+  fitted = calloc(nEnds, sizeof(double));
+  checkPtr(fitted, "out of memory");
+
+  allocScanStats(&st, G, interp);
+
+  wlsCache cache;
+  initWlsCache(&cache, m, k);
+
+  dcopy(k-1, priorVec, 1, &wg[nEnds], 1);
+
+  /*
+   * First iteration
+   */
+
+  if (!warmStart || (*tau) <= 0)
+  {
+    scanPass(series, NULL, 0, nu, &st);
+  }
+
+  if (!warmStart)
+  {
+    if (interp)
+    {
+      scanInterpSolve(series, k, ends, dMat, wg, dVec, &st,
+          XTX, sqw, sqwX, sqwy, coef);
+    }
+    else
+    {
+      for (g=0; g<G; g++)
+      {
+        dVec[g] = series->shift[g] + st.d[g] / st.w[g];
+        wg[g] = st.w[g];
+      }
+      wlsUpdate(dMat, m, k, dVec, wg, XTX, sqw, sqwX, sqwy, coef, &cache);
+    }
+  }
+
+  if (interp)
+    dgemv('n', nEnds, k, 1, ends, nEnds, coef, 1, 0, fitted, 1);
+  else
+    dgemv('n', nEnds, k, 1, dMat, m, coef, 1, 0, fitted, 1);
+
+  if (!warmStart || (*tau) <= 0)
+  {
+    (*tau) = scanTau(series, k, fitted, coef, &st, priorVec);
+  }
+
+  // Initial log-posterior, and weights for the first E step
+  (*logLikelihood) = scanPass(series, fitted, *tau, nu, &st);
+  logPrior = dnorm_log(&coef[1], k-1, 0, sqrt((*tau)/priorVec[0]));
+  (*logPosterior) = (*logLikelihood) + logPrior;
+
+  logPosterior_tm1 = (*logPosterior);
+
+  /*
+   * EM loop
+   */
+  for (iter=0; iter<maxIter; iter++)
+  {
+    // M step: Update beta, tau | u, with u from the last pass
+    if (interp)
+    {
+      scanInterpSolve(series, k, ends, dMat, wg, dVec, &st,
+          XTX, sqw, sqwX, sqwy, coef);
+      dgemv('n', nEnds, k, 1, ends, nEnds, coef, 1, 0, fitted, 1);
+    }
+    else
+    {
+      for (g=0; g<G; g++)
+      {
+        dVec[g] = series->shift[g] + st.d[g] / st.w[g];
+        wg[g] = st.w[g];
+      }
+      wlsUpdate(dMat, m, k, dVec, wg, XTX, sqw, sqwX, sqwy, coef, &cache);
+      dgemv('n', nEnds, k, 1, dMat, m, coef, 1, 0, fitted, 1);
+    }
+
+    (*tau) = scanTau(series, k, fitted, coef, &st, priorVec);
+
+    // Log-posterior, and E step: Update u | beta, tau
+    (*logLikelihood) = scanPass(series, fitted, *tau, nu, &st);
+    logPrior = dnorm_log(&coef[1], k-1, 0, sqrt((*tau)/priorVec[0]));
+    (*logPosterior) = (*logLikelihood) + logPrior;
+
+    // Check convergence as lmT
+    delta = ((*logPosterior) - logPosterior_tm1) /
+      fabs((*logPosterior) + logPosterior_tm1) * 2;
+
+    if (fabs(delta) < tol)
+    {
+      logPosterior_tm1 = (*logPosterior);
+      break;
+    }
+    logPosterior_tm1 = (*logPosterior);
+  }
+
+  /*
+   * Free allocated memory
+   */
+
+  free(dMat);
+  free(dVec);
+  free(ends);
+
+  free(sqwX);
+  free(XTX);
+
+  free(wg);
+  free(sqw);
+  free(sqwy);
+  free(fitted);
+  freeScanStats(&st);
+
+  freeWlsCache(&cache);
+
+  return iter;
+}
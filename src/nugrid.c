@@ -0,0 +1,443 @@
+/*
+ * nugrid.c
+ *
+ *  Fits of the full and smooth models over a grid of t degrees of freedom
+ */
+
+#include "rowavedt.h"
+
+/*
+ * Parse a comma-separated list of degrees of freedom (e.g. "2,3,5,10,inf")
+ * into nuVec, sorted in increasing order. Values below 1 are set to 1, as
+ * for a single -d value.
+ * Returns the number of values; caller frees nuVec
+ */
+int parseNuList(const char * list, double ** nuVec)
+{
+  int nNu = 1, i;
+  const char * pos;
+  char * end;
+
+  for (pos=list; *pos != '\0'; pos++)
+  {
+    if (*pos == ',') nNu++;
+  }
+
+  double * nu;
+  nu = calloc(nNu, sizeof(double));
+  checkPtr(nu, "out of memory");
+
+  pos = list;
+  for (i=0; i<nNu; i++)
+  {
+    nu[i] = strtod(pos, &end);
+    if (end == pos || (*end != ',' && *end != '\0') || isnan(nu[i]))
+    {
+      fprintf(stderr, "Error -- invalid df list '%s'\n", list);
+      exit(1);
+    }
+    nu[i] = (nu[i] < 1) ? 1 : nu[i];
+    pos = end + 1;
+  }
+
+  qsort(nu, nNu, sizeof(double), compare_dbl);
+  (*nuVec) = nu;
+
+  return nNu;
+}
+
+nuFit * allocNuFits(const double * nuVec, int nNu, int basisCols, int kSmooth)
+{
+  int g;
+  nuFit * fits;
+
+  fits = calloc(nNu, sizeof(nuFit));
+  checkPtr(fits, "out of memory");
+
+  for (g=0; g<nNu; g++)
+  {
+    fits[g].nu = nuVec[g];
+    fits[g].coef_m = calloc(basisCols, sizeof(double));
+    checkPtr(fits[g].coef_m, "out of memory");
+    fits[g].coef_l = calloc(kSmooth, sizeof(double));
+    checkPtr(fits[g].coef_l, "out of memory");
+  }
+
+  return fits;
+}
+
+void freeNuFits(nuFit * fits, int nNu)
+{
+  int g;
+
+  for (g=0; g<nNu; g++)
+  {
+    free(fits[g].coef_m);
+    free(fits[g].coef_l);
+  }
+  free(fits);
+}
+
+// Fit one model on a shared design, or on basisMatF in mixed precision
+// With unitChol (EM only), coef holds the unit-weight solution it factors
+static int fitModel(double * dMat, float * basisMatF, double * basisMat,
+    int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    double nu, int k, int maxIter, double tol, char solver,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau, int warmStart, const double * unitChol)
+{
+  if (basisMatF != NULL)
+  {
+    return lmTMixed(basisMatF, basisMat, basisRows, basisCols,
+        yVec, n, timeVec, priorVec, nu, k, maxIter, tol,
+        logPosterior, logLikelihood, coef, tau, warmStart);
+  }
+  if (unitChol != NULL)
+  {
+    return lmTDesignSeeded(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+        logPosterior, logLikelihood, coef, tau, unitChol);
+  }
+  if (solver == 'n')
+  {
+    return lmTNewtonDesign(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+        logPosterior, logLikelihood, coef, tau, warmStart);
+  }
+  return lmTDesign(dMat, n, k, yVec, priorVec, nu, maxIter, tol,
+      logPosterior, logLikelihood, coef, tau, warmStart);
+}
+
+// Fields of the full (smooth = 0) or smooth model of a nuFit
+typedef struct {
+  double * coef, * tau, * logPosterior, * logLikelihood;
+  int * iter;
+} nuFitModel;
+
+static nuFitModel fitModelOf(nuFit * fit, int smooth)
+{
+  nuFitModel model;
+
+  model.coef = smooth ? fit->coef_l : fit->coef_m;
+  model.tau = smooth ? &fit->tau_l : &fit->tau_m;
+  model.logPosterior = smooth ? &fit->logPosterior_l : &fit->logPosterior_m;
+  model.logLikelihood = smooth ? &fit->logLikelihood_l :
+    &fit->logLikelihood_m;
+  model.iter = smooth ? &fit->iter_l : &fit->iter_m;
+
+  return model;
+}
+
+// Fit one model (k columns) for each df, every df from the same start, so
+// that its fit does not depend on the rest of the list. With warmStart or
+// unitChol (as for fitModel), fits[0] holds that start on input.
+static void fitModelGrid(double * dMat, float * basisMatF, double * basisMat,
+    int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int k, int smooth, int maxIter, double tol, char solver,
+    nuFit * fits, int nNu, int warmStart, const double * unitChol)
+{
+  int g;
+  double * startCoef = NULL, startTau;
+  nuFitModel model;
+
+  model = fitModelOf(&fits[0], smooth);
+  if (nNu > 1 && (warmStart || unitChol != NULL))
+  {
+    startCoef = malloc(k * sizeof(double));
+    checkPtr(startCoef, "out of memory");
+    dcopy(k, model.coef, 1, startCoef, 1);
+  }
+  startTau = (*model.tau);
+
+  for (g=0; g<nNu; g++)
+  {
+    model = fitModelOf(&fits[g], smooth);
+    if (g > 0)
+    {
+      if (startCoef != NULL)
+        dcopy(k, startCoef, 1, model.coef, 1);
+      (*model.tau) = startTau;
+    }
+
+    (*model.iter) = fitModel(dMat, basisMatF, basisMat,
+        basisRows, basisCols, yVec, n, timeVec, priorVec,
+        fits[g].nu, k, maxIter, tol, solver,
+        model.logPosterior, model.logLikelihood,
+        model.coef, model.tau, warmStart, unitChol);
+  }
+
+  free(startCoef);
+}
+
+/*
+ * Fit the full (basisCols) and smooth (kSmooth) models for each df in fits
+ *
+ * Designs are built once and shared across the grid, so every extra df
+ * costs only its EM iterations. Each df is fit from the same start, so its
+ * result is the one a single -d would give. If warmStart is nonzero,
+ * fits[0] holds starting values; otherwise near-regularly sampled series
+ * start from projectInit where it solves the first regression. With
+ * basisMatF (mixed precision, -f) each fit builds its own design.
+ * Times must already be rescaled (see rescaleTimes).
+ */
+void fitNuGrid(double * basisMat, float * basisMatF,
+    int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit * fits, int nNu, int warmStart)
+{
+  double * dMat_m = NULL, * dMat_l = NULL;
+  int warm_m = warmStart, warm_l = warmStart;
+
+  if (basisMatF == NULL)
+  {
+    dMat_m = buildDesign(basisMat, basisRows, timeVec, n, basisCols);
+    dMat_l = buildDesign(basisMat, basisRows, timeVec, n, kSmooth);
+  }
+
+  // Start near-regular series from the projection instead of a first solve
+  if (!warmStart && basisMatF == NULL &&
+      regularSampling(timeVec, n, basisRows, basisCols) &&
+      regularSampling(timeVec, n, basisRows, kSmooth))
+  {
+    warm_m = projectInit(dMat_m, n, basisCols, basisRows, yVec, priorVec,
+        fits[0].coef_m);
+    warm_l = projectInit(dMat_l, n, kSmooth, basisRows, yVec, priorVec,
+        fits[0].coef_l);
+    fits[0].tau_m = 0;
+    fits[0].tau_l = 0;
+  }
+
+  fitModelGrid(dMat_m, basisMatF, basisMat, basisRows, basisCols,
+      yVec, n, timeVec, priorVec, basisCols, 0, maxIter, tol, solver,
+      fits, nNu, warm_m, NULL);
+  fitModelGrid(dMat_l, basisMatF, basisMat, basisRows, basisCols,
+      yVec, n, timeVec, priorVec, kSmooth, 1, maxIter, tol, solver,
+      fits, nNu, warm_l, NULL);
+
+  free(dMat_m);
+  free(dMat_l);
+}
+
+/*
+ * As fitNuGrid (without warm start or mixed precision) for a block of
+ * nLanes <= BLOCK_LANES short series; fits[s] is the grid of series s
+ *
+ * Models with at most kBlockMaxK columns are fit to all series of the block
+ * at once by lmTBlock if solver is EM; other models are fit series by series
+ * as in fitNuGrid. Starting values are chosen per series as in fitNuGrid.
+ */
+void fitNuGridBlock(double * basisMat, int basisRows, int basisCols,
+    double ** yVecs, int * nVec, double ** timeVecs, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit ** fits, int nNu, int nLanes)
+{
+  int s, g, k, smooth, regular[BLOCK_LANES], project[BLOCK_LANES];
+  int warm[BLOCK_LANES], iter[BLOCK_LANES];
+  double logPosterior[BLOCK_LANES], logLikelihood[BLOCK_LANES];
+  double tau[BLOCK_LANES], * coefs[BLOCK_LANES], * starts, * dMat;
+  nuFitModel model;
+
+  // Projection starts of each lane, kept for every df
+  starts = calloc(BLOCK_LANES * basisCols, sizeof(double));
+  checkPtr(starts, "out of memory");
+
+  for (s=0; s<nLanes; s++)
+  {
+    regular[s] = regularSampling(timeVecs[s], nVec[s], basisRows,
+        basisCols) &&
+      regularSampling(timeVecs[s], nVec[s], basisRows, kSmooth);
+  }
+
+  for (smooth=0; smooth<2; smooth++)
+  {
+    k = smooth ? kSmooth : basisCols;
+
+    // Starting values
+    for (s=0; s<nLanes; s++)
+    {
+      model = fitModelOf(&fits[s][0], smooth);
+      dMat = buildDesign(basisMat, basisRows, timeVecs[s], nVec[s], k);
+      project[s] = regular[s] && projectInit(dMat, nVec[s], k, basisRows,
+          yVecs[s], priorVec, model.coef);
+      if (project[s])
+      {
+        (*model.tau) = 0;
+        dcopy(k, model.coef, 1, &starts[s * basisCols], 1);
+      }
+
+      // Models too large for a block
+      if (k > kBlockMaxK || solver != 'e')
+      {
+        fitModelGrid(dMat, NULL, basisMat, basisRows, basisCols,
+            yVecs[s], nVec[s], timeVecs[s], priorVec, k, smooth,
+            maxIter, tol, solver, fits[s], nNu, project[s], NULL);
+      }
+      free(dMat);
+    }
+    if (k > kBlockMaxK || solver != 'e')
+      continue;
+
+    // Every df from the same start, as in fitModelGrid
+    for (g=0; g<nNu; g++)
+    {
+      for (s=0; s<nLanes; s++)
+      {
+        model = fitModelOf(&fits[s][g], smooth);
+        if (g > 0 && project[s])
+          dcopy(k, &starts[s * basisCols], 1, model.coef, 1);
+        coefs[s] = model.coef;
+        warm[s] = project[s];
+        tau[s] = 0;
+      }
+
+      lmTBlock(basisMat, basisRows, k, nLanes, yVecs, timeVecs, nVec,
+          priorVec, fits[0][g].nu, maxIter, tol,
+          logPosterior, logLikelihood, coefs, tau, iter, warm);
+
+      for (s=0; s<nLanes; s++)
+      {
+        model = fitModelOf(&fits[s][g], smooth);
+        (*model.tau) = tau[s];
+        (*model.logPosterior) = logPosterior[s];
+        (*model.logLikelihood) = logLikelihood[s];
+        (*model.iter) = iter[s];
+      }
+    }
+  }
+
+  free(starts);
+}
+
+/*
+ * As fitNuGrid (without warm start) for nBands series observed at the same
+ * times: column b of yMat (n x nBands) holds band b, fitted into fits[b]
+ *
+ * The designs are built once for all bands. Unless every band can start
+ * from projectInit, the unit-weight normal equations that start each EM
+ * fit are factored once and solved for all bands together, and the factor
+ * then serves each band's first iterations as in wlsUpdate. Mixed
+ * precision and Newton fits go band by band (fitNuGrid).
+ */
+void fitNuGridBands(double * basisMat, float * basisMatF,
+    int basisRows, int basisCols,
+    double * yMat, int n, int nBands, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit ** fits, int nNu)
+{
+  int b, j, k, smooth, regular, project, info;
+  double * dMat, * XTX, * coefs;
+  nuFitModel model;
+
+  if (basisMatF != NULL || solver != 'e')
+  {
+    for (b=0; b<nBands; b++)
+    {
+      fitNuGrid(basisMat, basisMatF, basisRows, basisCols,
+          &yMat[b * n], n, timeVec, priorVec, kSmooth, maxIter, tol, solver,
+          fits[b], nNu, 0);
+    }
+    return;
+  }
+
+  regular = regularSampling(timeVec, n, basisRows, basisCols) &&
+    regularSampling(timeVec, n, basisRows, kSmooth);
+
+  for (smooth=0; smooth<2; smooth++)
+  {
+    k = smooth ? kSmooth : basisCols;
+    dMat = buildDesign(basisMat, basisRows, timeVec, n, k);
+
+    XTX = calloc(k * k, sizeof(double));
+    checkPtr(XTX, "out of memory");
+    coefs = calloc(k * nBands, sizeof(double));
+    checkPtr(coefs, "out of memory");
+
+    // Projection starts only if they serve every band
+    project = regular;
+    for (b=0; b<nBands && project; b++)
+    {
+      model = fitModelOf(&fits[b][0], smooth);
+      project = projectInit(dMat, n, k, basisRows, &yMat[b * n], priorVec,
+          model.coef);
+      (*model.tau) = 0;
+    }
+
+    info = 1;
+    if (!project)
+    {
+      // X'WX for unit observation weights; prior rows are 0 in y
+      dsyrk('u', 't', k, n, 1, dMat, n + k - 1, 0, XTX, k);
+      for (j=1; j<k; j++)
+      {
+        XTX[j + j*k] += priorVec[j-1];
+      }
+      dgemm('t', 'n', k, nBands, n, 1, dMat, n + k - 1, yMat, n, 0,
+          coefs, k);
+      info = dposv('u', k, nBands, XTX, k, coefs, k);
+    }
+
+    for (b=0; b<nBands; b++)
+    {
+      model = fitModelOf(&fits[b][0], smooth);
+      if (!project && info == 0)
+      {
+        dcopy(k, &coefs[b * k], 1, model.coef, 1);
+      }
+
+      fitModelGrid(dMat, NULL, basisMat, basisRows, basisCols,
+          &yMat[b * n], n, timeVec, priorVec, k, smooth, maxIter, tol,
+          solver, fits[b], nNu, project, (info == 0) ? XTX : NULL);
+    }
+
+    free(dMat);
+    free(XTX);
+    free(coefs);
+  }
+}
+
+// As fitNuGrid (EM, cold start) for a series held out of core (lmTScan)
+void fitNuGridScan(double * basisMat, int basisRows, int basisCols,
+    const scanSeries * series, double * priorVec,
+    int kSmooth, int maxIter, double tol,
+    nuFit * fits, int nNu)
+{
+  int g, k, smooth;
+  nuFitModel model;
+
+  for (smooth=0; smooth<2; smooth++)
+  {
+    k = smooth ? kSmooth : basisCols;
+    for (g=0; g<nNu; g++)
+    {
+      model = fitModelOf(&fits[g], smooth);
+      (*model.iter) = lmTScan(basisMat, basisRows, series, priorVec,
+          fits[g].nu, k, maxIter, tol,
+          model.logPosterior, model.logLikelihood,
+          model.coef, model.tau, 0);
+    }
+  }
+}
+
+/*
+ * Index of the df maximizing the profile log-likelihood of the full model
+ * The fitted log-likelihoods omit normalizing constants that depend on df,
+ * so these are added back (dt_logConst) before comparing.
+ */
+int selectNu(const nuFit * fits, int nNu, int n)
+{
+  int g, best = 0;
+  double profile, bestProfile = -INFINITY;
+
+  for (g=0; g<nNu; g++)
+  {
+    profile = fits[g].logLikelihood_m + dt_logConst(n, fits[g].nu);
+    if (profile > bestProfile)
+    {
+      bestProfile = profile;
+      best = g;
+    }
+  }
+
+  return best;
+}
@@ -0,0 +1,180 @@
+/*
+ * numa.c
+ *
+ *  NUMA topology and thread placement for threaded fits
+ *
+ *  Topology is read from /sys/devices/system/node, restricted to the CPUs
+ *  this process may run on, so no NUMA library is needed. Threads are placed
+ *  compactly: thread t runs on the node of the (t mod nCpus)-th usable CPU,
+ *  so a run with as many threads as one node has CPUs stays on one node.
+ *  Memory is placed by first touch: a pinned thread that allocates and fills
+ *  a buffer gets pages on its own node. On other systems (no sysfs or CPU
+ *  affinity calls) there is one node and threads are not pinned.
+ */
+
+#define _GNU_SOURCE
+#include "rowavedt.h"
+
+#ifdef __linux__
+#include <sched.h>
+
+static const char kNodeDir[] = "/sys/devices/system/node";
+
+// Parse a kernel CPU or node list ("0-3,8,10-11") into out (up to max)
+static int parseIdList(const char * list, int * out, int max)
+{
+  int n = 0, lo, hi, id;
+  const char * pos = list;
+  char * end;
+
+  while (*pos != '\0' && *pos != '\n')
+  {
+    lo = (int) strtol(pos, &end, 10);
+    if (end == pos)
+      break;
+    hi = lo;
+    if (*end == '-')
+    {
+      pos = end + 1;
+      hi = (int) strtol(pos, &end, 10);
+    }
+    for (id=lo; id<=hi && n<max; id++)
+      out[n++] = id;
+    pos = (*end == ',') ? end + 1 : end;
+  }
+
+  return n;
+}
+
+static int readIdList(const char * path, int * out, int max)
+{
+  char line[4096];
+  FILE * infile;
+  int n = 0;
+
+  infile = fopen(path, "r");
+  if (infile == NULL)
+    return 0;
+  if (fgets(line, sizeof(line), infile) != NULL)
+    n = parseIdList(line, out, max);
+  fclose(infile);
+
+  return n;
+}
+
+/*
+ * Read the nodes with usable CPUs. With one node, no topology information,
+ * or ROWAVEDT_NUMA=0 in the environment, topo->nNodes is 1 and threads are
+ * left unpinned.
+ */
+void readNumaTopology(numaTopology * topo)
+{
+  char path[PATH_MAX];
+  const char * env;
+  int nodes[CPU_SETSIZE], cpus[CPU_SETSIZE];
+  int nNodeIds, nNodeCpus, i, j;
+  cpu_set_t allowed;
+
+  topo->nNodes = 1;
+  topo->nCpus = 0;
+  topo->cpus = NULL;
+  topo->nodeOf = NULL;
+
+  env = getenv("ROWAVEDT_NUMA");
+  if ((env != NULL && atoi(env) == 0) ||
+      sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+
+  snprintf(path, sizeof(path), "%s/online", kNodeDir);
+  nNodeIds = readIdList(path, nodes, CPU_SETSIZE);
+  if (nNodeIds < 2)
+    return;
+
+  topo->cpus = malloc(CPU_SETSIZE * sizeof(int));
+  checkPtr(topo->cpus, "out of memory");
+  topo->nodeOf = malloc(CPU_SETSIZE * sizeof(int));
+  checkPtr(topo->nodeOf, "out of memory");
+
+  // Usable CPUs grouped by node; nodes without any (memory-only) are skipped
+  topo->nNodes = 0;
+  for (i=0; i<nNodeIds; i++)
+  {
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", kNodeDir, nodes[i]);
+    nNodeCpus = readIdList(path, cpus, CPU_SETSIZE);
+    int used = 0;
+    for (j=0; j<nNodeCpus; j++)
+    {
+      if (cpus[j] < CPU_SETSIZE && CPU_ISSET(cpus[j], &allowed))
+      {
+        topo->cpus[topo->nCpus] = cpus[j];
+        topo->nodeOf[topo->nCpus] = topo->nNodes;
+        topo->nCpus++;
+        used = 1;
+      }
+    }
+    topo->nNodes += used;
+  }
+
+  if (topo->nNodes < 2)
+  {
+    freeNumaTopology(topo);
+  }
+}
+#else
+void readNumaTopology(numaTopology * topo)
+{
+  topo->nNodes = 1;
+  topo->nCpus = 0;
+  topo->cpus = NULL;
+  topo->nodeOf = NULL;
+}
+#endif
+
+void freeNumaTopology(numaTopology * topo)
+{
+  free(topo->cpus);
+  free(topo->nodeOf);
+  topo->cpus = NULL;
+  topo->nodeOf = NULL;
+  topo->nCpus = 0;
+  topo->nNodes = 1;
+}
+
+// Node (index into the topology) for worker thread
+int numaThreadNode(const numaTopology * topo, int thread)
+{
+  if (topo->nNodes < 2)
+    return 0;
+
+  return topo->nodeOf[thread % topo->nCpus];
+}
+
+/*
+ * Restrict the calling thread to the CPUs of node
+ * Returns 0 on success; placement is only a hint, so callers may ignore
+ * failures
+ */
+#ifdef __linux__
+int numaPinThread(const numaTopology * topo, int node)
+{
+  cpu_set_t set;
+  int i;
+
+  if (topo->nNodes < 2)
+    return 0;
+
+  CPU_ZERO(&set);
+  for (i=0; i<topo->nCpus; i++)
+  {
+    if (topo->nodeOf[i] == node)
+      CPU_SET(topo->cpus[i], &set);
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#else
+int numaPinThread(const numaTopology * topo, int node)
+{
+  return 0;
+}
+#endif
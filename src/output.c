@@ -0,0 +1,60 @@
+/*
+ * output.c
+ *
+ *  Formatting of result records
+ */
+
+#include "rowavedt.h"
+
+// Write one space-delimited result record (see kHelpMessage for columns)
+void writeResult(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, double nu,
+    double llr, double lpr, double tau, double * coef)
+{
+  int i, bytes = 0;
+
+  TRACE_BEGIN(TRACE_OUTPUT);
+
+  // Basic information
+  bytes += fprintf(outfile, "%s %d %d %d %g ", idString, nObs, basisCols,
+      kSmooth, nu);
+
+  // Test statistics
+  bytes += fprintf(outfile, "%g %g ", llr, lpr);
+
+  // Other statistics
+  bytes += fprintf(outfile, "%g ", sqrt(tau));
+
+  // Coefficients for k = 1..m
+  for (i=0; i<basisCols; i++) bytes += fprintf(outfile, "%g ", coef[i]);
+  bytes += fprintf(outfile, "\n");
+
+  TRACE_END(TRACE_OUTPUT, bytes);
+}
+
+/*
+ * Write one record per df in fits, or with profileNu only the df selected
+ * by profile likelihood (selectNu)
+ */
+void writeNuFits(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, const nuFit * fits, int nNu, short profileNu)
+{
+  int g, gFirst = 0, gLast = nNu - 1;
+  double llr, lpr;
+
+  if (profileNu)
+  {
+    gFirst = gLast = selectNu(fits, nNu, nObs);
+  }
+
+  for (g=gFirst; g<=gLast; g++)
+  {
+    // Calculate test statistics (LLR & LPR)
+    llr = fits[g].logLikelihood_m - fits[g].logLikelihood_l;
+    llr *= 2;
+    lpr = fits[g].logPosterior_m - fits[g].logPosterior_l;
+
+    writeResult(outfile, idString, nObs, basisCols, kSmooth, fits[g].nu,
+        llr, lpr, fits[g].tau_m, fits[g].coef_m);
+  }
+}
@@ -0,0 +1,219 @@
+/*
+ * pipeline.c
+ *
+ *  Bounded queues between the threads of a staged pipeline, and accounting
+ *  of how each stage spends its time
+ *
+ *  A stage thread is either busy, starved (waiting for input in stagePop)
+ *  or blocked (waiting for room downstream in stagePush). Waits are timed
+ *  only when a thread actually has to sleep, so a pipeline that never
+ *  stalls pays one lock per item and nothing else. Items are whole series
+ *  or blocks of them, so a lock per item is negligible next to the work.
+ *  A queue made by initCostQueue hands out its costliest item first instead
+ *  of its oldest, so that long fits start early and do not finish last.
+ */
+
+#include "rowavedt.h"
+
+#include <time.h>
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+double monotonicSeconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void initStageQueue(stageQueue * queue, int capacity)
+{
+  queue->capacity = (capacity < 1) ? 1 : capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+  queue->slots = calloc(queue->capacity, sizeof(void *));
+  checkPtr(queue->slots, "out of memory");
+  queue->costs = NULL;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->notEmpty, NULL);
+  pthread_cond_init(&queue->notFull, NULL);
+}
+
+// As initStageQueue, for items taken costliest first (see stagePushCost)
+void initCostQueue(stageQueue * queue, int capacity)
+{
+  initStageQueue(queue, capacity);
+  queue->costs = calloc(queue->capacity, sizeof(double));
+  checkPtr(queue->costs, "out of memory");
+}
+
+void freeStageQueue(stageQueue * queue)
+{
+  free(queue->slots);
+  queue->slots = NULL;
+  free(queue->costs);
+  queue->costs = NULL;
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->notEmpty);
+  pthread_cond_destroy(&queue->notFull);
+}
+
+// Append item, waiting while the queue is full; adds the wait to (*blocked)
+void stagePush(stageQueue * queue, void * item, double * blocked)
+{
+  stagePushCost(queue, item, 0, blocked);
+}
+
+// As stagePush, with the cost by which a cost queue orders its items
+void stagePushCost(stageQueue * queue, void * item, double cost,
+    double * blocked)
+{
+  double start;
+  int slot;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == queue->capacity)
+  {
+    start = monotonicSeconds();
+    while (queue->count == queue->capacity)
+      pthread_cond_wait(&queue->notFull, &queue->lock);
+    (*blocked) += monotonicSeconds() - start;
+  }
+
+  slot = (queue->head + queue->count) % queue->capacity;
+  queue->slots[slot] = item;
+  if (queue->costs != NULL)
+    queue->costs[slot] = cost;
+  queue->count++;
+  pthread_cond_signal(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Remove the oldest item, or for a cost queue the first of the costliest
+static void * stageTake(stageQueue * queue)
+{
+  int i, slot, prev, best = 0, bestSlot = queue->head;
+  void * item;
+
+  if (queue->costs != NULL)
+  {
+    for (i=1; i<queue->count; i++)
+    {
+      slot = (queue->head + i) % queue->capacity;
+      if (queue->costs[slot] > queue->costs[bestSlot])
+      {
+        best = i;
+        bestSlot = slot;
+      }
+    }
+    // Shift the items ahead of it back one slot, keeping their order, and
+    // move it to the head
+    item = queue->slots[bestSlot];
+    for (i=best; i>0; i--)
+    {
+      slot = (queue->head + i) % queue->capacity;
+      prev = (queue->head + i - 1) % queue->capacity;
+      queue->slots[slot] = queue->slots[prev];
+      queue->costs[slot] = queue->costs[prev];
+    }
+    queue->slots[queue->head] = item;
+  }
+
+  item = queue->slots[queue->head];
+
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  pthread_cond_signal(&queue->notFull);
+
+  return item;
+}
+
+/*
+ * Remove the next item (see stageTake), waiting while the queue is empty;
+ * adds the wait to (*starved). Returns NULL once the queue is closed and
+ * drained.
+ */
+void * stagePop(stageQueue * queue, double * starved)
+{
+  void * item = NULL;
+  double start;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == 0 && !queue->closed)
+  {
+    start = monotonicSeconds();
+    while (queue->count == 0 && !queue->closed)
+      pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    (*starved) += monotonicSeconds() - start;
+  }
+
+  if (queue->count > 0)
+    item = stageTake(queue);
+  pthread_mutex_unlock(&queue->lock);
+
+  return item;
+}
+
+// As stagePop without waiting: NULL if the queue is empty
+void * stageTryPop(stageQueue * queue)
+{
+  void * item = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0)
+    item = stageTake(queue);
+  pthread_mutex_unlock(&queue->lock);
+
+  return item;
+}
+
+// No more items will be pushed; wakes consumers waiting on an empty queue
+void closeStageQueue(stageQueue * queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Add the times of one finished thread of a stage
+void addStageTimes(stageStats * stage, double lifetime, double starved,
+    double blocked)
+{
+  pthread_mutex_lock(&statsLock);
+  stage->busy += lifetime - starved - blocked;
+  stage->starved += starved;
+  stage->blocked += blocked;
+  pthread_mutex_unlock(&statsLock);
+}
+
+/*
+ * Print the share of the wall time each stage's threads spent busy, starved
+ * and blocked, and the busiest stage: a busy read stage with a starved fit
+ * stage means the run is I/O-bound, the reverse that it is compute-bound.
+ */
+void reportStages(FILE * outfile, const char * label,
+    const stageStats * stages, int nStages, double wall)
+{
+  int s, busiest = 0;
+  double total, busy, maxBusy = -1;
+
+  fprintf(outfile, "%s: %-8s %7s %6s %8s %8s\n", label, "stage", "threads",
+      "busy", "starved", "blocked");
+  for (s=0; s<nStages; s++)
+  {
+    total = wall * stages[s].nThreads;
+    total = (total > 0) ? total : 1;
+    busy = stages[s].busy / total;
+    fprintf(outfile, "%s: %-8s %7d %5.0f%% %7.0f%% %7.0f%%\n", label,
+        stages[s].name, stages[s].nThreads, 100 * busy,
+        100 * stages[s].starved / total, 100 * stages[s].blocked / total);
+    if (busy > maxBusy)
+    {
+      maxBusy = busy;
+      busiest = s;
+    }
+  }
+  fprintf(outfile, "%s: busiest stage %s\n", label, stages[busiest].name);
+}
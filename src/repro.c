@@ -0,0 +1,353 @@
+/*
+ * repro.c
+ *
+ *  Fixed-order BLAS and LAPACK kernels for reproducible results (-D)
+ *
+ *  Optimized BLAS libraries choose their kernels by CPU at run time and may
+ *  split larger operations across threads, so the order of the sums in the
+ *  Gram matrices, fitted values and scale, and with it the last bits of llr,
+ *  can change with the machine and the thread count. With reproKernels set,
+ *  the wrappers in interfaceBLAS-LAPACK.c call the kernels here instead.
+ *  Every reduction runs in one order fixed by this code: REPRO_LANES
+ *  interleaved partial sums, which the compiler may vectorize but not
+ *  reorder, combined pairwise at the end. The Makefile builds this file
+ *  with -ffp-contract=off, so no product and sum are fused into one
+ *  multiply-add on CPUs that have one.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "interfaceBLAS-LAPACK.h"
+
+#define REPRO_LANES 4
+
+// Route the double-precision BLAS and LAPACK wrappers to these kernels
+int reproKernels = 0;
+
+// Offset of the first element of a BLAS vector of n entries with stride inc
+static int reproStart(int n, int inc)
+{
+  return (inc < 0) ? (1 - n) * inc : 0;
+}
+
+// Sum over i < n of x[i * incx] * y[i * incy], in the fixed order
+static double reproDotStride(int n, const double * x, int incx,
+    const double * y, int incy)
+{
+  int i, s;
+  double acc[REPRO_LANES] = {0};
+
+  for (i=0; i + REPRO_LANES <= n; i+=REPRO_LANES)
+  {
+    for (s=0; s<REPRO_LANES; s++)
+      acc[s] += x[(i + s) * incx] * y[(i + s) * incy];
+  }
+  for (s=0; i<n; i++, s++)
+  {
+    acc[s] += x[i * incx] * y[i * incy];
+  }
+
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+double reproDasum(int N, const double * X, int INCX)
+{
+  int i, s;
+  double acc[REPRO_LANES] = {0};
+
+  if (N <= 0 || INCX <= 0)
+    return 0;
+
+  for (i=0; i + REPRO_LANES <= N; i+=REPRO_LANES)
+  {
+    for (s=0; s<REPRO_LANES; s++)
+      acc[s] += fabs(X[(i + s) * INCX]);
+  }
+  for (s=0; i<N; i++, s++)
+  {
+    acc[s] += fabs(X[i * INCX]);
+  }
+
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+double reproDdot(int N, const double * X, int INCX,
+    const double * Y, int INCY)
+{
+  if (N <= 0)
+    return 0;
+
+  return reproDotStride(N, X + reproStart(N, INCX), INCX,
+      Y + reproStart(N, INCY), INCY);
+}
+
+void reproDaxpy(int N, double ALPHA, const double * X, int INCX,
+    double * Y, int INCY)
+{
+  int i;
+
+  if (N <= 0 || ALPHA == 0)
+    return;
+
+  X += reproStart(N, INCX);
+  Y += reproStart(N, INCY);
+  for (i=0; i<N; i++)
+  {
+    Y[i * INCY] += ALPHA * X[i * INCX];
+  }
+}
+
+// y = beta * y, with y set to 0 (not read) if beta is 0, as in BLAS
+static void reproScaleY(int n, double beta, double * y, int incy)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+  {
+    y[i * incy] = (beta == 0) ? 0 : beta * y[i * incy];
+  }
+}
+
+// C = alpha * t + beta * C, with C not read if beta is 0, as in BLAS
+static void reproStoreC(double * c, double alpha, double t, double beta)
+{
+  (*c) = (beta == 0) ? alpha * t : alpha * t + beta * (*c);
+}
+
+void reproDgemv(char TRANS, int M, int N, double ALPHA, const double * A,
+    int LDA, const double * X, int INCX, double BETA, double * Y, int INCY)
+{
+  int i, j, lenX, lenY;
+  double t;
+
+  lenX = (TRANS == 'n' || TRANS == 'N') ? N : M;
+  lenY = (TRANS == 'n' || TRANS == 'N') ? M : N;
+  if (lenY <= 0)
+    return;
+
+  X += reproStart(lenX, INCX);
+  Y += reproStart(lenY, INCY);
+
+  if (TRANS == 'n' || TRANS == 'N')
+  {
+    // Columns are added in order, each across all rows at once
+    reproScaleY(M, BETA, Y, INCY);
+    for (j=0; j<N; j++)
+    {
+      t = ALPHA * X[j * INCX];
+      for (i=0; i<M; i++)
+      {
+        Y[i * INCY] += t * A[i + j * LDA];
+      }
+    }
+  }
+  else
+  {
+    for (j=0; j<N; j++)
+    {
+      reproStoreC(&Y[j * INCY], ALPHA,
+          reproDotStride(M, &A[j * LDA], 1, X, INCX), BETA);
+    }
+  }
+}
+
+void reproDgemm(char TRANSA, char TRANSB, int M, int N, int K, double ALPHA,
+    const double * A, int LDA, const double * B, int LDB, double BETA,
+    double * C, int LDC)
+{
+  int i, j, rowA, colA, rowB, colB;
+
+  // Strides of row i of op(A) and column j of op(B)
+  rowA = (TRANSA == 'n' || TRANSA == 'N') ? 1 : LDA;
+  colA = (TRANSA == 'n' || TRANSA == 'N') ? LDA : 1;
+  rowB = (TRANSB == 'n' || TRANSB == 'N') ? 1 : LDB;
+  colB = (TRANSB == 'n' || TRANSB == 'N') ? LDB : 1;
+
+  for (j=0; j<N; j++)
+  {
+    for (i=0; i<M; i++)
+    {
+      reproStoreC(&C[i + j * LDC], ALPHA,
+          reproDotStride(K, &A[i * rowA], colA, &B[j * colB], rowB), BETA);
+    }
+  }
+}
+
+void reproDsyrk(char UPLO, char TRANS, int N, int K, double ALPHA,
+    const double * A, int LDA, double BETA, double * C, int LDC)
+{
+  int i, j, lo, hi, step, stride;
+
+  // Vector i of A is column i (TRANS 't') or row i (TRANS 'n')
+  step = (TRANS == 'n' || TRANS == 'N') ? 1 : LDA;
+  stride = (TRANS == 'n' || TRANS == 'N') ? LDA : 1;
+
+  for (j=0; j<N; j++)
+  {
+    lo = (UPLO == 'u' || UPLO == 'U') ? 0 : j;
+    hi = (UPLO == 'u' || UPLO == 'U') ? j : N - 1;
+    for (i=lo; i<=hi; i++)
+    {
+      reproStoreC(&C[i + j * LDC], ALPHA,
+          reproDotStride(K, &A[i * step], stride, &A[j * step], stride),
+          BETA);
+    }
+  }
+}
+
+/*
+ * Cholesky factorization by columns (upper, A = U'U) or rows (lower,
+ * A = LL'), each entry from one fixed-order dot product of the entries
+ * already computed. Returns 0, or j + 1 if the leading minor of order
+ * j + 1 is not positive definite, as LAPACK's info
+ */
+int reproDpotrf(char UPLO, int N, double * A, int LDA)
+{
+  int i, j, upper = (UPLO == 'u' || UPLO == 'U');
+  double d;
+
+  for (j=0; j<N; j++)
+  {
+    d = A[j + j * LDA] - (upper ?
+        reproDotStride(j, &A[j * LDA], 1, &A[j * LDA], 1) :
+        reproDotStride(j, &A[j], LDA, &A[j], LDA));
+    if (!(d > 0))
+    {
+      A[j + j * LDA] = d;
+      return j + 1;
+    }
+    d = sqrt(d);
+    A[j + j * LDA] = d;
+
+    for (i=j+1; i<N; i++)
+    {
+      if (upper)
+      {
+        A[j + i * LDA] = (A[j + i * LDA] -
+            reproDotStride(j, &A[j * LDA], 1, &A[i * LDA], 1)) / d;
+      }
+      else
+      {
+        A[i + j * LDA] = (A[i + j * LDA] -
+            reproDotStride(j, &A[i], LDA, &A[j], LDA)) / d;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Solve with the factor from reproDpotrf: forward, then back substitution
+int reproDpotrs(char UPLO, int N, int NRHS, const double * A, int LDA,
+    double * B, int LDB)
+{
+  int i, r, upper = (UPLO == 'u' || UPLO == 'U');
+  double * b;
+
+  for (r=0; r<NRHS; r++)
+  {
+    b = &B[r * LDB];
+
+    // Solve U'z = b (L z = b)
+    for (i=0; i<N; i++)
+    {
+      b[i] = (b[i] - (upper ?
+            reproDotStride(i, &A[i * LDA], 1, b, 1) :
+            reproDotStride(i, &A[i], LDA, b, 1))) / A[i + i * LDA];
+    }
+
+    // Solve U x = z (L' x = z)
+    for (i=N-1; i>=0; i--)
+    {
+      b[i] = (b[i] - (upper ?
+            reproDotStride(N-1-i, &A[i + (i+1) * LDA], LDA, &b[i+1], 1) :
+            reproDotStride(N-1-i, &A[(i+1) + i * LDA], 1, &b[i+1], 1))) /
+        A[i + i * LDA];
+    }
+  }
+
+  return 0;
+}
+
+int reproDposv(char UPLO, int N, int NRHS, double * A, int LDA,
+    double * B, int LDB)
+{
+  int info;
+
+  info = reproDpotrf(UPLO, N, A, LDA);
+  if (info != 0)
+    return info;
+
+  return reproDpotrs(UPLO, N, NRHS, A, LDA, B, LDB);
+}
+
+/*
+ * LU factorization with partial pivoting (the first largest entry of each
+ * column) and solve, as LAPACK's dgesv: A holds L and U and IPIV the
+ * (1-based) pivot rows on return. Returns 0, or j + 1 if U(j, j) is 0
+ */
+int reproDgesv(int N, int NRHS, double * A, int LDA, int * IPIV,
+    double * B, int LDB)
+{
+  int i, j, k, p, r;
+  double t, * b;
+
+  for (k=0; k<N; k++)
+  {
+    p = k;
+    for (i=k+1; i<N; i++)
+    {
+      if (fabs(A[i + k * LDA]) > fabs(A[p + k * LDA]))
+        p = i;
+    }
+    IPIV[k] = p + 1;
+    if (A[p + k * LDA] == 0)
+      return k + 1;
+
+    if (p != k)
+    {
+      for (j=0; j<N; j++)
+      {
+        t = A[k + j * LDA];
+        A[k + j * LDA] = A[p + j * LDA];
+        A[p + j * LDA] = t;
+      }
+      for (r=0; r<NRHS; r++)
+      {
+        t = B[k + r * LDB];
+        B[k + r * LDB] = B[p + r * LDB];
+        B[p + r * LDB] = t;
+      }
+    }
+
+    for (i=k+1; i<N; i++)
+    {
+      A[i + k * LDA] /= A[k + k * LDA];
+    }
+    for (j=k+1; j<N; j++)
+    {
+      t = A[k + j * LDA];
+      for (i=k+1; i<N; i++)
+      {
+        A[i + j * LDA] -= A[i + k * LDA] * t;
+      }
+    }
+  }
+
+  for (r=0; r<NRHS; r++)
+  {
+    b = &B[r * LDB];
+    for (i=0; i<N; i++)
+    {
+      b[i] -= reproDotStride(i, &A[i], LDA, b, 1);
+    }
+    for (i=N-1; i>=0; i--)
+    {
+      b[i] = (b[i] - reproDotStride(N-1-i, &A[i + (i+1) * LDA], LDA,
+            &b[i+1], 1)) / A[i + i * LDA];
+    }
+  }
+
+  return 0;
+}
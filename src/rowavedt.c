@@ -4,21 +4,147 @@
 const char * kHelpMessage = "\nUsage:\trowavedt [options] "
   "BASISFILE BASISROWS BASISCOLS\n\tDATAFILE DATAROWS PRIORFILE\n\n"
   "Options:\n"
+  "-a\tSolver: e (PX-EM) or n (EM until the relative change in\n"
+  "\tlog-posterior is below 1e-5, then safeguarded Newton steps on\n"
+  "\tthe EM fixed-point equations). Both converge to the same\n"
+  "\testimates. Ignored with -f. Cannot be used with -b or -w.\n"
+  "\tDefaults to e.\n"
+  "-b\tCalibration mode: number of null replicates to simulate on the\n"
+  "\tcadence of DATAFILE. Writes a row of the null quantile table\n"
+  "\tdescribed below instead of the fit.\n"
+  "-B\tBatch mode: output directory. DATAFILE is then a manifest with\n"
+  "\tone series per line, a data file optionally followed by an ID\n"
+  "\t(defaulting to the file name), and DATAROWS the expected rows per\n"
+  "\tseries. Series are split into shards by a hash of their ID; each\n"
+  "\tshard is fit with periodic checkpoints to OUTDIR and resumed from\n"
+  "\tthem if a worker fails. Once all shards are done, their outputs are\n"
+  "\tmerged in ID order into OUTDIR/results.txt. Reading, fitting\n"
+  "\tand writing overlap (see -j, -q and -R). For short series (at\n"
+  "\tmost 64 observations), models of at most 15 columns, such as the\n"
+  "\tdefault smooth model, are fit in blocks of 8 series that share one\n"
+  "\tEM loop; larger ones, such as a full model of 128 columns, are\n"
+  "\tstill fit series by series. Cannot be used with -b, -i, -r or -w.\n"
+  "-C\tCache directory. Results are stored under a hash of the valid\n"
+  "\tobservations, the identity (device, inode, size, mtime) of\n"
+  "\tBASISFILE and PRIORFILE, and all options that affect the fit;\n"
+  "\ta rerun with the same inputs prints the stored lines under the\n"
+  "\tcurrent ID without reading the basis or fitting. Least recently\n"
+  "\tused entries are evicted beyond ROWAVEDT_CACHE_MB megabytes\n"
+  "\t(default 256). Cannot be used with -b, -r or -w.\n"
   "-c\tSet column number for values. Note: This is base 0.\n"
-  "\tDefaults to 1.\n"
-  "-d\tSet df for t distribution of residuals.\n"
+  "\tA comma-separated list (e.g. 1,2,3) fits each column as a band\n"
+  "\ton the shared time axis, reading the file once and sharing the\n"
+  "\tdesigns between bands with the same valid epochs, and writes\n"
+  "\tthe lines of each band under ID:COLUMN. Lists cannot be used\n"
+  "\twith -b, -B, -C, -r or -w. Defaults to 1.\n"
+  "-d\tSet df for t distribution of residuals. A comma-separated\n"
+  "\tlist (e.g. 2,3,5,10,inf; inf for normal residuals) fits both\n"
+  "\tmodels for each df in one run, sharing the designs, and writes\n"
+  "\tone line per df in increasing order. Each df is fit from the\n"
+  "\tsame start, so its line does not depend on the rest of the list.\n"
+  "\tLists cannot be used with -b, -r or -w.\n"
   "\tDefaults to 5.\n"
+  "-D\tReproducible mode: every double-precision BLAS and LAPACK call\n"
+  "\tgoes to fixed-order kernels (repro.c) instead of the library's,\n"
+  "\twhose choice of kernel by CPU and splitting across threads can\n"
+  "\tchange the last bits of results. Results are then bitwise\n"
+  "\tidentical for any thread count (-j, -R, BLAS threads) and CPU for\n"
+  "\ta given build, at the cost of slower fits (see make bench). They\n"
+  "\tdiffer from those of the default mode in the last bits. Cannot be\n"
+  "\tused with -f.\n"
+  "-e\tNull model for calibration mode: g (Gaussian noise), t (t noise\n"
+  "\twith -d df) or p (permuted residuals), added to the smooth fit.\n"
+  "\tDefaults to t.\n"
+  "-f\tMixed precision: run EM on a single-precision basis and design,\n"
+  "\tthen refine in double precision to the same convergence criterion.\n"
+  "\tCannot be used with -b or -w.\n"
   "-i\tOptional ID for results. Used as first entry of output.\n"
   "\tDefaults to DATAFILE.\n"
-  "-m\tNumeric code for missing values.\n"
-  "\tDefaults to 99.999\n"
+  "-j\tNumber of threads for calibration and batch modes. On NUMA\n"
+  "\tsystems threads are pinned to nodes, each with its own copy of\n"
+  "\tthe designs or basis (set ROWAVEDT_NUMA=0 to disable).\n"
+  "\tDefaults to 1.\n"
+  "-l\tInterpolate design rows linearly between the two basis rows on\n"
+  "\teither side of each rescaled time instead of taking the nearest\n"
+  "\trow. Removes the rounding of times to the grid, so a basis of\n"
+  "\t256-512 rows gives the LLRs of a much finer one. Cannot be used\n"
+  "\twith -w.\n"
+  "-L\tLong-series mode: the fit never holds the series in memory.\n"
+  "\tDATAFILE is memory-mapped, and the valid observations are kept\n"
+  "\tas 12-byte records in a mapped scratch file under $TMPDIR (or\n"
+  "\t/tmp) that each EM iteration scans once, so memory grows with\n"
+  "\tBASISROWS and BASISCOLS but not with the length of the series.\n"
+  "\tDATAROWS is ignored. Results match a normal run up to the\n"
+  "\tconvergence tolerance. Cannot be used with -a n, -b, -B, -C,\n"
+  "\t-f, -r, -w or several value columns.\n"
+  "-k\tShards for batch mode (-B): SHARD/NSHARDS fits shard SHARD\n"
+  "\t(base 0) of NSHARDS; NSHARDS alone fits every shard not done or\n"
+  "\theld by another worker. Workers started on several nodes with the\n"
+  "\tsame OUTDIR split the work between them. Defaults to 1.\n"
+  "-m\tNumeric code for missing values. With several columns (-c),\n"
+  "\ta list gives one code per column. Defaults to 99.999\n"
   "-n\tMinimum number of observations required; else exit\n"
   "\tDefaults to 10\n"
+  "-p\tWith a list of df (-d), write only the line for the df that\n"
+  "\tmaximizes the profile likelihood of the full model.\n"
+  "-q\tQueue depths for batch mode (-B): READ,FIT,WRITE, the series\n"
+  "\tread ahead of the parser, blocks waiting to be fit (the longest\n"
+  "\tare fit first) and results waiting to be written. One value sets\n"
+  "\tall three. Defaults to 32,8,64.\n"
+  "-R\tReader threads for batch mode (-B). Raise on network file\n"
+  "\tsystems if the read stage is the busiest. Defaults to 1.\n"
+  "-r\tState file for incremental refits. If it holds a compatible fit\n"
+  "\tof an earlier version of this series, EM is warm-started from it;\n"
+  "\tthe file is then rewritten with the new fit. A full rebuild is\n"
+  "\tdone if the file was written for another ID (see -i), model\n"
+  "\tsettings differ, the series shrank, or the time span changed\n"
+  "\tenough to shift earlier times by more than half of the finest\n"
+  "\tbasis scale (BASISROWS / BASISCOLS rows).\n"
+  "-S\tScreening mode: ALPHA. Fits stop as soon as the series clearly\n"
+  "\tcannot be flagged by screen_time_series.R at ALPHA with the\n"
+  "\tchi-square p-values, i.e. once an estimated upper bound on the\n"
+  "\tconverged LLR falls below the chi-square quantile at ALPHA with\n"
+  "\tBASISCOLS - smooth dimension df. The EM iterations of the two\n"
+  "\tmodels are interleaved to track the bound, which extrapolates the\n"
+  "\tlast steps of each log-likelihood with a safety factor. Records of\n"
+  "\tseries stopped early hold fits short of convergence, always with\n"
+  "\tLLR below the threshold: every record with LLR at or above the\n"
+  "\tchi-square quantile is fully converged, and only those should\n"
+  "\tfeed compute_features.R. Cannot be used with -a n, -b, -f, -L, -p,\n"
+  "\t-r, -v, -w or several value columns.\n"
   "-s\tSet dimension of smooth (low-resolution) partial basis.\n"
   "\tMust be power of 2\n"
   "\tDefaults to 8.\n"
   "-t\tSet column number for times. Note: This is base 0.\n"
-  "\tDefaults to 0.\n\n"
+  "\tDefaults to 0.\n"
+  "-w\tStreaming mode: width of sliding time window. Observations are\n"
+  "\tread from DATAFILE (- for stdin) in time order, and the window,\n"
+  "\tmapped onto the BASISROWS grid, is refit as each one arrives.\n"
+  "\tOne record is written per observation once the window holds the\n"
+  "\tminimum number of observations, with ID@TIME as its ID and the\n"
+  "\tnumber of observations in the window as its second entry.\n"
+  "-v\tVerification: FRACTION[,RELTOL[,ABSTOL[,LLRTOL]]]. Refits a\n"
+  "\tfraction of series, sampled by a hash of their ID and the seed\n"
+  "\t(-x), with the reference algorithm (a cold start for each model\n"
+  "\tand df and a full double-precision solve at every EM iteration)\n"
+  "\tand compares llr, lpr, tau and the coefficients with the fit\n"
+  "\twritten. Differences in llr and lpr beyond LLRTOL (in LLR units)\n"
+  "\t+ RELTOL * their size, and in tau and the coefficients beyond\n"
+  "\tABSTOL + RELTOL * their size (the largest coefficient), are\n"
+  "\treported per series on stderr, with a summary of the largest\n"
+  "\tdifferences, and the exit status is then 2. RELTOL defaults to\n"
+  "\t1e-3, ABSTOL to 1e-6 and LLRTOL to 0.05. Cannot be used with -b,\n"
+  "\t-L or -w.\n"
+  "-x\tRandom seed for calibration mode and verification sampling (-v).\n"
+  "\tDefaults to 1.\n\n"
+  "Several bases: BASISFILE may be a comma-separated list of bases (e.g.\n"
+  "of several filter families), with BASISROWS, BASISCOLS and PRIORFILE\n"
+  "each one value for all or a list with one per basis. Each series is\n"
+  "then read and normalized once and fit against every basis in turn,\n"
+  "and the records of basis N (base 0) carry the ID followed by :bN.\n"
+  "Works with and without -B; cannot be used with -b, -C, -L, -r, -w or\n"
+  "several value columns.\n"
+  "\n"
   "Outputs a single space-delimited line to stdout consisting of\n"
   "8 + BASISCOLS entries:\n"
   " 1  - ID (defaults to DATAFILE)\n"
@@ -33,6 +159,12 @@ const char * kHelpMessage = "\nUsage:\trowavedt [options] "
   " 8  - Estimated scale for residual variance of full model\n"
   " 9: - Maximum a posteriori estimates of coefficients for full model\n"
   "       (BASISCOLS coefficients in total).\n"
+  "\n"
+  "In calibration mode, outputs a single space-delimited line consisting of\n"
+  "entries 1-5 above, the number of replicates, and the null quantiles of\n"
+  "entry 6 at upper-tail probabilities 0.5, 0.2, 0.1, 0.05, 0.02, 0.01,\n"
+  "0.005, 0.002, 0.001, 0.0005, 0.0002 and 0.0001 (NA where there are too\n"
+  "few replicates). scripts/screen_time_series.R reads this via --null.\n"
   "\n";
 
 int main(int argc, char * argv[]) {
@@ -43,40 +175,152 @@ int main(int argc, char * argv[]) {
   int c, timeCol=0, valueCol=1;
   extern char *optarg;
   char * dataFile, * basisFile, * priorFile, * idString=NULL;
+  char * stateFile=NULL;
+  char * cacheDir=NULL;
+  char * batchDir=NULL;
+  char * verifySpec=NULL;
+  double screenAlpha = 0;
+  int shard = -1, nShards = 1;
   short readID = 0;
+  short mixedPrecision = 0;
+  short longSeries = 0;
+  char solver = 'e';
   int kSmooth = 8;
   int maxIter = 1e3;
   double nu=5;
+  double * nuVec = NULL;
+  int nNu = 0;
+  short profileNu = 0;
   double tol=1e-9;
   double missingCode = 99.999;
+  int * valueCols = NULL, nBands = 1;
+  double * missingCodes = NULL;
+  int nMissing = 1;
+  double windowWidth = 0;
+  int nRep = 0, nThreads = 1, nReaders = 1;
+  int queueDepth[3] = {0, 0, 0};
+  char nullModel = 't';
+  unsigned long seed = 1;
   int minObs = 10;
   int basisRows, basisCols, dataRows;
   int i;
 
   // Parse options
-  while ( (c=getopt(argc, argv, "c:d:i:m:n:s:t:h")) != -1 ) {
+  while ( (c=getopt(argc, argv,
+          "a:B:b:C:c:Dd:e:fi:j:k:lLm:n:pq:R:r:S:s:t:v:w:x:h")) != -1 ) {
     switch(c) {
       case 'h':
         puts(kHelpMessage);
         return 0;
+      case 'a':
+        solver = optarg[0];
+        if (solver != 'e' && solver != 'n')
+        {
+          fprintf(stderr, "Unknown solver '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'B':
+        batchDir = optarg;
+        break;
+      case 'b':
+        nRep = atoi(optarg);
+        break;
+      case 'C':
+        cacheDir = optarg;
+        break;
       case 'c':
-        valueCol = atoi(optarg);
-        valueCol = (valueCol < 0) ? 0 : valueCol;
+        free(valueCols);
+        nBands = parseIntList(optarg, &valueCols);
+        for (i=0; i<nBands; i++)
+        {
+          valueCols[i] = (valueCols[i] < 0) ? 0 : valueCols[i];
+        }
+        valueCol = valueCols[0];
         break;
       case 'd':
-        nu = atof(optarg);
-        nu = (nu < 1) ? 1 : nu;
+        free(nuVec);
+        nNu = parseNuList(optarg, &nuVec);
+        break;
+      case 'D':
+        reproKernels = 1;
+        break;
+      case 'e':
+        nullModel = optarg[0];
+        if (nullModel != 'g' && nullModel != 't' && nullModel != 'p')
+        {
+          fprintf(stderr, "Unknown null model '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'f':
+        mixedPrecision = 1;
         break;
       case 'i':
         idString = optarg;
         readID = 1;
         break;
+      case 'j':
+        nThreads = atoi(optarg);
+        nThreads = (nThreads < 1) ? 1 : nThreads;
+        break;
+      case 'k':
+        if (sscanf(optarg, "%d/%d", &shard, &nShards) != 2)
+        {
+          shard = -1;
+          nShards = atoi(optarg);
+        }
+        if (nShards < 1 || shard >= nShards)
+        {
+          fprintf(stderr, "Error -- invalid shard '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'l':
+        basisInterp = 1;
+        break;
+      case 'L':
+        longSeries = 1;
+        break;
       case 'm':
-        missingCode = atof(optarg);
+        free(missingCodes);
+        nMissing = parseDoubleList(optarg, &missingCodes);
+        missingCode = missingCodes[0];
         break;
       case 'n':
         minObs = atoi(optarg);
         break;
+      case 'p':
+        profileNu = 1;
+        break;
+      case 'q':
+        i = sscanf(optarg, "%d,%d,%d", &queueDepth[0], &queueDepth[1],
+            &queueDepth[2]);
+        if (i == 1)
+        {
+          queueDepth[1] = queueDepth[2] = queueDepth[0];
+        }
+        else if (i != 3)
+        {
+          fprintf(stderr, "Error -- invalid queue depths '%s'\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'R':
+        nReaders = atoi(optarg);
+        nReaders = (nReaders < 1) ? 1 : nReaders;
+        break;
+      case 'r':
+        stateFile = optarg;
+        break;
+      case 'S':
+        screenAlpha = atof(optarg);
+        if (screenAlpha <= 0 || screenAlpha >= 1)
+        {
+          fprintf(stderr, "Error -- invalid screening alpha '%s'\n", optarg);
+          exit(1);
+        }
+        break;
       case 's':
         kSmooth = atoi(optarg);
         kSmooth = (trunc(log2(kSmooth))-log2(kSmooth) > 1e-16) ?
@@ -86,6 +330,15 @@ int main(int argc, char * argv[]) {
         timeCol = atoi(optarg);
         timeCol = (timeCol < 0) ? 1 : timeCol;
         break;
+      case 'v':
+        verifySpec = optarg;
+        break;
+      case 'w':
+        windowWidth = atof(optarg);
+        break;
+      case 'x':
+        seed = strtoul(optarg, NULL, 10);
+        break;
       case '?':
         if ( isprint(optopt) )
           fprintf(stderr, "Unknown argument '%c'\n", optopt);
@@ -98,6 +351,82 @@ int main(int argc, char * argv[]) {
     }
   }
 
+  // Single df unless a list was given
+  if (nNu == 0)
+  {
+    nNu = parseNuList("5", &nuVec);
+  }
+  if (nNu > 1 && (nRep > 0 || stateFile != NULL || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- a list of df cannot be used with -b, -r or -w\n");
+    exit(1);
+  }
+  if (cacheDir != NULL && (nRep > 0 || stateFile != NULL || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- -C cannot be used with -b, -r or -w\n");
+    exit(1);
+  }
+  if (batchDir != NULL &&
+      (nRep > 0 || readID || stateFile != NULL || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- -B cannot be used with -b, -i, -r or -w\n");
+    exit(1);
+  }
+  if (nMissing > 1 && nMissing != nBands)
+  {
+    fprintf(stderr, "Error -- give one missing code, or one per column\n");
+    exit(1);
+  }
+  if (nBands > 1 && (nRep > 0 || batchDir != NULL || cacheDir != NULL ||
+        stateFile != NULL || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- several value columns cannot be used with "
+        "-b, -B, -C, -r or -w\n");
+    exit(1);
+  }
+  if (longSeries && (solver == 'n' || nRep > 0 || batchDir != NULL ||
+        cacheDir != NULL || mixedPrecision || stateFile != NULL ||
+        windowWidth > 0 || nBands > 1))
+  {
+    fprintf(stderr, "Error -- -L cannot be used with -a n, -b, -B, -C, -f, "
+        "-r, -w or several value columns\n");
+    exit(1);
+  }
+  if (basisInterp && windowWidth > 0)
+  {
+    fprintf(stderr, "Error -- -l cannot be used with -w\n");
+    exit(1);
+  }
+  if (verifySpec != NULL && (nRep > 0 || longSeries || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- -v cannot be used with -b, -L or -w\n");
+    exit(1);
+  }
+  if (solver == 'n' && (nRep > 0 || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- -a n cannot be used with -b or -w\n");
+    exit(1);
+  }
+  if (mixedPrecision && (nRep > 0 || windowWidth > 0))
+  {
+    fprintf(stderr, "Error -- -f cannot be used with -b or -w\n");
+    exit(1);
+  }
+  if (reproKernels && mixedPrecision)
+  {
+    fprintf(stderr, "Error -- -D cannot be used with -f\n");
+    exit(1);
+  }
+  if (screenAlpha > 0 && (solver == 'n' || nRep > 0 || mixedPrecision ||
+        longSeries || profileNu || stateFile != NULL || verifySpec != NULL ||
+        windowWidth > 0 || nBands > 1))
+  {
+    fprintf(stderr, "Error -- -S cannot be used with -a n, -b, -f, -L, -p, "
+        "-r, -v, -w or several value columns\n");
+    exit(1);
+  }
+  nu = nuVec[0];
+
   // Parse positional arguments
   if (argc-optind < nArgs) {
     fprintf(stderr, "Not enough arguments\n");
@@ -119,12 +448,182 @@ int main(int argc, char * argv[]) {
     idString = dataFile;
   }
 
-  // Read basis to allocated matrix
-  double* basisMat;
-  basisMat = malloc(basisCols * basisRows * sizeof(double));
-  checkPtr(basisMat, "out of memory");
+  double * basisMat = NULL, * priorVec = NULL;
+  float * basisMatF = NULL;
+
+  fitConfig cfg;
+  cfg.basisRows = basisRows;
+  cfg.basisCols = basisCols;
+  cfg.kSmooth = kSmooth;
+  cfg.timeCol = timeCol;
+  cfg.valueCol = valueCol;
+  cfg.minObs = minObs;
+  cfg.maxIter = maxIter;
+  cfg.tol = tol;
+  cfg.missingCode = missingCode;
+  cfg.nuVec = nuVec;
+  cfg.nNu = nNu;
+  cfg.profileNu = profileNu;
+  cfg.mixedPrecision = mixedPrecision;
+  cfg.solver = solver;
+  cfg.nThreads = nThreads;
+  cfg.nReaders = nReaders;
+  memcpy(cfg.queueDepth, queueDepth, sizeof(queueDepth));
+  cfg.cacheDir = cacheDir;
+  cfg.screenAlpha = screenAlpha;
+  cfg.cacheSeed = fitCacheSeed(&cfg, basisFile, priorFile);
+  cfg.basisTag = NULL;
+
+  verifyState verify;
+  cfg.verify = NULL;
+  if (verifySpec != NULL)
+  {
+    initVerify(&verify, verifySpec, seed);
+    cfg.verify = &verify;
+  }
+
+  // Several bases: each series is read once and fit against every basis
+  if (strchr(basisFile, ',') != NULL)
+  {
+    if (nRep > 0 || cacheDir != NULL || longSeries || stateFile != NULL ||
+        windowWidth > 0 || nBands > 1)
+    {
+      fprintf(stderr, "Error -- several bases cannot be used with -b, -C, "
+          "-L, -r, -w or several value columns\n");
+      exit(1);
+    }
+
+    fitConfig * bases;
+    int nBases = setupBases(&cfg, basisFile, argv[optind+1], argv[optind+2],
+        priorFile, &bases);
 
-  readToDoubleMatrix(basisFile, basisRows, basisCols, basisMat);
+    int status = (batchDir != NULL) ?
+      runBatch(bases, nBases, dataFile, dataRows, batchDir, shard, nShards) :
+      runBases(bases, nBases, dataFile, dataRows, idString);
+
+    if (cfg.verify != NULL)
+    {
+      reportVerify(stderr, &verify);
+      status = (verify.nFailed > 0) ? 2 : status;
+      freeVerify(&verify);
+    }
+
+    freeBases(bases, nBases);
+    free(nuVec);
+    return status;
+  }
+
+  // Several bands: one fit per value column on a shared time axis
+  if (nBands > 1)
+  {
+    double bandMissing[nBands];
+    for (i=0; i<nBands; i++)
+    {
+      bandMissing[i] = (nMissing > 1) ? missingCodes[i] : missingCode;
+    }
+
+    readModelInputs(basisFile, basisRows, basisCols, priorFile,
+        mixedPrecision, &cfg.basisMat, &cfg.basisMatF, &cfg.priorVec);
+
+    int status = runBands(&cfg, dataFile, dataRows, idString,
+        valueCols, bandMissing, nBands);
+
+    if (cfg.verify != NULL)
+    {
+      reportVerify(stderr, &verify);
+      status = (verify.nFailed > 0) ? 2 : status;
+      freeVerify(&verify);
+    }
+
+    free(cfg.basisMat);
+    free(cfg.basisMatF);
+    free(cfg.priorVec);
+    free(valueCols);
+    free(missingCodes);
+    free(nuVec);
+    return status;
+  }
+
+  // Batch mode: DATAFILE is a manifest of series
+  if (batchDir != NULL)
+  {
+    readModelInputs(basisFile, basisRows, basisCols, priorFile,
+        mixedPrecision, &cfg.basisMat, &cfg.basisMatF, &cfg.priorVec);
+
+    int status = runBatch(&cfg, 1, dataFile, dataRows, batchDir,
+        shard, nShards);
+
+    if (cfg.verify != NULL)
+    {
+      reportVerify(stderr, &verify);
+      status = (verify.nFailed > 0) ? 2 : status;
+      freeVerify(&verify);
+    }
+
+    free(cfg.basisMat);
+    free(cfg.basisMatF);
+    free(cfg.priorVec);
+    free(nuVec);
+    return status;
+  }
+
+  // Long-series mode: EM passes over a mapped copy of the valid data
+  if (longSeries)
+  {
+    scanSeries series;
+    int nObs = openScanSeries(dataFile, timeCol, valueCol, missingCode,
+        basisRows, &series);
+
+    if (nObs < minObs)
+    {
+      fprintf(stderr, "Error -- read %d obs, minimum to process is %d\n",
+          nObs, minObs);
+      exit(1);
+    }
+
+    readModelInputs(basisFile, basisRows, basisCols, priorFile, 0,
+        &basisMat, &basisMatF, &priorVec);
+
+    nuFit * fits;
+    fits = allocNuFits(nuVec, nNu, basisCols, kSmooth);
+
+    fitNuGridScan(basisMat, basisRows, basisCols, &series, priorVec,
+        kSmooth, maxIter, tol, fits, nNu);
+
+    writeNuFits(stdout, idString, nObs, basisCols, kSmooth, fits, nNu,
+        profileNu);
+
+    closeScanSeries(&series);
+    freeNuFits(fits, nNu);
+    free(basisMat);
+    free(priorVec);
+    free(nuVec);
+    return 0;
+  }
+
+  // Streaming mode: sliding-window detection over DATAFILE in time order
+  if (windowWidth > 0)
+  {
+    FILE * infile = stdin;
+    if (strcmp(dataFile, "-") != 0)
+    {
+      infile = fopen(dataFile, "r");
+      checkPtr(infile, dataFile);
+    }
+
+    readModelInputs(basisFile, basisRows, basisCols, priorFile, 0,
+        &basisMat, &basisMatF, &priorVec);
+
+    streamDetect(infile, idString, basisMat, basisRows, basisCols,
+        priorVec, timeCol, valueCol, missingCode,
+        windowWidth, dataRows, minObs,
+        nu, kSmooth, maxIter, tol);
+
+    if (infile != stdin) fclose(infile);
+    free(basisMat);
+    free(priorVec);
+    return 0;
+  }
 
   // Read times to vector
   double* timeVec;
@@ -170,16 +669,6 @@ int main(int argc, char * argv[]) {
     exit(1);
   }
 
-  // Read prior to vector
-  double * priorVec;
-  priorVec = malloc( (basisCols-1) * sizeof(double));
-  if (priorVec==NULL)
-  {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
-  }
-  readToDoubleVector(priorFile, basisCols-1, 0, priorVec);
-
   /*
    * Handle coded missing values and restructure times
    */
@@ -212,74 +701,146 @@ int main(int argc, char * argv[]) {
     timeVec[i] = timeVec[validInd[i]];
   }
 
+  // Report cached result for unchanged inputs
+  uint64_t cacheKey = 0;
+  if (cacheDir != NULL)
+  {
+    cacheKey = seriesCacheKey(cfg.cacheSeed, timeVec, yVec, nObs);
+
+    if (cacheLookup(cacheDir, cacheKey, idString, stdout))
+    {
+      free(timeVec);
+      free(yVec);
+      free(validInd);
+      free(nuVec);
+      return 0;
+    }
+  }
+
+  readModelInputs(basisFile, basisRows, basisCols, priorFile,
+      mixedPrecision, &basisMat, &basisMatF, &priorVec);
 
-  // Setup variables for estimation
-  double logPosterior_l, logLikelihood_l, tau_l;
-  double logPosterior_m, logLikelihood_m, tau_m;
-  double * coef_l, * coef_m;
+  // Rescale times to basis grid
+  double minTime, maxTime;
+  arrayMinMax(timeVec, nObs, &minTime, &maxTime);
+  rescaleTimes(timeVec, nObs, minTime, maxTime, basisRows);
 
-  coef_l = malloc(kSmooth * sizeof(double));
-  if (coef_l==NULL)
+  // Calibration mode: null quantile table for this cadence
+  if (nRep > 0)
   {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
+    double * llrNull;
+    llrNull = malloc(nRep * sizeof(double));
+    checkPtr(llrNull, "out of memory");
+
+    calibrateNull(basisMat, basisRows, basisCols,
+        yVec, nObs, timeVec, priorVec,
+        nu, kSmooth, maxIter, tol,
+        nullModel, nRep, nThreads, seed, llrNull);
+
+    writeNullQuantiles(stdout, idString, nObs, basisCols, kSmooth, nu,
+        llrNull, nRep);
+
+    free(llrNull);
+    free(basisMat);
+    free(timeVec);
+    free(yVec);
+    free(priorVec);
+    return 0;
   }
 
-  coef_m = malloc(basisCols * sizeof(double));
-  if (coef_m==NULL)
+  // Setup fits for each df
+  nuFit * fits;
+  fits = allocNuFits(nuVec, nNu, basisCols, kSmooth);
+
+  // Warm-start from stored state if compatible with this series
+  seriesState state;
+  int warmStart = 0;
+  uint64_t idHash = fnv1a(idString, strlen(idString), kFnvOffset);
+
+  if (stateFile != NULL && readSeriesState(stateFile, &state) == 0)
   {
-    fprintf(stderr, "Error -- out of memory\n");
-    exit(1);
+    warmStart = checkSeriesState(&state, idHash, basisRows, basisCols,
+        kSmooth, nu, nObs, minTime, maxTime);
+    if (warmStart)
+    {
+      dcopy(basisCols, state.coef_m, 1, fits[0].coef_m, 1);
+      dcopy(kSmooth, state.coef_l, 1, fits[0].coef_l, 1);
+      fits[0].tau_m = state.tau_m;
+      fits[0].tau_l = state.tau_l;
+    }
+    freeSeriesState(&state);
+  }
+
+  // Run wavelet model with t residuals for full and restricted (smooth) bases
+  if (screenAlpha > 0)
+  {
+    fitNuGridScreen(basisMat, basisRows, basisCols,
+        yVec, nObs, timeVec, priorVec,
+        kSmooth, maxIter, tol,
+        screenThreshold(screenAlpha, basisCols, kSmooth),
+        fits, nNu);
+  }
+  else
+  {
+    fitNuGrid(basisMat, basisMatF, basisRows, basisCols,
+        yVec, nObs, timeVec, priorVec,
+        kSmooth, maxIter, tol, solver,
+        fits, nNu, warmStart);
+  }
+
+  // Check sampled series against the reference fit
+  int status = 0;
+  if (cfg.verify != NULL)
+  {
+    cfg.basisMat = basisMat;
+    cfg.priorVec = priorVec;
+    status = verifySeries(&cfg, idString, yVec, nObs, timeVec, fits) ? 2 : 0;
+    reportVerify(stderr, &verify);
+    freeVerify(&verify);
   }
 
-  // Run wavelet model with t residuals for full basis
-  int iter_m;
-  iter_m = lmT(basisMat, basisRows, basisCols,
-      yVec, nObs,
-      timeVec,
-      priorVec,
-      nu, basisCols,
-      maxIter, tol,
-      &logPosterior_m,
-      &logLikelihood_m,
-      coef_m,
-      &tau_m);
-
-  // Run wavelet model with t residuals for restricted (smooth) basis
-  int iter_l;
-  iter_l = lmT(basisMat, basisRows, basisCols,
-      yVec, nObs,
-      timeVec,
-      priorVec,
-      nu, kSmooth,
-      maxIter, tol,
-      &logPosterior_l,
-      &logLikelihood_l,
-      coef_l,
-      &tau_l);
-
-  // Calculate test statistics (LLR & LPR)
-  double llr, lpr;
-  llr = logLikelihood_m - logLikelihood_l;
-  llr *= 2;
-  lpr = logPosterior_m - logPosterior_l;
+  // Save fit for next incremental run
+  if (stateFile != NULL)
+  {
+    state.idHash = idHash;
+    state.basisRows = basisRows;
+    state.basisCols = basisCols;
+    state.kSmooth = kSmooth;
+    state.nObs = nObs;
+    state.nu = nu;
+    state.minTime = minTime;
+    state.maxTime = maxTime;
+    state.tau_m = fits[0].tau_m;
+    state.tau_l = fits[0].tau_l;
+    state.coef_m = fits[0].coef_m;
+    state.coef_l = fits[0].coef_l;
+    writeSeriesState(stateFile, &state);
+  }
 
   /*
    * Print output
    */
 
-  // Basic information
-  fprintf(stdout, "%s %d %d %d %g ", idString, nObs, basisCols, kSmooth, nu);
-
-  // Test statistics
-  fprintf(stdout, "%g %g ", llr, lpr);
+  // With a cache, collect the lines to store them as well
+  FILE * outfile = stdout;
+  char * outBuffer = NULL;
+  size_t outSize = 0;
+  if (cacheDir != NULL)
+  {
+    outfile = open_memstream(&outBuffer, &outSize);
+    checkPtr(outfile, "out of memory");
+  }
 
-  // Other statistics
-  fprintf(stdout, "%g ", sqrt(tau_m));
+  writeNuFits(outfile, idString, nObs, basisCols, kSmooth, fits, nNu,
+      profileNu);
 
-  // Coefficients for k = 1..m
-  for (i=0; i<basisCols; i++) fprintf(stdout, "%g ", coef_m[i]);
-  fprintf(stdout, "\n");
+  if (cacheDir != NULL)
+  {
+    fclose(outfile);
+    fputs(outBuffer, stdout);
+    cacheStore(cacheDir, cacheKey, outBuffer);
+    free(outBuffer);
+  }
 
   /*
    * Free allocated memory
@@ -289,6 +850,9 @@ int main(int argc, char * argv[]) {
   free(basisMat);
   basisMat = NULL;
 
+  free(basisMatF);
+  basisMatF = NULL;
+
   // Free timeVec & yVec
   free(timeVec);
   timeVec=NULL;
@@ -296,15 +860,15 @@ int main(int argc, char * argv[]) {
   free(yVec);
   yVec=NULL;
 
-  // Free coef vecs and prior vec
-  free(coef_l);
-  coef_l=NULL;
+  // Free fits and prior vec
+  freeNuFits(fits, nNu);
+  fits=NULL;
 
-  free(coef_m);
-  coef_m=NULL;
+  free(nuVec);
+  nuVec=NULL;
 
   free(priorVec);
   priorVec=NULL;
 
-  return 0;
+  return status;
 }
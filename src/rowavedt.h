@@ -20,18 +20,27 @@
 #include <float.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 // GSL
 #include <gsl_cdf.h>
 #include <gsl_math.h>
 #include <gsl_statistics_double.h>
+#include <gsl_rng.h>
+#include <gsl_randist.h>
 
 // BLAS-LAPACK interface (direct to Fortran)
 #include "interfaceBLAS-LAPACK.h"
 
+// Optional hot-path tracing
+#include "trace.h"
+
 // utils.c
+extern void (*fatalHandler)(const char * msg);
 void checkPtr(const void * ptr, const char * msg);
 int arrayMinMax(double * X, int n, double * min, double * max);
+void rescaleTimes(double * timeVec, int n, double minTime, double maxTime,
+    int basisRows);
 int allocateMatrix(double*** matrix, int nRows, int nCols);
 void freeMatrix(double*** matrix, int nRows, int nCols);
 double arraymean(double x[], int start, int stop);
@@ -44,6 +53,8 @@ void readToDoubleMatrix (const char * fname, int nRows, int nCols, double *X);
 int readToDoubleVector (const char * fname, int nRows, int col, double* X);
 int readToDoubleVectorDynamic(const char * fname, int startRows, int col,
     double** X);
+int readToDoubleColumnsDynamic(const char * fname, int startRows,
+    const int * cols, int nCols, double ** X);
 
 // wls.c
 int wls(double* X, int n, int k,
@@ -54,6 +65,24 @@ int calcFitted(double* X, int n, int k,
     double* y,
     double* coef,
     double* fitted);
+
+// Cholesky factor and CG workspace carried across wlsUpdate calls
+typedef struct {
+  int n, k, factored;
+  double * chol, * wFactor;
+  double * tmp, * r, * z, * p, * Ap;
+  int nRebuild, nCg, nCgIter;
+} wlsCache;
+
+extern const double kWlsMaxCond;
+extern const double kWlsCgTol;
+void initWlsCache(wlsCache * cache, int n, int k);
+void freeWlsCache(wlsCache * cache);
+void seedWlsCache(wlsCache * cache, const double * chol, const double * w);
+int wlsUpdate(double* X, int n, int k,
+    double* y, double* w,
+    double* XTX, double *sqw, double* sqwX, double* sqwy,
+    double* coef, wlsCache * cache);
 int calcResid(double* X, int n, int k,
     double* y,
     double* coef,
@@ -62,6 +91,8 @@ int calcResid(double* X, int n, int k,
 // dist.c
 double dnorm_log(double * x, int n, double location, double scale);
 double dt_log(double * x, int n, double df, double location, double scale);
+double dt_logConst(int n, double df);
+double tWeight(double resid, double tau, double df);
 
 // lmT.c
 int lmT(double * basisMat, int basisRows, int basisCols,
@@ -73,6 +104,379 @@ int lmT(double * basisMat, int basisRows, int basisCols,
     double * logPosterior,
     double * logLikelihood,
     double * coef,
-    double * tau);
+    double * tau,
+    int warmStart);
+// EM state of one model on a shared design (see emInit)
+typedef struct {
+  double * dMat, * priorVec, * coef;
+  int n, k, m;
+  double nu, tau, logPosterior, logLikelihood;
+  double * dVec, * sqwX, * XTX, * w, * sqw, * sqwy, * resid;
+  wlsCache cache;
+} emModel;
+
+void emInit(emModel * em, double * dMat, int n, int k,
+    double * yVec, double * priorVec, double nu,
+    double * coef, double tau, int warmStart, const double * unitChol);
+double emStep(emModel * em);
+void emFree(emModel * em);
+extern int basisInterp;
+extern const double kInterpSnap;
+void basisPosition(double t, int basisRows, int * row, double * frac);
+double * buildDesign(double * basisMat, int basisRows,
+    double * timeVec, int n, int k);
+int lmTDesign(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+int lmTDesignSeeded(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    const double * unitChol);
+
+// init.c
+extern const double kRegularMaxMove;
+extern const double kProjectMaxResid;
+int regularSampling(double * timeVec, int n, int basisRows, int k);
+int projectInit(double * dMat, int n, int k, int basisRows,
+    double * yVec, double * priorVec, double * coef);
+
+// lmTGrouped.c
+int lmTGrouped(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int * rowVec, int n,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+void groupStats(int * groupVec, int n, int G,
+    double * y, double * w,
+    double * wg, double * ybar);
+void groupResid(double * dMat, int m, int k, int G,
+    int * groupVec, int n,
+    double * y, double * coef,
+    double * fitted, double * resid);
+
+// lmTScan.c
+// Valid observations of a series out of core (see openScanSeries): the
+// group (index among occupied basis rows, or with basisInterp the intervals
+// starting at them) and value of each, and with basisInterp the fraction
+// across the interval, mapped from a scratch file; with the basis row and
+// first value (shift) of each group
+typedef struct {
+  int n, G;
+  int * rowOfGroup;
+  double * shift;
+  double * yVec;
+  double * fracVec;
+  int * groupVec;
+  void * map;
+  size_t mapSize;
+  double minTime, maxTime;
+} scanSeries;
+
+extern const char * kScanScratchDir;
+int openScanSeries(const char * dataFile, int timeCol, int valueCol,
+    double missingCode, int basisRows, scanSeries * series);
+void closeScanSeries(scanSeries * series);
+int lmTScan(double * basisMat, int basisRows,
+    const scanSeries * series,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+
+// lmTMixed.c
+extern const double kMixedTol;
+int lmTMixed(float * basisMatF, double * basisMat,
+    int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+
+// lmTBlock.c
+// Series per block; 8 doubles fill an AVX-512 register
+#define BLOCK_LANES 8
+
+extern const int kBlockMaxK;
+int lmTBlock(double * basisMat, int basisRows, int k, int nLanes,
+    double ** yVecs, double ** timeVecs, int * nVec,
+    double * priorVec, double nu,
+    int maxIter, double tol,
+    double * logPosterior, double * logLikelihood,
+    double ** coefs, double * tau, int * iter, int * warmStart);
+
+// lmTNewton.c
+extern const double kNewtonWarmupTol;
+int lmTNewtonDesign(double * dMat, int n, int k,
+    double * yVec,
+    double * priorVec,
+    double nu,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+int lmTNewton(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int k,
+    int maxIter, double tol,
+    double * logPosterior,
+    double * logLikelihood,
+    double * coef,
+    double * tau,
+    int warmStart);
+
+// nugrid.c
+typedef struct {
+  double nu;
+  double logPosterior_m, logLikelihood_m, tau_m;
+  double logPosterior_l, logLikelihood_l, tau_l;
+  double * coef_m, * coef_l;
+  int iter_m, iter_l;
+} nuFit;
+
+int parseNuList(const char * list, double ** nuVec);
+nuFit * allocNuFits(const double * nuVec, int nNu, int basisCols,
+    int kSmooth);
+void freeNuFits(nuFit * fits, int nNu);
+void fitNuGrid(double * basisMat, float * basisMatF,
+    int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit * fits, int nNu, int warmStart);
+void fitNuGridBlock(double * basisMat, int basisRows, int basisCols,
+    double ** yVecs, int * nVec, double ** timeVecs, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit ** fits, int nNu, int nLanes);
+void fitNuGridBands(double * basisMat, float * basisMatF,
+    int basisRows, int basisCols,
+    double * yMat, int n, int nBands, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, char solver,
+    nuFit ** fits, int nNu);
+void fitNuGridScan(double * basisMat, int basisRows, int basisCols,
+    const scanSeries * series, double * priorVec,
+    int kSmooth, int maxIter, double tol,
+    nuFit * fits, int nNu);
+int selectNu(const nuFit * fits, int nNu, int n);
+
+// output.c
+void writeResult(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, double nu,
+    double llr, double lpr, double tau, double * coef);
+void writeNuFits(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, const nuFit * fits, int nNu, short profileNu);
+
+// stream.c
+int streamDetect(FILE * infile, const char * idString,
+    double * basisMat, int basisRows, int basisCols,
+    double * priorVec,
+    int timeCol, int valueCol, double missingCode,
+    double width, int startRows, int minObs,
+    double nu, int kSmooth,
+    int maxIter, double tol);
+
+// cache.c
+extern const uint64_t kFnvOffset;
+extern const double kCacheMaxMB;
+uint64_t fnv1a(const void * data, size_t len, uint64_t hash);
+uint64_t fnv1aFileIdentity(const char * fname, uint64_t hash);
+int cacheLookup(const char * dir, uint64_t key, const char * idString,
+    FILE * outfile);
+void cacheStore(const char * dir, uint64_t key, const char * lines);
+
+// batch.c
+struct verifyState;
+
+typedef struct {
+  double * basisMat, * priorVec;
+  float * basisMatF;
+  int basisRows, basisCols, kSmooth;
+  int timeCol, valueCol, minObs, maxIter;
+  double tol, missingCode;
+  const double * nuVec;
+  int nNu;
+  short profileNu, mixedPrecision;
+  char solver;
+  int nThreads, nReaders;
+  int queueDepth[3];    // Read, fit and write queues; <= 0 for defaults
+  const char * cacheDir;
+  uint64_t cacheSeed;
+  struct verifyState * verify;  // Sampled reference checks (-v); NULL if off
+  char * basisTag;      // Appended to IDs with several bases; NULL if one
+  double screenAlpha;   // Stop clear non-detections early (-S); 0 if off
+} fitConfig;
+
+extern const int kBatchCheckpointEvery;
+extern const int kBatchQueueDepth[];
+extern const int kBlockMaxObs;
+uint64_t fitCacheSeed(const fitConfig * cfg, const char * basisFile,
+    const char * priorFile);
+uint64_t seriesCacheKey(uint64_t seed, const double * timeVec,
+    const double * yVec, int n);
+int runBatch(const fitConfig * cfg, int nBases, const char * manifest,
+    int dataRows, const char * outDir, int shard, int nShards);
+
+// bands.c
+int parseIntList(const char * list, int ** vec);
+int parseDoubleList(const char * list, double ** vec);
+int runBands(const fitConfig * cfg, const char * dataFile, int dataRows,
+    const char * idString, const int * valueCols, const double * missingCodes,
+    int nBands);
+
+// bases.c
+void readModelInputs(const char * basisFile, int basisRows,
+    int basisCols, const char * priorFile, short mixedPrecision,
+    double ** basisMat, float ** basisMatF, double ** priorVec);
+int setupBases(const fitConfig * cfg, const char * basisFiles,
+    const char * rowsList, const char * colsList, const char * priorFiles,
+    fitConfig ** cfgs);
+void freeBases(fitConfig * cfgs, int nBases);
+const char * basisSeriesId(const fitConfig * cfg, const char * id,
+    char * buffer, size_t size);
+void unitTimes(double * timeVec, int n);
+void gridTimes(const double * unitVec, int n, int basisRows,
+    double * timeVec);
+void fitBases(const fitConfig * cfgs, int nBases, const char * id,
+    double * yVec, int n, double * timeVec, FILE * outfile);
+int runBases(const fitConfig * cfgs, int nBases, const char * dataFile,
+    int dataRows, const char * idString);
+
+// verify.c
+// Compared statistics: llr, lpr, tau and coefficients
+#define VERIFY_FIELDS 4
+
+typedef struct verifyState {
+  double fraction, relTol, absTol, llrTol;
+  uint64_t seed;
+  int nChecked, nFailed;
+  double maxAbs[VERIFY_FIELDS], maxRel[VERIFY_FIELDS];
+  pthread_mutex_t lock;
+} verifyState;
+
+extern const double kVerifyRelTol;
+extern const double kVerifyAbsTol;
+extern const double kVerifyLlrTol;
+void initVerify(verifyState * verify, const char * spec, unsigned long seed);
+void freeVerify(verifyState * verify);
+void fitNuGridReference(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol,
+    nuFit * fits, int nNu);
+int verifySeries(const fitConfig * cfg, const char * id,
+    double * yVec, int n, double * timeVec, const nuFit * fits);
+void reportVerify(FILE * outfile, const verifyState * verify);
+
+// screen.c
+extern const double kScreenSafety;
+extern const double kScreenMaxRate;
+extern const int kScreenMinIter;
+double screenThreshold(double alpha, int basisCols, int kSmooth);
+int fitNuGridScreen(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, double llrThreshold,
+    nuFit * fits, int nNu);
+
+// numa.c
+typedef struct {
+  int nNodes, nCpus;
+  int * cpus;     // Usable CPUs, grouped by node
+  int * nodeOf;   // Node index of each entry of cpus
+} numaTopology;
+
+void readNumaTopology(numaTopology * topo);
+void freeNumaTopology(numaTopology * topo);
+int numaThreadNode(const numaTopology * topo, int thread);
+int numaPinThread(const numaTopology * topo, int node);
+
+// pipeline.c
+typedef struct {
+  void ** slots;
+  double * costs;       // Cost of the item in each slot; NULL if FIFO
+  int capacity, head, count, closed;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty, notFull;
+} stageQueue;
+
+typedef struct {
+  const char * name;
+  int nThreads;
+  double busy, starved, blocked;  // Thread-seconds
+} stageStats;
+
+double monotonicSeconds(void);
+void initStageQueue(stageQueue * queue, int capacity);
+void initCostQueue(stageQueue * queue, int capacity);
+void freeStageQueue(stageQueue * queue);
+void stagePush(stageQueue * queue, void * item, double * blocked);
+void stagePushCost(stageQueue * queue, void * item, double cost,
+    double * blocked);
+void * stagePop(stageQueue * queue, double * starved);
+void * stageTryPop(stageQueue * queue);
+void closeStageQueue(stageQueue * queue);
+void addStageTimes(stageStats * stage, double lifetime, double starved,
+    double blocked);
+void reportStages(FILE * outfile, const char * label,
+    const stageStats * stages, int nStages, double wall);
+
+// calibrate.c
+extern const double kNullTailProbs[];
+extern const int kNumNullTailProbs;
+int calibrateNull(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n,
+    double * timeVec,
+    double * priorVec,
+    double nu, int kSmooth,
+    int maxIter, double tol,
+    char nullModel, int nRep, int nThreads, unsigned long seed,
+    double * llrNull);
+void writeNullQuantiles(FILE * outfile, const char * idString, int nObs,
+    int basisCols, int kSmooth, double nu,
+    double * llrNull, int nRep);
+
+// state.c
+typedef struct {
+  uint64_t idHash;      // fnv1a of the series ID
+  int basisRows, basisCols, kSmooth, nObs;
+  double nu, minTime, maxTime;
+  double tau_m, tau_l;
+  double * coef_m, * coef_l;
+} seriesState;
+
+int readSeriesState(const char * fname, seriesState * state);
+void writeSeriesState(const char * fname, const seriesState * state);
+void freeSeriesState(seriesState * state);
+int checkSeriesState(const seriesState * state, uint64_t idHash,
+    int basisRows, int basisCols, int kSmooth, double nu,
+    int nObs, double minTime, double maxTime);
 
 #endif /* WAVELETLMT_H_ */
@@ -0,0 +1,170 @@
+/*
+ * screen.c
+ *
+ *  Screening fits that stop once the detection decision is settled
+ *
+ *  screen_time_series.R flags a series when the p-value of its LLR,
+ *  2 * (logLikelihood_m - logLikelihood_l), against a chi-square with
+ *  basisCols - kSmooth df is small. Adjusted p-values (Bonferroni, BH and
+ *  the other p.adjust methods) are never below the raw ones, so a series
+ *  whose LLR stays below the chi-square quantile at alpha cannot be flagged
+ *  at that alpha, and how far below it ends up does not matter. Here the
+ *  EM iterations of the full and smooth models are interleaved, and both
+ *  stop as soon as an estimated upper bound on the converged LLR falls
+ *  below that quantile. Series that may be flagged, and so are used for
+ *  features, converge to the usual tolerance.
+ */
+
+#include "rowavedt.h"
+
+// Multiple of the extrapolated remaining change in each log-likelihood
+// added to the LLR bound, for rates that are not yet steady
+const double kScreenSafety = 10;
+
+// Slowest contraction of log-likelihood steps trusted for a bound
+const double kScreenMaxRate = 0.9;
+
+// Iterations of each model before a bound is trusted
+const int kScreenMinIter = 3;
+
+// LLR above which a series may be flagged at alpha
+double screenThreshold(double alpha, int basisCols, int kSmooth)
+{
+  return gsl_cdf_chisq_Qinv(alpha, basisCols - kSmooth);
+}
+
+// One model of a screening fit with the convergence state of its EM
+typedef struct {
+  emModel em;
+  double step;          // Size of the last change in log-likelihood
+  double remaining;     // Bound on its remaining change; INFINITY if none
+  int iter, done;
+} screenModel;
+
+static void screenInit(screenModel * s, double * dMat, int n, int k,
+    double * yVec, double * priorVec, double nu,
+    double * coef, double tau, int warmStart)
+{
+  emInit(&s->em, dMat, n, k, yVec, priorVec, nu, coef, tau, warmStart, NULL);
+  s->step = 0;
+  s->remaining = INFINITY;
+  s->iter = 0;
+  s->done = 0;
+}
+
+/*
+ * One EM iteration, counted as lmTDesign counts them. Once EM converges
+ * (or maxIter is reached) the model is done and its bound is 0. Otherwise,
+ * for linear convergence at rate r, the remaining change after a step d is
+ * about d * r / (1 - r), with r estimated from the last two steps
+ */
+static void screenStep(screenModel * s, int maxIter, double tol)
+{
+  double before, step, rate;
+
+  if (s->done)
+    return;
+
+  before = s->em.logLikelihood;
+  if (fabs(emStep(&s->em)) < tol)
+  {
+    s->done = 1;
+    s->remaining = 0;
+    return;
+  }
+  s->iter++;
+  s->done = (s->iter >= maxIter);
+
+  step = fabs(s->em.logLikelihood - before);
+  rate = (s->step > 0) ? step / s->step : INFINITY;
+  s->remaining = (rate < kScreenMaxRate) ?
+    kScreenSafety * step * rate / (1 - rate) : INFINITY;
+  s->step = step;
+  s->remaining = s->done ? 0 : s->remaining;
+}
+
+/*
+ * As fitNuGrid (EM, without mixed precision or warm start) for screening
+ * at LLR threshold llrThreshold (see screenThreshold). For each df, the two
+ * models are stepped in turn until both converge or, once each has run
+ * kScreenMinIter iterations, until
+ *   2 * (ll_m + remaining_m - (ll_l - remaining_l)) < llrThreshold,
+ * in which case their fits are left as they are, short of convergence.
+ * Returns the number of df whose fits were stopped early
+ */
+int fitNuGridScreen(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol, double llrThreshold,
+    nuFit * fits, int nNu)
+{
+  int g, warm_m = 0, warm_l = 0, nStopped = 0;
+  double * dMat_m, * dMat_l, * start_m, * start_l, llrUpper;
+  screenModel full, smooth;
+
+  dMat_m = buildDesign(basisMat, basisRows, timeVec, n, basisCols);
+  dMat_l = buildDesign(basisMat, basisRows, timeVec, n, kSmooth);
+
+  // Starting values as in fitNuGrid, the same for every df
+  start_m = calloc(basisCols, sizeof(double));
+  checkPtr(start_m, "out of memory");
+  start_l = calloc(kSmooth, sizeof(double));
+  checkPtr(start_l, "out of memory");
+  if (regularSampling(timeVec, n, basisRows, basisCols) &&
+      regularSampling(timeVec, n, basisRows, kSmooth))
+  {
+    warm_m = projectInit(dMat_m, n, basisCols, basisRows, yVec, priorVec,
+        start_m);
+    warm_l = projectInit(dMat_l, n, kSmooth, basisRows, yVec, priorVec,
+        start_l);
+  }
+
+  for (g=0; g<nNu; g++)
+  {
+    dcopy(basisCols, start_m, 1, fits[g].coef_m, 1);
+    dcopy(kSmooth, start_l, 1, fits[g].coef_l, 1);
+    fits[g].tau_m = 0;
+    fits[g].tau_l = 0;
+
+    screenInit(&full, dMat_m, n, basisCols, yVec, priorVec, fits[g].nu,
+        fits[g].coef_m, fits[g].tau_m, warm_m);
+    screenInit(&smooth, dMat_l, n, kSmooth, yVec, priorVec, fits[g].nu,
+        fits[g].coef_l, fits[g].tau_l, warm_l);
+
+    while (!full.done || !smooth.done)
+    {
+      screenStep(&full, maxIter, tol);
+      screenStep(&smooth, maxIter, tol);
+
+      if ((full.done || full.iter >= kScreenMinIter) &&
+          (smooth.done || smooth.iter >= kScreenMinIter))
+      {
+        llrUpper = 2 * (full.em.logLikelihood + full.remaining -
+            (smooth.em.logLikelihood - smooth.remaining));
+        if (llrUpper < llrThreshold && (!full.done || !smooth.done))
+        {
+          nStopped++;
+          break;
+        }
+      }
+    }
+
+    fits[g].logPosterior_m = full.em.logPosterior;
+    fits[g].logLikelihood_m = full.em.logLikelihood;
+    fits[g].tau_m = full.em.tau;
+    fits[g].iter_m = full.iter;
+    fits[g].logPosterior_l = smooth.em.logPosterior;
+    fits[g].logLikelihood_l = smooth.em.logLikelihood;
+    fits[g].tau_l = smooth.em.tau;
+    fits[g].iter_l = smooth.iter;
+
+    emFree(&full.em);
+    emFree(&smooth.em);
+  }
+
+  free(dMat_m);
+  free(dMat_l);
+  free(start_m);
+  free(start_l);
+
+  return nStopped;
+}
@@ -0,0 +1,140 @@
+/*
+ * state.c
+ *
+ *  Per-series fit state persisted between runs for incremental refits
+ *
+ *  The state is tagged with a hash of the series ID, so a state file left
+ *  by another series is never taken for an earlier version of this one.
+ */
+
+#include "rowavedt.h"
+
+// Largest shift of previously observed times on the basis grid, in units of
+// the finest resolved scale (basisRows / basisCols rows), that still allows a
+// warm start. Larger changes in the time span force a full rebuild.
+const double kMaxStateDrift = 0.5;
+
+// Read state written by writeSeriesState; returns 0 on success
+int readSeriesState(const char * fname, seriesState * state)
+{
+  FILE * infile;
+  unsigned long long idHash;
+  int i, ok = 1;
+
+  state->coef_m = NULL;
+  state->coef_l = NULL;
+
+  infile = fopen(fname, "r");
+  if (infile==NULL)
+    return 1;
+
+  if (fscanf(infile, "# rowavedt state %llx %d %d %d %d %lf %lf %lf",
+        &idHash, &state->basisRows, &state->basisCols, &state->kSmooth,
+        &state->nObs, &state->nu, &state->minTime, &state->maxTime) != 8 ||
+      state->basisCols < 1 || state->kSmooth < 1)
+  {
+    fclose(infile);
+    return 1;
+  }
+  state->idHash = idHash;
+
+  state->coef_m = malloc(state->basisCols * sizeof(double));
+  checkPtr(state->coef_m, "out of memory");
+  state->coef_l = malloc(state->kSmooth * sizeof(double));
+  checkPtr(state->coef_l, "out of memory");
+
+  ok = ok && fscanf(infile, "%lf", &state->tau_m) == 1;
+  for (i=0; ok && i<state->basisCols; i++)
+    ok = fscanf(infile, "%lf", &state->coef_m[i]) == 1;
+
+  ok = ok && fscanf(infile, "%lf", &state->tau_l) == 1;
+  for (i=0; ok && i<state->kSmooth; i++)
+    ok = fscanf(infile, "%lf", &state->coef_l[i]) == 1;
+
+  fclose(infile);
+
+  if (!ok)
+  {
+    freeSeriesState(state);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Write state to fname via a temporary file so readers never see partial state
+void writeSeriesState(const char * fname, const seriesState * state)
+{
+  FILE * outfile;
+  char tmpName[strlen(fname) + 5];
+  int i;
+
+  sprintf(tmpName, "%s.tmp", fname);
+
+  outfile = fopen(tmpName, "w");
+  checkPtr(outfile, tmpName);
+
+  fprintf(outfile,
+      "# rowavedt state %016llx %d %d %d %d %.17g %.17g %.17g\n",
+      (unsigned long long) state->idHash, state->basisRows,
+      state->basisCols, state->kSmooth, state->nObs, state->nu,
+      state->minTime, state->maxTime);
+
+  fprintf(outfile, "%.17g", state->tau_m);
+  for (i=0; i<state->basisCols; i++)
+    fprintf(outfile, " %.17g", state->coef_m[i]);
+  fprintf(outfile, "\n");
+
+  fprintf(outfile, "%.17g", state->tau_l);
+  for (i=0; i<state->kSmooth; i++)
+    fprintf(outfile, " %.17g", state->coef_l[i]);
+  fprintf(outfile, "\n");
+
+  if (fclose(outfile) != 0 || rename(tmpName, fname) != 0)
+  {
+    fprintf(stderr, "Error -- could not write state to %s\n", fname);
+    exit(1);
+  }
+}
+
+void freeSeriesState(seriesState * state)
+{
+  free(state->coef_m);
+  state->coef_m = NULL;
+
+  free(state->coef_l);
+  state->coef_l = NULL;
+}
+
+/*
+ * Decide whether a stored state can warm-start a fit of the current series.
+ * Returns 1 for a warm start, 0 if a full rebuild is required.
+ *
+ * The series ID (idHash) and model settings must match and the series may
+ * only have grown. Because
+ * times are rescaled to span the basis grid, any change in the time span moves
+ * previously observed times to new grid rows; this shift is largest at the old
+ * endpoints. Warm starts are allowed while that shift stays below
+ * kMaxStateDrift times the finest resolved scale.
+ */
+int checkSeriesState(const seriesState * state, uint64_t idHash,
+    int basisRows, int basisCols, int kSmooth, double nu,
+    int nObs, double minTime, double maxTime)
+{
+  double drift;
+
+  if (state->idHash != idHash)
+    return 0;
+
+  if (state->basisRows != basisRows || state->basisCols != basisCols ||
+      state->kSmooth != kSmooth || state->nu != nu || nObs < state->nObs)
+    return 0;
+
+  if (!(state->tau_m > 0) || !(state->tau_l > 0) || maxTime <= minTime)
+    return 0;
+
+  drift = fmax(fabs(minTime - state->minTime), fabs(maxTime - state->maxTime));
+  drift = drift / (maxTime - minTime) * (basisRows-1);
+
+  return drift <= kMaxStateDrift * basisRows / basisCols;
+}
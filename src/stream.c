@@ -0,0 +1,203 @@
+/*
+ * stream.c
+ *
+ *  Sliding-window event detection over streaming observations
+ */
+
+#include "rowavedt.h"
+
+// Parse two columns from a delimited line; returns 0 if both were found
+static int parseColumns(char * row, int col1, int col2,
+    double * x1, double * x2)
+{
+  const char sep[] = "\t ,\n";
+  char * buf;
+  int j = 0, found = 0;
+
+  buf = strtok(row, sep);
+  while (buf != NULL && found < 2)
+  {
+    if (j==col1)
+    {
+      *x1 = atof(buf);
+      found++;
+    }
+    if (j==col2)
+    {
+      *x2 = atof(buf);
+      found++;
+    }
+    j++;
+    buf = strtok(NULL, sep);
+  }
+
+  return found < 2;
+}
+
+/*
+ * Run the detector over observations read from infile in time order
+ * Returns number of records written to stdout
+ *
+ * The window covers the most recent `width` time units and is mapped onto the
+ * basis grid, so each grid row is a cell of width / (basisRows-1) time units
+ * with the newest cell on the last row. Times are binned to absolute cells
+ * once, as they arrive; the window slides by whole cells, so an observation's
+ * basis row is its cell minus the cell at the start of the window. Each
+ * arriving observation enters the window, observations whose cell falls off
+ * the start leave it, and the full and smooth models are refit from the
+ * grouped statistics of the observations in the window, warm-started from the
+ * previous step. The cost of a step is bounded by the window contents, not by
+ * the length of the history.
+ *
+ * Records use the format of the batch output, with the time of the newest
+ * observation appended to the ID as ID@TIME.
+ */
+int streamDetect(FILE * infile, const char * idString,
+    double * basisMat, int basisRows, int basisCols,
+    double * priorVec,
+    int timeCol, int valueCol, double missingCode,
+    double width, int startRows, int minObs,
+    double nu, int kSmooth,
+    int maxIter, double tol)
+{
+  int maxCol = (timeCol > valueCol) ? timeCol : valueCol;
+  char row[(maxCol+1)*100];
+  char recordId[strlen(idString) + 32];
+  double t = 0, y = 0, t0 = 0, cellWidth;
+  long cell, lastCell = LONG_MIN, startCell;
+  int i, head = 0, count = 0, cap, nRecords = 0, fitted = 0;
+
+  cellWidth = width / (basisRows-1);
+  cap = (startRows > minObs) ? startRows : minObs;
+
+  // Window of observations as a ring buffer; cells are absolute grid cells
+  double * yRing, * yWin;
+  long * cellRing;
+  int * rowWin;
+
+  yRing = calloc(cap, sizeof(double));
+  checkPtr(yRing, "out of memory");
+  cellRing = malloc(cap * sizeof(long));
+  checkPtr(cellRing, "out of memory");
+  yWin = malloc(cap * sizeof(double));
+  checkPtr(yWin, "out of memory");
+  rowWin = malloc(cap * sizeof(int));
+  checkPtr(rowWin, "out of memory");
+
+  // Setup variables for estimation
+  double logPosterior_l, logLikelihood_l, tau_l = 0;
+  double logPosterior_m, logLikelihood_m, tau_m = 0;
+  double * coef_l, * coef_m;
+
+  coef_l = malloc(kSmooth * sizeof(double));
+  checkPtr(coef_l, "out of memory");
+  coef_m = malloc(basisCols * sizeof(double));
+  checkPtr(coef_m, "out of memory");
+
+  while (fgets(row, (maxCol+1)*100, infile) != NULL)
+  {
+    // Skip comments, malformed lines and coded missing values
+    if (row[0] == '#') continue;
+    if (parseColumns(row, timeCol, valueCol, &t, &y)) continue;
+    if (y == missingCode || isnan(t) || isnan(y)) continue;
+
+    // Bin time to absolute grid cell
+    if (lastCell == LONG_MIN) t0 = t;
+    cell = (long) floor( (t - t0) / cellWidth + 0.5 );
+    if (cell < lastCell)
+    {
+      fprintf(stderr, "Error -- times out of order at %g\n", t);
+      exit(1);
+    }
+    lastCell = cell;
+
+    // Drop observations that have left the window
+    startCell = cell - (basisRows-1);
+    while (count > 0 && cellRing[head] < startCell)
+    {
+      head = (head + 1) % cap;
+      count--;
+    }
+
+    // Grow buffers if full, unrolling the ring
+    if (count == cap)
+    {
+      double * yNew = malloc(2 * cap * sizeof(double));
+      long * cellNew = malloc(2 * cap * sizeof(long));
+      checkPtr(yNew, "out of memory");
+      checkPtr(cellNew, "out of memory");
+      for (i=0; i<count; i++)
+      {
+        yNew[i] = yRing[(head + i) % cap];
+        cellNew[i] = cellRing[(head + i) % cap];
+      }
+      free(yRing);
+      free(cellRing);
+      yRing = yNew;
+      cellRing = cellNew;
+      head = 0;
+      cap *= 2;
+
+      free(yWin);
+      free(rowWin);
+      yWin = malloc(cap * sizeof(double));
+      checkPtr(yWin, "out of memory");
+      rowWin = malloc(cap * sizeof(int));
+      checkPtr(rowWin, "out of memory");
+    }
+
+    // Add new observation
+    yRing[(head + count) % cap] = y;
+    cellRing[(head + count) % cap] = cell;
+    count++;
+
+    if (count < minObs) continue;
+
+    // Map window onto basis rows
+    for (i=0; i<count; i++)
+    {
+      yWin[i] = yRing[(head + i) % cap];
+      rowWin[i] = (int) (cellRing[(head + i) % cap] - startCell);
+    }
+
+    // Refit full and smooth models, warm-started from previous step
+    lmTGrouped(basisMat, basisRows, basisCols,
+        yWin, rowWin, count,
+        priorVec,
+        nu, basisCols,
+        maxIter, tol,
+        &logPosterior_m,
+        &logLikelihood_m,
+        coef_m,
+        &tau_m,
+        fitted);
+
+    lmTGrouped(basisMat, basisRows, basisCols,
+        yWin, rowWin, count,
+        priorVec,
+        nu, kSmooth,
+        maxIter, tol,
+        &logPosterior_l,
+        &logLikelihood_l,
+        coef_l,
+        &tau_l,
+        fitted);
+    fitted = 1;
+
+    sprintf(recordId, "%s@%.10g", idString, t);
+    writeResult(stdout, recordId, count, basisCols, kSmooth, nu,
+        2 * (logLikelihood_m - logLikelihood_l),
+        logPosterior_m - logPosterior_l,
+        tau_m, coef_m);
+    nRecords++;
+  }
+
+  free(yRing);
+  free(cellRing);
+  free(yWin);
+  free(rowWin);
+  free(coef_l);
+  free(coef_m);
+
+  return nRecords;
+}
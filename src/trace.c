@@ -0,0 +1,203 @@
+/*
+ * trace.c
+ *
+ *  Per-thread counters and event log for hot-path tracing (see trace.h)
+ */
+
+#include "rowavedt.h"
+
+#ifdef ROWAVEDT_TRACE
+
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Events kept per thread for Chrome traces; older events are overwritten
+#define TRACE_EVENTS 65536
+
+const char * kTracePhaseNames[TRACE_NUM_PHASES] = {
+  "readToDoubleVectorDynamic", "buildDesign", "wls", "calcResid", "dt_log",
+  "writeResult"};
+
+typedef struct {
+  uint64_t start, end;
+  int phase;
+} traceEvent;
+
+typedef struct traceThread {
+  int id;
+  uint64_t calls[TRACE_NUM_PHASES];
+  uint64_t cycles[TRACE_NUM_PHASES];
+  uint64_t bytes[TRACE_NUM_PHASES];
+  traceEvent * events;
+  uint64_t nEvents;
+  struct traceThread * next;
+} traceThread;
+
+static __thread traceThread * tThread = NULL;
+static traceThread * allThreads = NULL;
+static int nThreads = 0;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static volatile sig_atomic_t dumpRequested = 0;
+static uint64_t cycleOrigin;
+static double nsPerCycle = 1;
+
+uint64_t traceCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double traceNanoseconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void traceDump(void)
+{
+  const char * fname = getenv("ROWAVEDT_TRACE");
+  const char * format = getenv("ROWAVEDT_TRACE_FORMAT");
+  int chrome = (format != NULL && strcmp(format, "chrome") == 0);
+  char defaultName[64];
+  traceThread * t;
+  uint64_t e, first;
+  int p, sep = 0;
+  FILE * outfile;
+
+  if (fname == NULL || fname[0] == '\0')
+  {
+    sprintf(defaultName, "rowavedt-trace.%d.json", (int) getpid());
+    fname = defaultName;
+  }
+
+  pthread_mutex_lock(&traceLock);
+
+  outfile = fopen(fname, "w");
+  if (outfile == NULL)
+  {
+    pthread_mutex_unlock(&traceLock);
+    fprintf(stderr, "Error -- could not write trace to %s\n", fname);
+    return;
+  }
+
+  if (chrome)
+  {
+    // Complete ("X") events with microsecond timestamps
+    fprintf(outfile, "{\"traceEvents\": [");
+    for (t=allThreads; t!=NULL; t=t->next)
+    {
+      first = (t->nEvents > TRACE_EVENTS) ? t->nEvents - TRACE_EVENTS : 0;
+      for (e=first; e<t->nEvents; e++)
+      {
+        traceEvent * ev = &t->events[e % TRACE_EVENTS];
+        fprintf(outfile, "%s\n{\"name\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+            sep++ ? "," : "", kTracePhaseNames[ev->phase],
+            (ev->start - cycleOrigin) * nsPerCycle / 1e3,
+            (ev->end - ev->start) * nsPerCycle / 1e3,
+            (int) getpid(), t->id);
+      }
+    }
+    fprintf(outfile, "\n]}\n");
+  }
+  else
+  {
+    // Counters per thread and phase
+    fprintf(outfile, "{\"ns_per_cycle\": %.6f, \"threads\": [", nsPerCycle);
+    for (t=allThreads; t!=NULL; t=t->next)
+    {
+      fprintf(outfile, "%s\n{\"thread\": %d, \"phases\": {",
+          (t != allThreads) ? "," : "", t->id);
+      for (p=0; p<TRACE_NUM_PHASES; p++)
+      {
+        fprintf(outfile, "%s\"%s\": {\"calls\": %llu, \"cycles\": %llu, "
+            "\"bytes\": %llu}", p ? ", " : "", kTracePhaseNames[p],
+            (unsigned long long) t->calls[p],
+            (unsigned long long) t->cycles[p],
+            (unsigned long long) t->bytes[p]);
+      }
+      fprintf(outfile, "}}");
+    }
+    fprintf(outfile, "\n]}\n");
+  }
+
+  fclose(outfile);
+  pthread_mutex_unlock(&traceLock);
+}
+
+static void traceSignal(int sig)
+{
+  dumpRequested = 1;
+}
+
+// Calibrate cycles against wall time and arrange dumps at exit and SIGUSR1
+static void traceInit(void)
+{
+  double ns0, ns1;
+  uint64_t c0, c1;
+
+  ns0 = traceNanoseconds();
+  c0 = traceCycles();
+  do
+  {
+    ns1 = traceNanoseconds();
+  } while (ns1 - ns0 < 1e6);
+  c1 = traceCycles();
+  nsPerCycle = (ns1 - ns0) / (double) (c1 - c0);
+  cycleOrigin = c0;
+
+  signal(SIGUSR1, traceSignal);
+  atexit(traceDump);
+}
+
+void traceRecord(int phase, uint64_t start, uint64_t bytes)
+{
+  uint64_t end = traceCycles();
+  traceThread * t = tThread;
+
+  if (t == NULL)
+  {
+    pthread_once(&traceOnce, traceInit);
+
+    t = calloc(1, sizeof(traceThread));
+    checkPtr(t, "out of memory");
+    t->events = malloc(TRACE_EVENTS * sizeof(traceEvent));
+    checkPtr(t->events, "out of memory");
+
+    pthread_mutex_lock(&traceLock);
+    t->id = nThreads++;
+    t->next = allThreads;
+    allThreads = t;
+    pthread_mutex_unlock(&traceLock);
+
+    tThread = t;
+  }
+
+  t->calls[phase]++;
+  t->cycles[phase] += end - start;
+  t->bytes[phase] += bytes;
+
+  traceEvent * ev = &t->events[t->nEvents % TRACE_EVENTS];
+  ev->start = start;
+  ev->end = end;
+  ev->phase = phase;
+  t->nEvents++;
+
+  if (dumpRequested)
+  {
+    dumpRequested = 0;
+    traceDump();
+  }
+}
+
+#endif /* ROWAVEDT_TRACE */
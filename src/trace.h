@@ -0,0 +1,46 @@
+/*
+ * trace.h
+ *
+ *  Optional hot-path tracing, enabled by compiling with -DROWAVEDT_TRACE
+ *
+ *  Each traced phase records call counts, cycles and approximate bytes
+ *  touched in per-thread counters, plus recent events for Chrome traces.
+ *  Results are written at exit and on SIGUSR1 to the file named by
+ *  ROWAVEDT_TRACE (default rowavedt-trace.PID.json), as counter JSON or, if
+ *  ROWAVEDT_TRACE_FORMAT=chrome, in Chrome trace event format.
+ *  Without ROWAVEDT_TRACE the macros expand to nothing.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+// Traced phases; names in kTracePhaseNames (trace.c)
+enum {
+  TRACE_READ,
+  TRACE_DESIGN,
+  TRACE_WLS,
+  TRACE_RESID,
+  TRACE_DTLOG,
+  TRACE_OUTPUT,
+  TRACE_NUM_PHASES
+};
+
+#ifdef ROWAVEDT_TRACE
+
+uint64_t traceCycles(void);
+void traceRecord(int phase, uint64_t start, uint64_t bytes);
+
+#define TRACE_BEGIN(phase) uint64_t traceStart_##phase = traceCycles()
+#define TRACE_END(phase, bytes) \
+  traceRecord(phase, traceStart_##phase, (uint64_t) (bytes))
+
+#else
+
+#define TRACE_BEGIN(phase)
+#define TRACE_END(phase, bytes)
+
+#endif /* ROWAVEDT_TRACE */
+
+#endif /* TRACE_H_ */
@@ -6,11 +6,17 @@
 
 #include "rowavedt.h"
 
+// Called by checkPtr instead of exiting if set; must not return (see
+// R/rowavedt_r.c, which raises an R error instead)
+void (*fatalHandler)(const char * msg) = NULL;
+
 // Function to catch NULL pointers and exit if needed
 void checkPtr(const void * ptr, const char * msg)
 {
   if (ptr==NULL)
   {
+    if (fatalHandler != NULL)
+      fatalHandler(msg);
     fprintf(stderr, "Error -- %s\n", msg);
     exit(1);
   }
@@ -41,6 +47,18 @@ int arrayMinMax(double * X, int n, double * min, double * max)
   return 0;
 }
 
+// Map times in [minTime, maxTime] onto basis rows [0, basisRows-1] in place
+void rescaleTimes(double * timeVec, int n, double minTime, double maxTime,
+    int basisRows)
+{
+  int i;
+  for (i=0; i<n; i++)
+  {
+    timeVec[i] = (timeVec[i] - minTime) / (maxTime - minTime);
+    timeVec[i] = timeVec[i] * (basisRows-1);
+  }
+}
+
 int allocateMatrix(double*** matrix, int nRows, int nCols)
 {
   int i;
@@ -143,7 +161,8 @@ double quantile_int(double x, double data[], int n)
 int compare_dbl(const void * a, const void * b)
   /* Comparator function for qsort */
 {
-  return (*(double*)a - *(double*)b);
+  double x = *(double*)a, y = *(double*)b;
+  return (x > y) - (x < y);
 }
 
 // Column-major ordering for BLAS/LAPACK compatibility
@@ -292,6 +311,8 @@ int readToDoubleVectorDynamic(const char * fname, int startRows, int col,
   int size = startRows;
   double * tmp;
 
+  TRACE_BEGIN(TRACE_READ);
+
   // Open file
   infile = fopen(fname, "r");
   checkPtr(infile, fname);
@@ -334,9 +355,70 @@ int readToDoubleVectorDynamic(const char * fname, int startRows, int col,
     i++;
   }
 
+  TRACE_END(TRACE_READ, ftell(infile));
+
   // Close file
   fclose(infile);
 
   // Return number of lines read
   return i;
 }
+
+/*
+ * Read columns cols[0..nCols-1] of fname in one pass, splitting lines as
+ * readToDoubleVectorDynamic does. Line i goes to (*X)[i*nCols + c] for
+ * column c; columns missing from a line are NaN. (*X) must hold startRows
+ * (at least 1) lines and is grown as needed.
+ * Returns number of lines read
+ */
+int readToDoubleColumnsDynamic(const char * fname, int startRows,
+    const int * cols, int nCols, double ** X)
+{
+  FILE * infile;
+  const char sep[] = "\t ,";
+  char * row = NULL, * buf, * save;
+  size_t rowSize = 0;
+  int i = 0, j, c;
+  int size = startRows;
+  double * tmp;
+
+  TRACE_BEGIN(TRACE_READ);
+
+  infile = fopen(fname, "r");
+  checkPtr(infile, fname);
+
+  while (getline(&row, &rowSize, infile) > 0)
+  {
+    // Skip comments
+    if (row[0] == '#') continue;
+
+    if (i >= size)
+    {
+      size = size * 2;
+      tmp = realloc((*X), size * nCols * sizeof(double));
+      checkPtr(tmp, "out of memory");
+      (*X) = tmp;
+    }
+
+    for (c=0; c<nCols; c++)
+    {
+      (*X)[i * nCols + c] = NAN;
+    }
+    for (j=0, buf=strtok_r(row, sep, &save); buf != NULL;
+        j++, buf=strtok_r(NULL, sep, &save))
+    {
+      for (c=0; c<nCols; c++)
+      {
+        if (cols[c] == j) (*X)[i * nCols + c] = atof(buf);
+      }
+    }
+    i++;
+  }
+
+  TRACE_END(TRACE_READ, ftell(infile));
+
+  free(row);
+  fclose(infile);
+
+  return i;
+}
@@ -0,0 +1,343 @@
+/*
+ * verify.c
+ *
+ *  Checks of fitted series against the reference fit (-v)
+ *
+ *  The fits written by rowavedt come from several accelerated paths:
+ *  shared designs across df, projection starts, factor reuse in wlsUpdate,
+ *  Newton steps, mixed precision and blocks of short series.
+ *  With -v a sampled fraction of series is refit by the reference algorithm,
+ *  the original lmT (a cold start for each model and df, and a full weighted
+ *  least-squares solve in double precision at every EM iteration), in the
+ *  same process and on the same design, and llr, lpr, tau and the
+ *  coefficients of both fits are compared. Series are sampled by a hash of
+ *  their ID and the seed (-x), so a run checks the same series whatever the
+ *  thread count or shard layout.
+ */
+
+#include "rowavedt.h"
+
+// Default tolerances on differences from the reference fit. Fits that stop
+// on the same criterion from different starts differ by up to about 1e-4
+// (relative) at small df, where EM converges slowly, and llr by a few
+// hundredths of a unit.
+const double kVerifyRelTol = 1e-3;
+const double kVerifyAbsTol = 1e-6;
+
+// Absolute tolerance on llr and lpr, in LLR units. Near the detection
+// threshold the relative tolerance adds about as much again, so a fit
+// whose llr is off by a few tenths, enough to move a series across the
+// threshold, is reported.
+const double kVerifyLlrTol = 0.05;
+
+static const char * kVerifyFieldNames[VERIFY_FIELDS] =
+  {"llr", "lpr", "tau", "coef"};
+
+/*
+ * Set up verification from a spec FRACTION[,RELTOL[,ABSTOL[,LLRTOL]]]
+ * A fitted value passes if it is within RELTOL * its scale (see
+ * verifyValues) of the reference, plus LLRTOL for llr and lpr or ABSTOL
+ * for tau and the coefficients
+ */
+void initVerify(verifyState * verify, const char * spec, unsigned long seed)
+{
+  double * values;
+  int n;
+
+  n = parseDoubleList(spec, &values);
+  if (n > 4 || !(values[0] > 0 && values[0] <= 1) ||
+      (n > 1 && !(values[1] >= 0)) || (n > 2 && !(values[2] >= 0)) ||
+      (n > 3 && !(values[3] >= 0)))
+  {
+    fprintf(stderr, "Error -- invalid verification spec '%s'\n", spec);
+    exit(1);
+  }
+
+  memset(verify, 0, sizeof(verifyState));
+  verify->fraction = values[0];
+  verify->relTol = (n > 1) ? values[1] : kVerifyRelTol;
+  verify->absTol = (n > 2) ? values[2] : kVerifyAbsTol;
+  verify->llrTol = (n > 3) ? values[3] : kVerifyLlrTol;
+  verify->seed = fnv1a(&seed, sizeof(seed), kFnvOffset);
+  pthread_mutex_init(&verify->lock, NULL);
+
+  free(values);
+}
+
+void freeVerify(verifyState * verify)
+{
+  pthread_mutex_destroy(&verify->lock);
+}
+
+/*
+ * Whether the series with this ID is in the sample. The high bits of FNV-1a
+ * are poorly mixed for short, similar IDs, so the hash is finished with the
+ * splitmix64 mixer before it is compared with the fraction.
+ */
+static int verifySelected(const verifyState * verify, const char * id)
+{
+  uint64_t hash = fnv1a(id, strlen(id), verify->seed);
+
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+
+  return (double) (hash >> 11) * 0x1.0p-53 < verify->fraction;
+}
+
+/*
+ * Reference fit of one model: lmTDesign as originally written, from a cold
+ * start with a full wls solve at every iteration
+ */
+static int lmTReference(double * dMat, int n, int k,
+    double * yVec, double * priorVec, double nu,
+    int maxIter, double tol,
+    double * logPosterior, double * logLikelihood,
+    double * coef, double * tau)
+{
+  int iter, i, m = n + k - 1;
+  double logPosterior_tm1, logPrior, delta;
+  double * dVec, * sqwX, * XTX, * w, * sqw, * sqwy, * resid;
+
+  dVec = calloc(m, sizeof(double));
+  checkPtr(dVec, "out of memory");
+  sqwX = calloc(m * k, sizeof(double));
+  checkPtr(sqwX, "out of memory");
+  XTX = calloc(k * k, sizeof(double));
+  checkPtr(XTX, "out of memory");
+  w = calloc(m, sizeof(double));
+  checkPtr(w, "out of memory");
+  sqw = calloc(m, sizeof(double));
+  checkPtr(sqw, "out of memory");
+  sqwy = calloc(m, sizeof(double));
+  checkPtr(sqwy, "out of memory");
+  resid = calloc(m, sizeof(double));
+  checkPtr(resid, "out of memory");
+
+  // Observations, then 0 for the prior rows
+  dcopy(n, yVec, 1, dVec, 1);
+
+  for (i=0; i<n; i++)
+  {
+    w[i] = 1;
+  }
+  dcopy(k-1, priorVec, 1, &w[n], 1);
+
+  // First iteration
+  wls(dMat, m, k, dVec, w, XTX, sqw, sqwX, sqwy, coef);
+  calcResid(dMat, m, k, dVec, coef, resid);
+
+  (*tau) = 0;
+  for (i=0; i<m; i++)
+  {
+    (*tau) += resid[i] * resid[i] * w[i];
+  }
+  (*tau) /= dasum(m, w, 1);
+
+  (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+  logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+  (*logPosterior) = (*logLikelihood) + logPrior;
+  logPosterior_tm1 = (*logPosterior);
+
+  // EM loop
+  for (iter=0; iter<maxIter; iter++)
+  {
+    for (i=0; i<n; i++)
+    {
+      w[i] = tWeight(resid[i], *tau, nu);
+    }
+
+    wls(dMat, m, k, dVec, w, XTX, sqw, sqwX, sqwy, coef);
+    calcResid(dMat, m, k, dVec, coef, resid);
+
+    (*tau) = 0;
+    for (i=0; i<m; i++)
+    {
+      (*tau) += resid[i] * resid[i] * w[i];
+    }
+    (*tau) /= dasum(m, w, 1);
+
+    (*logLikelihood) = dt_log(resid, n, nu, 0, sqrt(*tau));
+    logPrior = dnorm_log(&resid[n], k-1, 0, sqrt((*tau)/priorVec[0]));
+    (*logPosterior) = (*logLikelihood) + logPrior;
+
+    delta = ((*logPosterior) - logPosterior_tm1) /
+      fabs((*logPosterior) + logPosterior_tm1) * 2;
+    logPosterior_tm1 = (*logPosterior);
+
+    if (delta < tol)
+      break;
+  }
+
+  free(dVec);
+  free(sqwX);
+  free(XTX);
+  free(w);
+  free(sqw);
+  free(sqwy);
+  free(resid);
+
+  return iter;
+}
+
+/*
+ * Reference fits of the full and smooth models for each df in fits
+ * Times must already be rescaled (see rescaleTimes).
+ */
+void fitNuGridReference(double * basisMat, int basisRows, int basisCols,
+    double * yVec, int n, double * timeVec, double * priorVec,
+    int kSmooth, int maxIter, double tol,
+    nuFit * fits, int nNu)
+{
+  int g;
+  double * dMat_m, * dMat_l;
+
+  dMat_m = buildDesign(basisMat, basisRows, timeVec, n, basisCols);
+  dMat_l = buildDesign(basisMat, basisRows, timeVec, n, kSmooth);
+
+  for (g=0; g<nNu; g++)
+  {
+    fits[g].iter_m = lmTReference(dMat_m, n, basisCols, yVec, priorVec,
+        fits[g].nu, maxIter, tol, &fits[g].logPosterior_m,
+        &fits[g].logLikelihood_m, fits[g].coef_m, &fits[g].tau_m);
+    fits[g].iter_l = lmTReference(dMat_l, n, kSmooth, yVec, priorVec,
+        fits[g].nu, maxIter, tol, &fits[g].logPosterior_l,
+        &fits[g].logLikelihood_l, fits[g].coef_l, &fits[g].tau_l);
+  }
+
+  free(dMat_m);
+  free(dMat_l);
+}
+
+/*
+ * Statistics compared for one df (llr, lpr and tau), and the scale of each
+ * that tolerances are relative to: its own size. The detection decision
+ * rests on llr itself, so its tolerance must not grow with the
+ * log-likelihoods it is a difference of.
+ */
+static void verifyValues(const nuFit * fit, double * values, double * scale)
+{
+  int f;
+
+  values[0] = 2 * (fit->logLikelihood_m - fit->logLikelihood_l);
+  values[1] = fit->logPosterior_m - fit->logPosterior_l;
+  values[2] = fit->tau_m;
+
+  if (scale != NULL)
+  {
+    for (f=0; f<3; f++)
+      scale[f] = fabs(values[f]);
+  }
+}
+
+/*
+ * If the series with this ID is sampled (cfg->verify), refit it by the
+ * reference algorithm and compare with fits, its fitted grid; yVec and
+ * timeVec (rescaled) are as passed to the fit. Differences are relative to
+ * the scales of verifyValues, and for the coefficients, compared as a
+ * vector, to the largest reference coefficient. Differences beyond
+ * tolerance are reported per df on stderr.
+ * Returns 1 if any difference is beyond tolerance, else 0
+ */
+int verifySeries(const fitConfig * cfg, const char * id,
+    double * yVec, int n, double * timeVec, const nuFit * fits)
+{
+  verifyState * verify = cfg->verify;
+  nuFit * ref;
+  int g, f, i, failed = 0, bad[VERIFY_FIELDS];
+  double fast[VERIFY_FIELDS], slow[VERIFY_FIELDS], scale[VERIFY_FIELDS];
+  double absDiff[VERIFY_FIELDS], relDiff[VERIFY_FIELDS];
+  double maxAbs[VERIFY_FIELDS] = {0}, maxRel[VERIFY_FIELDS] = {0};
+
+  if (verify == NULL || !verifySelected(verify, id))
+    return 0;
+
+  ref = allocNuFits(cfg->nuVec, cfg->nNu, cfg->basisCols, cfg->kSmooth);
+  fitNuGridReference(cfg->basisMat, cfg->basisRows, cfg->basisCols,
+      yVec, n, timeVec, cfg->priorVec, cfg->kSmooth, cfg->maxIter, cfg->tol,
+      ref, cfg->nNu);
+
+  for (g=0; g<cfg->nNu; g++)
+  {
+    verifyValues(&fits[g], fast, NULL);
+    verifyValues(&ref[g], slow, scale);
+
+    // Coefficients: largest difference and largest reference value
+    fast[3] = 0;
+    slow[3] = 0;
+    for (i=0; i<cfg->basisCols; i++)
+    {
+      fast[3] = fmax(fast[3], fabs(fits[g].coef_m[i] - ref[g].coef_m[i]));
+      slow[3] = fmax(slow[3], fabs(ref[g].coef_m[i]));
+    }
+    scale[3] = slow[3];
+
+    for (f=0; f<VERIFY_FIELDS; f++)
+    {
+      absDiff[f] = (f == 3) ? fast[f] : fabs(fast[f] - slow[f]);
+      relDiff[f] = (scale[f] != 0) ? absDiff[f] / scale[f] :
+        ((absDiff[f] != 0) ? INFINITY : 0);
+      bad[f] = !(absDiff[f] <= ((f < 2) ? verify->llrTol : verify->absTol) +
+          verify->relTol * scale[f]);
+      maxAbs[f] = fmax(maxAbs[f], absDiff[f]);
+      maxRel[f] = fmax(maxRel[f], relDiff[f]);
+    }
+
+    if (bad[0] || bad[1] || bad[2] || bad[3])
+    {
+      failed = 1;
+      flockfile(stderr);
+      fprintf(stderr, "Verify -- %s df %g beyond tolerance:", id, fits[g].nu);
+      for (f=0; f<VERIFY_FIELDS; f++)
+      {
+        if (!bad[f]) continue;
+        if (f == 3)
+          fprintf(stderr, " coef max diff %g (largest reference %g)",
+              absDiff[f], slow[f]);
+        else
+          fprintf(stderr, " %s %.10g (reference %.10g)",
+              kVerifyFieldNames[f], fast[f], slow[f]);
+      }
+
+      // Which fit reached the higher posterior: a fast path may converge
+      // to another local mode of the t likelihood rather than be wrong
+      fprintf(stderr, "; full-model log-posterior %.10g (reference %.10g)\n",
+          fits[g].logPosterior_m, ref[g].logPosterior_m);
+      funlockfile(stderr);
+    }
+  }
+
+  freeNuFits(ref, cfg->nNu);
+
+  pthread_mutex_lock(&verify->lock);
+  verify->nChecked++;
+  verify->nFailed += failed;
+  for (f=0; f<VERIFY_FIELDS; f++)
+  {
+    verify->maxAbs[f] = fmax(verify->maxAbs[f], maxAbs[f]);
+    verify->maxRel[f] = fmax(verify->maxRel[f], maxRel[f]);
+  }
+  pthread_mutex_unlock(&verify->lock);
+
+  return failed;
+}
+
+// Summary of the series checked so far: counts and largest differences
+void reportVerify(FILE * outfile, const verifyState * verify)
+{
+  int f;
+
+  fprintf(outfile, "verify: %d series checked against the reference fit, "
+      "%d beyond tolerance (rel %g, abs %g, llr %g)\n", verify->nChecked,
+      verify->nFailed, verify->relTol, verify->absTol, verify->llrTol);
+  if (verify->nChecked == 0)
+    return;
+
+  fprintf(outfile, "verify: largest difference (abs/rel)");
+  for (f=0; f<VERIFY_FIELDS; f++)
+  {
+    fprintf(outfile, " %s %.3g/%.3g", kVerifyFieldNames[f],
+        verify->maxAbs[f], verify->maxRel[f]);
+  }
+  fprintf(outfile, "\n");
+}
@@ -15,6 +15,8 @@ int wls(double* X, int n, int k,
   // Initializations
   int i, j;
 
+  TRACE_BEGIN(TRACE_WLS);
+
   // Compute sqw
   for (i=0; i<n; i++)
   {
@@ -37,6 +39,8 @@ int wls(double* X, int n, int k,
   int info;
   info = dposv('u', k, 1, XTX, k, coef, k);
 
+  TRACE_END(TRACE_WLS, (3 * n * k + k * k) * sizeof(double));
+
   //  // Obtain least-squares coefficients via LAPACK DGELS driver routine
   //  int info;
   //  info = dgels('n', n, k, 1, sqwX, n, sqwy, n);
@@ -47,6 +51,166 @@ int wls(double* X, int n, int k,
   return info;
 }
 
+/*
+ * Weighted least squares for repeated solves with the same X and y
+ *
+ * Between EM iterations only the weights change. When they have moved little
+ * since X'WX was last factored, the normal equations are solved by conjugate
+ * gradients preconditioned with that Cholesky factor and started from coef,
+ * which costs a few matrix-vector products instead of a full X'WX rebuild.
+ * The eigenvalues of the preconditioned system lie between the smallest and
+ * largest ratio of new to factored weights, so that ratio bounds the number
+ * of CG iterations; past kWlsMaxCond, or if CG has not converged within its
+ * budget, X'WX is rebuilt and refactored by wls.
+ * Returns info from wls (0 if solved by CG)
+ */
+
+// Largest condition bound of the preconditioned system before rebuilding
+const double kWlsMaxCond = 4;
+
+// Relative residual of the normal equations at which CG stops
+const double kWlsCgTol = 1e-12;
+
+void initWlsCache(wlsCache * cache, int n, int k)
+{
+  cache->n = n;
+  cache->k = k;
+  cache->factored = 0;
+  cache->nRebuild = 0;
+  cache->nCg = 0;
+  cache->nCgIter = 0;
+
+  cache->chol = calloc(k * k, sizeof(double));
+  checkPtr(cache->chol, "out of memory");
+  cache->wFactor = calloc(n, sizeof(double));
+  checkPtr(cache->wFactor, "out of memory");
+  cache->tmp = calloc(n, sizeof(double));
+  checkPtr(cache->tmp, "out of memory");
+  cache->r = calloc(4 * k, sizeof(double));
+  checkPtr(cache->r, "out of memory");
+  cache->z = cache->r + k;
+  cache->p = cache->r + 2 * k;
+  cache->Ap = cache->r + 3 * k;
+}
+
+// Take chol, the factor of X'WX for weights w, as the current factor
+void seedWlsCache(wlsCache * cache, const double * chol, const double * w)
+{
+  memcpy(cache->chol, chol, cache->k * cache->k * sizeof(double));
+  memcpy(cache->wFactor, w, cache->n * sizeof(double));
+  cache->factored = 1;
+}
+
+void freeWlsCache(wlsCache * cache)
+{
+  free(cache->chol);
+  free(cache->wFactor);
+  free(cache->tmp);
+  free(cache->r);
+  cache->chol = cache->wFactor = cache->tmp = NULL;
+  cache->r = cache->z = cache->p = cache->Ap = NULL;
+}
+
+// Ap = X' diag(w) X p
+static void wlsGramProduct(double* X, int n, int k, double* w,
+    double* p, double* tmp, double* Ap)
+{
+  int i;
+
+  dgemv('n', n, k, 1, X, n, p, 1, 0, tmp, 1);
+  for (i=0; i<n; i++)
+  {
+    tmp[i] *= w[i];
+  }
+  dgemv('t', n, k, 1, X, n, tmp, 1, 0, Ap, 1);
+}
+
+int wlsUpdate(double* X, int n, int k,
+    double* y, double* w,
+    double* XTX, double *sqw, double* sqwX, double* sqwy,
+    double* coef, wlsCache * cache)
+{
+  int i, iter, maxCgIter, info;
+  double ratio, ratioMin = 1, ratioMax = 1;
+  double rz, rzOld, alpha, bNorm;
+  double * r = cache->r, * z = cache->z, * p = cache->p, * Ap = cache->Ap;
+  double * tmp = cache->tmp;
+
+  // CG budget: two passes over X per iteration against one X'WX rebuild
+  maxCgIter = k / 8;
+
+  if (cache->factored && maxCgIter > 1)
+  {
+    for (i=0; i<n; i++)
+    {
+      ratio = w[i] / cache->wFactor[i];
+      if (ratio < ratioMin) ratioMin = ratio;
+      if (ratio > ratioMax) ratioMax = ratio;
+    }
+
+    if (ratioMax <= kWlsMaxCond * ratioMin)
+    {
+      TRACE_BEGIN(TRACE_WLS);
+
+      // b = X'Wy; r = b - X'WX coef
+      for (i=0; i<n; i++)
+      {
+        tmp[i] = w[i] * y[i];
+      }
+      dgemv('t', n, k, 1, X, n, tmp, 1, 0, r, 1);
+      bNorm = sqrt(ddot(k, r, 1, r, 1));
+
+      wlsGramProduct(X, n, k, w, coef, tmp, Ap);
+      daxpy(k, -1, Ap, 1, r, 1);
+
+      dcopy(k, r, 1, z, 1);
+      dpotrs('u', k, 1, cache->chol, k, z, k);
+      dcopy(k, z, 1, p, 1);
+      rz = ddot(k, r, 1, z, 1);
+
+      for (iter=0; iter<maxCgIter; iter++)
+      {
+        if (sqrt(ddot(k, r, 1, r, 1)) <= kWlsCgTol * bNorm)
+          break;
+
+        wlsGramProduct(X, n, k, w, p, tmp, Ap);
+        alpha = rz / ddot(k, p, 1, Ap, 1);
+        daxpy(k, alpha, p, 1, coef, 1);
+        daxpy(k, -alpha, Ap, 1, r, 1);
+
+        dcopy(k, r, 1, z, 1);
+        dpotrs('u', k, 1, cache->chol, k, z, k);
+        rzOld = rz;
+        rz = ddot(k, r, 1, z, 1);
+
+        dscal(k, rz / rzOld, p, 1);
+        daxpy(k, 1, z, 1, p, 1);
+      }
+
+      TRACE_END(TRACE_WLS, (iter + 2) * 2 * n * k * sizeof(double));
+
+      cache->nCgIter += iter;
+      if (sqrt(ddot(k, r, 1, r, 1)) <= kWlsCgTol * bNorm)
+      {
+        cache->nCg++;
+        return 0;
+      }
+    }
+  }
+
+  // Full rebuild; keep the Cholesky factor dposv leaves in XTX
+  info = wls(X, n, k, y, w, XTX, sqw, sqwX, sqwy, coef);
+  cache->nRebuild++;
+  cache->factored = (info == 0);
+  if (cache->factored)
+  {
+    dcopy(k * k, XTX, 1, cache->chol, 1);
+    dcopy(n, w, 1, cache->wFactor, 1);
+  }
+
+  return info;
+}
+
 int calcFitted(double* X, int n, int k,
     double* y,
     double* coef,
@@ -63,6 +227,8 @@ int calcResid(double* X, int n, int k,
     double* coef,
     double* resid)
 {
+  TRACE_BEGIN(TRACE_RESID);
+
   // Calculate fitted values; store temporarily in resid
   dgemv('n', n, k, 1, X, n, coef, 1, 0, resid, 1);
 
@@ -70,5 +236,7 @@ int calcResid(double* X, int n, int k,
   dscal(n, -1, resid, 1);
   daxpy(n, 1, y, 1, resid, 1);
 
+  TRACE_END(TRACE_RESID, (n * k + 3 * n) * sizeof(double));
+
   return 0;
 }